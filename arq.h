@@ -0,0 +1,160 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#include "wire.h"
+
+// The retransmission and negotiation rules Protocol and embedded::Protocol
+// share, in fixed storage so the embedded one can use them. Each keeps its
+// own send window and packet layout; what is here is what both must get the
+// same for the two to interwork.
+
+// Retransmission timeout before the first sample, in ms.
+static const uint64_t INITIAL_RETRANSMIT_TIMEOUT = 500;
+
+// Smoothed round trip time and the retransmission timeout derived from it
+// (RFC 6298). srtt is scaled by 8 and rttvar by 4, as in Jacobson's
+// algorithm. srtt is zero until the first sample arrives.
+struct RttEstimator {
+    int64_t srtt;
+    int64_t rttvar;
+    // RTO before backoff.
+    uint64_t rto;
+    uint32_t backoff;
+
+    RttEstimator() : srtt(0) , rttvar(0) , rto(INITIAL_RETRANSMIT_TIMEOUT) , backoff(0) {}
+
+    void sample(uint64_t rtt) {
+        int64_t r = rtt;
+        if (srtt == 0) {
+            srtt = r << 3;
+            rttvar = r << 1;
+        } else {
+            int64_t delta = r - (srtt >> 3);
+            srtt += delta;
+            if (delta < 0) {
+                delta = -delta;
+            }
+            rttvar += delta - (rttvar >> 2);
+        }
+        rto = (srtt >> 3) + rttvar;
+        if (rto < MIN_RETRANSMIT_TIMEOUT) {
+            rto = MIN_RETRANSMIT_TIMEOUT;
+        }
+        if (rto > MAX_RETRANSMIT_TIMEOUT) {
+            rto = MAX_RETRANSMIT_TIMEOUT;
+        }
+    }
+
+    uint64_t smoothed() const {
+        return srtt >> 3;
+    }
+
+    uint64_t timeout() const {
+        uint64_t t = rto << backoff;
+        return t > MAX_RETRANSMIT_TIMEOUT ? MAX_RETRANSMIT_TIMEOUT : t;
+    }
+
+    // after a timer pass that resent something.
+    void backOff() {
+        if (backoff < MAX_BACKOFF_SHIFT) {
+            backoff++;
+        }
+    }
+};
+
+// The attempt number a DATA packet sent sends times before carries. It
+// stops at 0xfe, as 0xff marks ACKs that aren't RTT samples, and is always
+// 0 for a peer that didn't agree to OPT_ATTEMPTS.
+static inline uint8_t sendAttempt(uint32_t sends, bool attemptsOn) {
+    if (!attemptsOn) {
+        return 0;
+    }
+    return sends < 0xfe ? sends : 0xfe;
+}
+
+// Whether an ACK naming a packet, and echoing attempt, times its latest
+// copy. A peer that doesn't take attempt numbers sees every copy as attempt
+// 0, so then only packets sent once are samples (Karn's algorithm).
+static inline bool isRttSample(uint8_t attempt, uint8_t latest, uint32_t sends, bool attemptsOn) {
+    return attempt == latest && (attemptsOn || sends == 1);
+}
+
+// Walks the option, length, value triples of a CON or CONACK, stopping at
+// one that runs past the end.
+class OptionReader {
+
+    public:
+        OptionReader(const uint8_t * data, size_t n) : opt(0) , len(0) , value(NULL) , p(data) , end(data + n) {}
+
+        bool next() {
+            if (end - p < 2 || end - p - 2 < p[1]) {
+                return false;
+            }
+            opt = p[0];
+            len = p[1];
+            value = p + 2;
+            p += 2 + len;
+            return true;
+        }
+
+        uint8_t opt;
+        uint8_t len;
+        const uint8_t * value;
+
+    private:
+        const uint8_t * p;
+        const uint8_t * end;
+};
+
+// The options every implementation takes the same way: OPT_ATTEMPTS and
+// OPT_PIGGYBACK, which both always offer, and the peer's OPT_LIMITS, which
+// bound what we send it for the connection.
+struct SharedOptions {
+    bool attempts;
+    bool piggyback;
+    uint32_t peerPayload;
+    uint32_t peerWindow;
+
+    // the most either of ours writes.
+    static const size_t SIZE = 4;
+
+    SharedOptions() {
+        reset();
+    }
+
+    void reset() {
+        attempts = false;
+        piggyback = false;
+        peerPayload = MAX_PAYLOAD_SIZE;
+        peerWindow = MAX_WINDOW_SIZE;
+    }
+
+    void apply(const OptionReader & option) {
+        if (option.opt == OPT_ATTEMPTS) {
+            attempts = true;
+        }
+        if (option.opt == OPT_PIGGYBACK) {
+            piggyback = true;
+        }
+        if (option.opt == OPT_LIMITS && option.len >= 3) {
+            uint32_t payload = option.value[0] | (option.value[1] << 8);
+            peerPayload = payload < MIN_PAYLOAD_SIZE ? MIN_PAYLOAD_SIZE : payload > MAX_PAYLOAD_SIZE ? MAX_PAYLOAD_SIZE : payload;
+            peerWindow = option.value[2] ? option.value[2] : 1;
+        }
+    }
+
+    // Ours for a CON, or those agreed for a CONACK, returning their length.
+    size_t write(uint8_t * out, bool agreed) const {
+        size_t n = 0;
+        if (!agreed || attempts) {
+            out[n++] = OPT_ATTEMPTS;
+            out[n++] = 0;
+        }
+        if (!agreed || piggyback) {
+            out[n++] = OPT_PIGGYBACK;
+            out[n++] = 0;
+        }
+        return n;
+    }
+};
@@ -1,115 +1,322 @@
-#include "base64.h"
-#include <iostream>
-
-static const std::string base64_chars = 
-             "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-             "abcdefghijklmnopqrstuvwxyz"
-             "0123456789+/";
-
-
-static inline bool is_base64(BYTE c) {
-  return (isalnum(c) || (c == '+') || (c == '/'));
-}
-
-std::string b64encode(const std::vector<BYTE> & buff) {
-  std::string ret;
-  int i = 0;
-  int j = 0;
-  BYTE char_array_3[3];
-  BYTE char_array_4[4];
-  
-  std::vector<BYTE>::const_iterator buffiter = buff.begin();
-
-  while (buffiter != buff.end()) {
-    char_array_3[i++] = *(buffiter++);
-    if (i == 3) {
-      char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-      char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-      char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
-      char_array_4[3] = char_array_3[2] & 0x3f;
-
-      for(i = 0; (i <4) ; i++)
-        ret += base64_chars[char_array_4[i]];
-      i = 0;
-    }
-  }
-
-  if (i)
-  {
-    for(j = i; j < 3; j++)
-      char_array_3[j] = '\0';
-
-    char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-    char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-    char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
-    char_array_4[3] = char_array_3[2] & 0x3f;
-
-    for (j = 0; (j < i + 1); j++)
-      ret += base64_chars[char_array_4[j]];
-
-    while((i++ < 3))
-      ret += '=';
-  }
-
-  return ret;
-}
-
-std::string b64encode(const std::string & buff) {
-    std::vector<BYTE> vbuff(buff.begin(),buff.end());
-    return b64encode(vbuff);
-}
-
-std::vector<BYTE> b64encode_v(const std::vector<BYTE> & vbuff) {
-    std::string ret = b64encode(vbuff);
-    return std::vector<BYTE>(ret.begin(),ret.end());
-}
-
-std::string b64decode_s(const std::string & encoded_string) {
-    std::vector<BYTE> ret = b64decode(encoded_string);
-    return std::string(ret.begin(),ret.end());
-}
-
-std::vector<BYTE> b64decode(const std::string & encoded_string) {
-    return b64decode(std::vector<BYTE>(encoded_string.begin(),encoded_string.end()));
-}
-
-std::vector<BYTE> b64decode(const std::vector<BYTE> & encoded_string) {
-  int in_len = encoded_string.size();
-  int i = 0;
-  int j = 0;
-  int in_ = 0;
-  BYTE char_array_4[4], char_array_3[3];
-  std::vector<BYTE> ret;
-
-  while (in_len-- && ( encoded_string[in_] != '=') && is_base64(encoded_string[in_])) {
-    char_array_4[i++] = encoded_string[in_]; in_++;
-    if (i ==4) {
-      for (i = 0; i <4; i++)
-        char_array_4[i] = base64_chars.find(char_array_4[i]);
-
-      char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-      char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-      char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-      for (i = 0; (i < 3); i++)
-          ret.push_back(char_array_3[i]);
-      i = 0;
-    }
-  }
-
-  if (i) {
-    for (j = i; j <4; j++)
-      char_array_4[j] = 0;
-
-    for (j = 0; j <4; j++)
-      char_array_4[j] = base64_chars.find(char_array_4[j]);
-
-    char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-    char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-    char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-    for (j = 0; (j < i - 1); j++) ret.push_back(char_array_3[j]);
-  }
-
-  return ret;
-}
+#include "base64.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define B64_X86 1
+#endif
+
+static const uint8_t encodeTable[65] =
+             "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+             "abcdefghijklmnopqrstuvwxyz"
+             "0123456789+/";
+
+// Sextet for each character, 0xff for anything outside the alphabet
+// including padding.
+struct DecodeTable {
+    uint8_t value[256];
+    DecodeTable() {
+        memset(value,0xff,sizeof(value));
+        for(int i = 0; i < 64 ; i++) {
+            value[encodeTable[i]] = i;
+        }
+    }
+};
+
+static const DecodeTable decodeTable;
+
+// Scalar
+
+static size_t encodeScalar(const uint8_t * in, size_t n, uint8_t * out) {
+    uint8_t * o = out;
+    size_t i = 0;
+
+    for(; i + 3 <= n; i += 3) {
+        uint32_t v = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+        o[0] = encodeTable[v >> 18];
+        o[1] = encodeTable[(v >> 12) & 0x3f];
+        o[2] = encodeTable[(v >> 6) & 0x3f];
+        o[3] = encodeTable[v & 0x3f];
+        o += 4;
+    }
+
+    if (i < n) {
+        uint32_t v = in[i] << 16;
+        if (i + 1 < n) {
+            v |= in[i + 1] << 8;
+        }
+        o[0] = encodeTable[v >> 18];
+        o[1] = encodeTable[(v >> 12) & 0x3f];
+        o[2] = i + 1 < n ? encodeTable[(v >> 6) & 0x3f] : '=';
+        o[3] = '=';
+        o += 4;
+    }
+    return o - out;
+}
+
+// Whole groups first. The group holding the first bad character, or the
+// short one at the end, gives one byte fewer than its good characters.
+static size_t decodeScalar(const uint8_t * in, size_t n, uint8_t * out) {
+    const uint8_t * t = decodeTable.value;
+    uint8_t * o = out;
+    size_t i = 0;
+
+    for(; i + 4 <= n; i += 4) {
+        uint32_t a = t[in[i]];
+        uint32_t b = t[in[i + 1]];
+        uint32_t c = t[in[i + 2]];
+        uint32_t d = t[in[i + 3]];
+        if ((a | b | c | d) & 0x80) {
+            break;
+        }
+        uint32_t v = (a << 18) | (b << 12) | (c << 6) | d;
+        o[0] = v >> 16;
+        o[1] = v >> 8;
+        o[2] = v;
+        o += 3;
+    }
+
+    uint32_t v = 0;
+    size_t k = 0;
+    while (k < 3 && i + k < n && t[in[i + k]] != 0xff) {
+        v |= t[in[i + k]] << (18 - 6 * k);
+        k++;
+    }
+    for(size_t j = 0; j + 1 < k; j++) {
+        *o++ = v >> (16 - 8 * j);
+    }
+    return o - out;
+}
+
+// SIMD kernels. These take whole blocks from the front of the input and
+// return how many input bytes they consumed, leaving the rest, and any block
+// with a bad character in it, to the scalar code. They read and write a few
+// bytes past the block they are working on, so stop short of the end.
+// After W. Mula and D. Lemire, "Faster Base64 Encoding and Decoding using
+// AVX2 Instructions".
+
+#ifdef B64_X86
+
+// 3 bytes in each 4 byte lane, spread to four 6 bit indices, one per byte.
+__attribute__((target("ssse3")))
+static inline __m128i splitSsse3(__m128i v) {
+    v = _mm_shuffle_epi8(v,_mm_set_epi8(10,11,9,10,7,8,6,7,4,5,3,4,1,2,0,1));
+    __m128i ac = _mm_mulhi_epu16(_mm_and_si128(v,_mm_set1_epi32(0x0fc0fc00)),_mm_set1_epi32(0x04000040));
+    __m128i bd = _mm_mullo_epi16(_mm_and_si128(v,_mm_set1_epi32(0x003f03f0)),_mm_set1_epi32(0x01000010));
+    return _mm_or_si128(ac,bd);
+}
+
+// Index to character by adding an offset looked up per range of indices.
+__attribute__((target("ssse3")))
+static inline __m128i toAsciiSsse3(__m128i idx) {
+    const __m128i offsets = _mm_setr_epi8('a' - 26,'0' - 52,'0' - 52,'0' - 52,'0' - 52,'0' - 52,'0' - 52,
+                                          '0' - 52,'0' - 52,'0' - 52,'0' - 52,'+' - 62,'/' - 63,'A',0,0);
+    __m128i range = _mm_subs_epu8(idx,_mm_set1_epi8(51));
+    range = _mm_or_si128(range,_mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26),idx),_mm_set1_epi8(13)));
+    return _mm_add_epi8(idx,_mm_shuffle_epi8(offsets,range));
+}
+
+__attribute__((target("ssse3")))
+static size_t encodeSsse3(const uint8_t * in, size_t n, uint8_t * out) {
+    size_t i = 0;
+    for(; i + 16 <= n; i += 12) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i / 3 * 4),toAsciiSsse3(splitSsse3(v)));
+    }
+    return i;
+}
+
+// Valid characters are found by looking up a bitmap of allowed high nibbles
+// by low nibble, and turned into indices by an offset per high nibble, with
+// '/' the one character that needs its own.
+__attribute__((target("ssse3")))
+static size_t decodeSsse3(const uint8_t * in, size_t n, uint8_t * out) {
+    const __m128i allowed = _mm_setr_epi8(0xa8,0xf8,0xf8,0xf8,0xf8,0xf8,0xf8,0xf8,
+                                          0xf8,0xf8,0xf0,0x54,0x50,0x50,0x50,0x54);
+    const __m128i bits = _mm_setr_epi8(0x01,0x02,0x04,0x08,0x10,0x20,0x40,0x80,0,0,0,0,0,0,0,0);
+    const __m128i offsets = _mm_setr_epi8(0,0,19,4,-65,-65,-71,-71,0,0,0,0,0,0,0,0);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for(; i + 24 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+        __m128i hi = _mm_and_si128(_mm_srli_epi32(v,4),nibble);
+        __m128i lo = _mm_and_si128(v,nibble);
+        __m128i ok = _mm_and_si128(_mm_shuffle_epi8(allowed,lo),_mm_shuffle_epi8(bits,hi));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(ok,_mm_setzero_si128()))) {
+            break;
+        }
+        __m128i slash = _mm_and_si128(_mm_cmpeq_epi8(v,_mm_set1_epi8('/')),_mm_set1_epi8(-3));
+        v = _mm_add_epi8(v,_mm_add_epi8(_mm_shuffle_epi8(offsets,hi),slash));
+        v = _mm_maddubs_epi16(v,_mm_set1_epi32(0x01400140));
+        v = _mm_madd_epi16(v,_mm_set1_epi32(0x00011000));
+        v = _mm_shuffle_epi8(v,_mm_setr_epi8(2,1,0,6,5,4,10,9,8,14,13,12,-1,-1,-1,-1));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i / 4 * 3),v);
+    }
+    return i;
+}
+
+// The same, with a 12 byte or 16 character block in each 128 bit lane.
+
+__attribute__((target("avx2")))
+static inline __m256i lanes(__m128i v) {
+    return _mm256_broadcastsi128_si256(v);
+}
+
+__attribute__((target("avx2")))
+static size_t encodeAvx2(const uint8_t * in, size_t n, uint8_t * out) {
+    const __m256i split = lanes(_mm_set_epi8(10,11,9,10,7,8,6,7,4,5,3,4,1,2,0,1));
+    const __m256i offsets = lanes(_mm_setr_epi8('a' - 26,'0' - 52,'0' - 52,'0' - 52,'0' - 52,'0' - 52,'0' - 52,
+                                                '0' - 52,'0' - 52,'0' - 52,'0' - 52,'+' - 62,'/' - 63,'A',0,0));
+    size_t i = 0;
+    for(; i + 28 <= n; i += 24) {
+        __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+        __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i + 12));
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo),hi,1);
+        v = _mm256_shuffle_epi8(v,split);
+        __m256i ac = _mm256_mulhi_epu16(_mm256_and_si256(v,_mm256_set1_epi32(0x0fc0fc00)),_mm256_set1_epi32(0x04000040));
+        __m256i bd = _mm256_mullo_epi16(_mm256_and_si256(v,_mm256_set1_epi32(0x003f03f0)),_mm256_set1_epi32(0x01000010));
+        __m256i idx = _mm256_or_si256(ac,bd);
+        __m256i range = _mm256_subs_epu8(idx,_mm256_set1_epi8(51));
+        range = _mm256_or_si256(range,_mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26),idx),_mm256_set1_epi8(13)));
+        v = _mm256_add_epi8(idx,_mm256_shuffle_epi8(offsets,range));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i / 3 * 4),v);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t decodeAvx2(const uint8_t * in, size_t n, uint8_t * out) {
+    const __m256i allowed = lanes(_mm_setr_epi8(0xa8,0xf8,0xf8,0xf8,0xf8,0xf8,0xf8,0xf8,
+                                                0xf8,0xf8,0xf0,0x54,0x50,0x50,0x50,0x54));
+    const __m256i bits = lanes(_mm_setr_epi8(0x01,0x02,0x04,0x08,0x10,0x20,0x40,0x80,0,0,0,0,0,0,0,0));
+    const __m256i offsets = lanes(_mm_setr_epi8(0,0,19,4,-65,-65,-71,-71,0,0,0,0,0,0,0,0));
+    const __m256i pack = lanes(_mm_setr_epi8(2,1,0,6,5,4,10,9,8,14,13,12,-1,-1,-1,-1));
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for(; i + 48 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi32(v,4),nibble);
+        __m256i lo = _mm256_and_si256(v,nibble);
+        __m256i ok = _mm256_and_si256(_mm256_shuffle_epi8(allowed,lo),_mm256_shuffle_epi8(bits,hi));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(ok,_mm256_setzero_si256()))) {
+            break;
+        }
+        __m256i slash = _mm256_and_si256(_mm256_cmpeq_epi8(v,_mm256_set1_epi8('/')),_mm256_set1_epi8(-3));
+        v = _mm256_add_epi8(v,_mm256_add_epi8(_mm256_shuffle_epi8(offsets,hi),slash));
+        v = _mm256_maddubs_epi16(v,_mm256_set1_epi32(0x01400140));
+        v = _mm256_madd_epi16(v,_mm256_set1_epi32(0x00011000));
+        v = _mm256_shuffle_epi8(v,pack);
+        v = _mm256_permutevar8x32_epi32(v,_mm256_setr_epi32(0,1,2,4,5,6,7,7));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i / 4 * 3),v);
+    }
+    return i;
+}
+
+#endif
+
+// Dispatch
+
+typedef size_t (*BulkFunc)(const uint8_t * in, size_t n, uint8_t * out);
+
+static size_t noBulk(const uint8_t *, size_t, uint8_t *) {
+    return 0;
+}
+
+static B64Kernel currentKernel = B64_SCALAR;
+static BulkFunc encodeBulk = noBulk;
+static BulkFunc decodeBulk = noBulk;
+
+bool b64setKernel(B64Kernel kernel) {
+    BulkFunc encode = noBulk;
+    BulkFunc decode = noBulk;
+
+#ifdef B64_X86
+    __builtin_cpu_init();
+    if (kernel == B64_SSSE3) {
+        if (!__builtin_cpu_supports("ssse3")) {
+            return false;
+        }
+        encode = encodeSsse3;
+        decode = decodeSsse3;
+    }
+    if (kernel == B64_AVX2) {
+        if (!__builtin_cpu_supports("avx2")) {
+            return false;
+        }
+        encode = encodeAvx2;
+        decode = decodeAvx2;
+    }
+#else
+    if (kernel != B64_SCALAR) {
+        return false;
+    }
+#endif
+
+    currentKernel = kernel;
+    encodeBulk = encode;
+    decodeBulk = decode;
+    return true;
+}
+
+B64Kernel b64kernel() {
+    return currentKernel;
+}
+
+struct PickKernel {
+    PickKernel() {
+        if (!b64setKernel(B64_AVX2)) {
+            b64setKernel(B64_SSSE3);
+        }
+    }
+};
+
+static PickKernel pickKernel;
+
+size_t b64encode(const uint8_t * in, size_t n, uint8_t * out) {
+    size_t done = encodeBulk(in,n,out);
+    return done / 3 * 4 + encodeScalar(in + done,n - done,out + done / 3 * 4);
+}
+
+size_t b64decode(const uint8_t * in, size_t n, uint8_t * out) {
+    size_t done = decodeBulk(in,n,out);
+    return done / 4 * 3 + decodeScalar(in + done,n - done,out + done / 4 * 3);
+}
+
+// Wrappers
+
+std::string b64encode(const std::vector<BYTE> & buff) {
+    std::vector<BYTE> ret = b64encode_v(buff);
+    return std::string(ret.begin(),ret.end());
+}
+
+std::string b64encode(const std::string & buff) {
+    std::vector<BYTE> vbuff(buff.begin(),buff.end());
+    return b64encode(vbuff);
+}
+
+std::vector<BYTE> b64encode_v(const std::vector<BYTE> & vbuff) {
+    std::vector<BYTE> ret(b64encodedSize(vbuff.size()));
+    if (!vbuff.empty()) {
+        b64encode(&vbuff[0],vbuff.size(),&ret[0]);
+    }
+    return ret;
+}
+
+std::string b64decode_s(const std::string & encoded_string) {
+    std::vector<BYTE> ret = b64decode(encoded_string);
+    return std::string(ret.begin(),ret.end());
+}
+
+std::vector<BYTE> b64decode(const std::string & encoded_string) {
+    return b64decode(std::vector<BYTE>(encoded_string.begin(),encoded_string.end()));
+}
+
+std::vector<BYTE> b64decode(const std::vector<BYTE> & encoded_string) {
+    std::vector<BYTE> ret(b64decodedSize(encoded_string.size()));
+    if (!encoded_string.empty()) {
+        ret.resize(b64decode(&encoded_string[0],encoded_string.size(),&ret[0]));
+    }
+    return ret;
+}
@@ -1,14 +1,44 @@
-#pragma once
-#include <vector>
-#include <string>
-#include <stdint.h>
-typedef uint8_t BYTE;
-
-std::string b64encode(const std::vector<BYTE> & buff);
-std::string b64encode(const std::string & buff);
-std::vector<BYTE> b64encode_v(const std::vector<BYTE> & buff);
-
-std::vector<BYTE> b64decode(const std::string & encoded_string);
-std::vector<BYTE> b64decode(const std::vector<BYTE> & encoded_string);
-std::string b64decode_s(const std::string & encoded_string);
-
+#pragma once
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include <stddef.h>
+typedef uint8_t BYTE;
+
+std::string b64encode(const std::vector<BYTE> & buff);
+std::string b64encode(const std::string & buff);
+std::vector<BYTE> b64encode_v(const std::vector<BYTE> & buff);
+
+std::vector<BYTE> b64decode(const std::string & encoded_string);
+std::vector<BYTE> b64decode(const std::vector<BYTE> & encoded_string);
+std::string b64decode_s(const std::string & encoded_string);
+
+// Characters needed to encode n bytes, with padding.
+static inline size_t b64encodedSize(size_t n) {
+    return (n + 2) / 3 * 4;
+}
+
+// Room needed to decode n characters.
+static inline size_t b64decodedSize(size_t n) {
+    return (n + 3) / 4 * 3;
+}
+
+// Encodes n bytes into out, which must have room for b64encodedSize(n), and
+// returns the number of characters written.
+size_t b64encode(const uint8_t * in, size_t n, uint8_t * out);
+
+// Decodes up to the first padding or non base64 character into out, which
+// must have room for b64decodedSize(n), and returns the number of bytes
+// written.
+size_t b64decode(const uint8_t * in, size_t n, uint8_t * out);
+
+// The kernels the codec can run on. The best one the CPU supports is picked
+// at startup; tests and benchmarks may pick another.
+enum B64Kernel {
+    B64_SCALAR,
+    B64_SSSE3,
+    B64_AVX2
+};
+
+bool b64setKernel(B64Kernel kernel);
+B64Kernel b64kernel();
@@ -0,0 +1,623 @@
+#include "protocol.h"
+#include "fec.h"
+#include "compress.h"
+#include "base64.h"
+#include "crc.h"
+#include "embedded.h"
+#include "uring.h"
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <algorithm>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+// Throughput benchmarks for the hot paths. Results are compared against the
+// byte rate of a 2 Mbaud 8N1 line, which is the fastest link we drive.
+
+static const double LINE_RATE = 2000000.0 / 10;
+
+// Every heap allocation in the process, so benchmarks can report how many
+// each packet costs.
+static size_t allocations = 0;
+
+void * operator new(size_t n) {
+    allocations++;
+    void * p = malloc(n);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void * p) throw() {
+    free(p);
+}
+
+void operator delete(void * p, size_t) throw() {
+    free(p);
+}
+
+static double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char * name, double bytes, double seconds) {
+    double rate = bytes / seconds;
+    printf("%-28s %10.1f MB/s  %8.1fx 2Mbaud\n",name,rate / 1e6,rate / LINE_RATE);
+}
+
+
+void benchParityRebuild() {
+    const uint32_t group = 4;
+    const uint32_t size = 1024;
+    std::vector<std::vector<uint8_t> > payloads(group,std::vector<uint8_t>(size));
+    for(uint32_t i = 0; i < group; i++) {
+        for(uint32_t j = 0; j < size; j++) {
+            payloads[i][j] = i * 31 + j;
+        }
+    }
+    
+    ParityAccumulator acc;
+    for(uint32_t i = 0; i < group; i++) {
+        acc.add(payloads[i]);
+    }
+    std::vector<uint8_t> parity = acc.encode();
+    
+    const int rounds = 200000;
+    double start = nowSeconds();
+    size_t check = 0;
+    for(int r = 0; r < rounds; r++) {
+        ParityAccumulator fix(parity);
+        for(uint32_t i = 1; i < group; i++) {
+            fix.add(payloads[i]);
+        }
+        check += fix.payload().size();
+    }
+    double elapsed = nowSeconds() - start;
+    if (check != rounds * size) {
+        printf("parity rebuild gave the wrong result\n");
+    }
+    report("fec parity rebuild",(double)rounds * size * group,elapsed);
+}
+
+// Whole receive path with FEC on: framing, checksum, parity upkeep and one
+// rebuilt packet in every group.
+void benchFecReceive() {
+    Protocol a;
+    Protocol b;
+    a.setFec(4,2);
+    b.setFec(4,2);
+    a.setWindowSize(MAX_WINDOW_SIZE);
+    
+    b.listen();
+    std::vector<uint8_t> wire = a.connect(0);
+    wire = b.dataEvent(wire,0).first;
+    a.dataEvent(wire,0);
+    
+    std::vector<ProtocolPacket> frames;
+    std::string chunk(1024,'x');
+    size_t sent = 0;
+    while (a.readyForData()) {
+        std::vector<ProtocolPacket> out = a._sendData(chunk.c_str(),0);
+        frames.insert(frames.end(),out.begin(),out.end());
+        sent += chunk.size();
+    }
+    
+    // lose one packet from each group
+    std::vector<uint8_t> encoded;
+    for(size_t i = 0; i < frames.size(); i++) {
+        if (frames[i].type == TYPE_DATA && ((frames[i].seqnum % 8) == 1 || (frames[i].seqnum % 8) == 2)) {
+            continue;
+        }
+        std::vector<uint8_t> f = encodePacket(frames[i]);
+        encoded.insert(encoded.end(),f.begin(),f.end());
+    }
+    
+    const int rounds = 200;
+    size_t delivered = 0;
+    double start = nowSeconds();
+    for(int r = 0; r < rounds; r++) {
+        Protocol rx = b;
+        delivered += rx.dataEvent(encoded,1,true).second.size();
+    }
+    double elapsed = nowSeconds() - start;
+    if (delivered != rounds * sent) {
+        printf("fec receive lost data\n");
+    }
+    report("fec receive path",(double)delivered,elapsed);
+}
+
+
+// Shell output style text cut into packets, compressed and decompressed as a
+// stream.
+void benchCompression() {
+    std::string text;
+    for(int i = 0; text.size() < 1000000; i++) {
+        char line[128];
+        snprintf(line,sizeof(line),"Oct 17 19:%02d:%02d host kernel: [%8d.%06d] eth0: link up, %d Mbps\n",
+                 (i / 60) % 60,i % 60,i / 7,(i * 7919) % 1000000,(i % 3) ? 100 : 1000);
+        text += line;
+    }
+    
+    const size_t packet = 256;
+    StreamCompressor c;
+    std::vector<std::vector<uint8_t> > coded;
+    std::vector<bool> isCompressed;
+    
+    double start = nowSeconds();
+    for(size_t off = 0; off < text.size(); off += packet) {
+        size_t n = std::min(packet,text.size() - off);
+        std::vector<uint8_t> out;
+        bool z = c.compress((const uint8_t *)text.data() + off,n,out);
+        if (!z) {
+            out.assign(text.begin() + off,text.begin() + off + n);
+        }
+        coded.push_back(out);
+        isCompressed.push_back(z);
+    }
+    double elapsed = nowSeconds() - start;
+    report("compress",text.size(),elapsed);
+    
+    StreamDecompressor d;
+    std::vector<uint8_t> plain;
+    plain.reserve(text.size());
+    start = nowSeconds();
+    for(size_t i = 0; i < coded.size(); i++) {
+        if (isCompressed[i]) {
+            d.decompress(&coded[i][0],coded[i].size(),plain,MAX_PAYLOAD_SIZE);
+        } else {
+            d.addRaw(&coded[i][0],coded[i].size());
+            plain.insert(plain.end(),coded[i].begin(),coded[i].end());
+        }
+    }
+    elapsed = nowSeconds() - start;
+    if (std::string(plain.begin(),plain.end()) != text) {
+        printf("decompress gave the wrong result\n");
+    }
+    report("decompress",text.size(),elapsed);
+    
+    const CompressionStats & st = c.stats();
+    printf("%-28s %10.2f ratio   %8.1f ns/byte\n","compression",
+           (double)st.plainBytes / st.codedBytes,(double)st.nanos / st.plainBytes);
+}
+
+
+// One direction of a bulk transfer with ACKs coming back, in steady state.
+// Packet level leaves out the wire encoding, framing and checksums.
+static void benchAllocations(const char * name, bool wire) {
+    Protocol a;
+    Protocol b;
+    a.setWindowSize(32);
+    
+    b.listen();
+    std::vector<uint8_t> bytes = a.connect(0);
+    bytes = b.dataEvent(bytes,0).first;
+    a.dataEvent(bytes,0);
+    
+    std::vector<uint8_t> chunk(1024,'x');
+    std::vector<ProtocolPacket> out;
+    std::vector<ProtocolPacket> back;
+    std::vector<uint8_t> toB;
+    std::vector<uint8_t> toA;
+    std::vector<uint8_t> data;
+    std::vector<uint8_t> spare;
+    
+    const int warmup = 2000;
+    const int rounds = 20000;
+    size_t before = 0;
+    uint32_t firstSeq = 0;
+    
+    for(int r = 0; r < warmup + rounds; r++) {
+        if (r == warmup) {
+            before = allocations;
+            firstSeq = a.seqnum;
+        }
+        uint64_t now = 1 + r;
+        data.clear();
+        if (wire) {
+            toB.clear();
+            toA.clear();
+            if (a.readyForData()) {
+                a.sendData(0,&chunk[0],chunk.size(),now,toB);
+            }
+            a.timerEvent(now,toB);
+            b.dataEvent(toB.empty() ? NULL : &toB[0],toB.size(),now,true,toA,data);
+            b.timerEvent(now,toA);
+            a.dataEvent(toA.empty() ? NULL : &toA[0],toA.size(),now,false,toB,spare);
+        } else {
+            out.clear();
+            back.clear();
+            if (a.readyForData()) {
+                a._sendData(0,&chunk[0],chunk.size(),now,out);
+            }
+            a._timerEvent(now,out);
+            VectorSink dataSink(data);
+            VectorSink spareSink(spare);
+            for(size_t i = 0; i < out.size(); i++) {
+                b._packetEvent(out[i],now,true,back,dataSink);
+            }
+            b._timerEvent(now,back);
+            out.clear();
+            for(size_t i = 0; i < back.size(); i++) {
+                a._packetEvent(back[i],now,false,out,spareSink);
+            }
+        }
+    }
+    
+    uint32_t packets = a.seqnum - firstSeq;
+    printf("%-28s %10.2f allocs/packet  %6u packets\n",name,(double)(allocations - before) / packets,packets);
+}
+
+
+// Packet sized encodes and decodes into the same buffers, on each kernel the
+// CPU supports.
+void benchBase64() {
+    B64Kernel original = b64kernel();
+    B64Kernel kernels[] = { B64_SCALAR, B64_SSSE3, B64_AVX2 };
+    const char * names[] = { "scalar", "ssse3", "avx2" };
+    
+    std::vector<uint8_t> raw(1024 + PACKET_OVERHEAD);
+    for(size_t i = 0; i < raw.size(); i++) {
+        raw[i] = i * 131 + 7;
+    }
+    std::vector<uint8_t> text(b64encodedSize(raw.size()));
+    std::vector<uint8_t> back(b64decodedSize(text.size()));
+    
+    for(int k = 0; k < 3; k++) {
+        if (!b64setKernel(kernels[k])) {
+            continue;
+        }
+        const int rounds = 200000;
+        char name[64];
+        
+        double start = nowSeconds();
+        size_t check = 0;
+        for(int r = 0; r < rounds; r++) {
+            raw[0] = r;
+            check += b64encode(&raw[0],raw.size(),&text[0]);
+        }
+        double elapsed = nowSeconds() - start;
+        snprintf(name,sizeof(name),"base64 encode %s",names[k]);
+        report(name,(double)rounds * raw.size(),elapsed);
+        
+        start = nowSeconds();
+        for(int r = 0; r < rounds; r++) {
+            text[0] = 'A' + (r & 15);
+            check += b64decode(&text[0],text.size(),&back[0]);
+        }
+        elapsed = nowSeconds() - start;
+        snprintf(name,sizeof(name),"base64 decode %s",names[k]);
+        report(name,(double)rounds * raw.size(),elapsed);
+        
+        if (check != (size_t)rounds * (text.size() + raw.size()) || back[1] != raw[1]) {
+            printf("base64 gave the wrong result\n");
+        }
+    }
+    b64setKernel(original);
+}
+
+
+// Keeps the checksum loops from being optimised away.
+static volatile uint32_t crcSink;
+
+// Frame checksums over packet sized frames, on each kernel.
+void benchChecksum() {
+    CrcKernel original = crcKernel();
+    CrcKernel kernels[] = { CRC_SLICING, CRC_HARDWARE };
+    const char * names[] = { "slicing", "hardware" };
+    
+    std::vector<uint8_t> frame(1024 + PACKET_OVERHEAD);
+    for(size_t i = 0; i < frame.size(); i++) {
+        frame[i] = i * 131 + 7;
+    }
+    
+    for(int k = 0; k < 2; k++) {
+        if (!crcSetKernel(kernels[k])) {
+            continue;
+        }
+        const int rounds = 500000;
+        char name[64];
+        uint32_t check = 0;
+        
+        double start = nowSeconds();
+        for(int r = 0; r < rounds; r++) {
+            frame[0] = r;
+            check ^= crc32(&frame[0],frame.size());
+        }
+        double elapsed = nowSeconds() - start;
+        snprintf(name,sizeof(name),"crc32 %s",names[k]);
+        report(name,(double)rounds * frame.size(),elapsed);
+        
+        start = nowSeconds();
+        for(int r = 0; r < rounds; r++) {
+            frame[0] = r;
+            check ^= crc32c(&frame[0],frame.size());
+        }
+        elapsed = nowSeconds() - start;
+        snprintf(name,sizeof(name),"crc32c %s",names[k]);
+        report(name,(double)rounds * frame.size(),elapsed);
+        
+        crcSink = check;
+    }
+    crcSetKernel(original);
+}
+
+
+// Encoding a DATA packet for the wire, afresh and as a retransmission from
+// the frame kept at its first send.
+void benchEncode() {
+    Protocol p;
+    p.state = STATE_CONNECTED;
+    p.pingInterval = 1000000;
+    std::vector<uint8_t> payload(1024);
+    for(size_t i = 0; i < payload.size(); i++) {
+        payload[i] = i * 131 + 7;
+    }
+    std::vector<uint8_t> out;
+    p.sendData(0,&payload[0],payload.size(),0,out);
+    
+    std::vector<ProtocolPacket> packets(1,p.sendWindow.front().packet);
+    VectorSink sink(out);
+    const int rounds = 200000;
+    
+    double start = nowSeconds();
+    for(int r = 0; r < rounds; r++) {
+        packets[0].attempt = r;
+        out.clear();
+        encodePacket(packets[0],out,FRAMING_BASE64);
+    }
+    report("encode fresh",(double)rounds * payload.size(),nowSeconds() - start);
+    
+    start = nowSeconds();
+    for(int r = 0; r < rounds; r++) {
+        packets[0].attempt = r;
+        out.clear();
+        p._encode(packets,sink);
+    }
+    report("encode resend",(double)rounds * payload.size(),nowSeconds() - start);
+}
+
+// The tunnel's I/O on its own: bytes arriving on one pipe in 256 byte
+// chunks, as from a UART, relayed to another, in the way each of the proxy
+// loops does it. Counts are for the relaying thread only.
+static const size_t RELAY_BYTES = 32 << 20;
+static const size_t RELAY_CHUNK = 256;
+
+static void * relayFeed(void * arg) {
+    int fd = *(int *)arg;
+    uint8_t chunk[RELAY_CHUNK] = { 0 };
+    for(size_t sent = 0; sent < RELAY_BYTES; sent += RELAY_CHUNK) {
+        if (write(fd,chunk,RELAY_CHUNK) != (ssize_t)RELAY_CHUNK) {
+            break;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+static void * relayDrain(void * arg) {
+    int fd = *(int *)arg;
+    uint8_t buff[65536];
+    while (read(fd,buff,sizeof(buff)) > 0) {
+    }
+    return NULL;
+}
+
+static double threadCpuSeconds() {
+    struct rusage ru;
+    getrusage(RUSAGE_THREAD,&ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+// As Proxy: edge triggered, one read and one write a round, and a wait
+// between rounds unless something is still ready.
+static size_t relayEpoll(int in, int out, size_t & syscalls) {
+    int ep = epoll_create1(0);
+    struct epoll_event e;
+    bool readable = false;
+    bool writable = false;
+    e.events = EPOLLIN | EPOLLET;
+    e.data.u32 = 0;
+    epoll_ctl(ep,EPOLL_CTL_ADD,in,&e);
+    e.events = EPOLLOUT | EPOLLET;
+    e.data.u32 = 1;
+    epoll_ctl(ep,EPOLL_CTL_ADD,out,&e);
+    
+    std::vector<uint8_t> pending;
+    uint8_t buff[4096];
+    size_t moved = 0;
+    bool eof = false;
+    bool busy = false;
+    while (!eof || !pending.empty()) {
+        struct epoll_event events[4];
+        int n = epoll_wait(ep,events,4,busy ? 0 : -1);
+        syscalls++;
+        for(int i = 0; i < n; i++) {
+            readable = readable || events[i].data.u32 == 0;
+            writable = writable || events[i].data.u32 == 1;
+        }
+        if (readable && !eof) {
+            ssize_t r = read(in,buff,sizeof(buff));
+            syscalls++;
+            if (r > 0) {
+                pending.insert(pending.end(),buff,buff + r);
+            } else if (r == 0) {
+                eof = true;
+            } else {
+                readable = false;
+            }
+        }
+        if (writable && !pending.empty()) {
+            ssize_t w = write(out,&pending[0],pending.size());
+            syscalls++;
+            if (w > 0) {
+                pending.erase(pending.begin(),pending.begin() + w);
+                moved += w;
+            } else {
+                writable = false;
+            }
+        }
+        busy = (readable && !eof) || (writable && !pending.empty());
+    }
+    close(ep);
+    return moved;
+}
+
+// As UringProxy: a multishot read into a buffer group, writes from a fixed
+// buffer, one at a time, and one enter a round.
+static size_t relayUring(Uring & ring, int in, int out, size_t & syscalls) {
+    static uint8_t reads[16 * 4096];
+    static uint8_t fixed[65536];
+    struct iovec iov = { fixed, sizeof(fixed) };
+    if (!ring.registerBuffers(&iov,1) || !ring.addBufferGroup(0,reads,4096,16)) {
+        return 0;
+    }
+    
+    std::vector<uint8_t> pending;
+    size_t moved = 0;
+    size_t inFlight = 0;
+    bool armed = false;
+    bool eof = false;
+    uint64_t enters = ring.enters;
+    while (!eof || !pending.empty() || inFlight) {
+        struct io_uring_cqe * cqe;
+        while ((cqe = ring.completion())) {
+            if (cqe->user_data == 0) {
+                armed = cqe->flags & IORING_CQE_F_MORE;
+                if (cqe->res > 0) {
+                    uint16_t id = uringBufferId(cqe);
+                    pending.insert(pending.end(),reads + id * 4096,reads + id * 4096 + cqe->res);
+                    ring.provide(0,id);
+                } else if (cqe->res == 0) {
+                    eof = true;
+                }
+            } else {
+                inFlight = 0;
+                if (cqe->res > 0) {
+                    pending.erase(pending.begin(),pending.begin() + cqe->res);
+                    moved += cqe->res;
+                }
+            }
+            ring.seen();
+        }
+        if (!armed && !eof) {
+            struct io_uring_sqe * sqe = ring.prepare(URING_OP_READ_MULTISHOT,in,0);
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = 0;
+            sqe->off = -1;
+            armed = true;
+        }
+        if (!inFlight && !pending.empty()) {
+            inFlight = std::min(pending.size(),sizeof(fixed));
+            memcpy(fixed,&pending[0],inFlight);
+            struct io_uring_sqe * sqe = ring.prepare(IORING_OP_WRITE_FIXED,out,1);
+            sqe->addr = (uintptr_t)fixed;
+            sqe->len = inFlight;
+            sqe->off = -1;
+        }
+        if (!eof || inFlight || !pending.empty()) {
+            ring.enter(static_cast<uint64_t>(-1));
+        }
+    }
+    syscalls += ring.enters - enters;
+    return moved;
+}
+
+void benchRelay() {
+    Uring ring(64);
+    bool uring = ring.ok() && ring.supports(URING_OP_READ_MULTISHOT) && ring.supports(IORING_OP_WRITE_FIXED);
+    
+    for(int k = 0; k < 2; k++) {
+        if (k == 1 && !uring) {
+            printf("%-28s not available\n","relay io_uring");
+            break;
+        }
+        int a[2];
+        int b[2];
+        if (pipe(a) || pipe(b)) {
+            return;
+        }
+        // the epoll loop's fds are non blocking, io_uring's needn't be.
+        if (k == 0) {
+            fcntl(a[0],F_SETFL,O_NONBLOCK);
+            fcntl(b[1],F_SETFL,O_NONBLOCK);
+        }
+        pthread_t feed;
+        pthread_t drain;
+        pthread_create(&feed,NULL,relayFeed,&a[1]);
+        pthread_create(&drain,NULL,relayDrain,&b[0]);
+        
+        size_t syscalls = 0;
+        double cpu = threadCpuSeconds();
+        double start = nowSeconds();
+        size_t moved = k ? relayUring(ring,a[0],b[1],syscalls) : relayEpoll(a[0],b[1],syscalls);
+        double seconds = nowSeconds() - start;
+        cpu = threadCpuSeconds() - cpu;
+        
+        close(b[1]);
+        pthread_join(feed,NULL);
+        pthread_join(drain,NULL);
+        close(a[0]);
+        close(b[0]);
+        if (moved != RELAY_BYTES) {
+            printf("relay lost data\n");
+            return;
+        }
+        double mb = moved / 1e6;
+        printf("%-28s %10.1f syscalls/MB %6.2f cpu ms/MB %8.1f MB/s\n",k ? "relay io_uring" : "relay epoll",
+               syscalls / mb,cpu * 1000 / mb,mb / seconds);
+    }
+}
+
+// Configurations of the embedded protocol, for its RAM footprint. It holds
+// everything inline, so that is all it needs besides stack.
+struct BoardSmall {
+    static const uint32_t window = 2;
+    static const uint32_t maxPayload = 64;
+    static const Framing framing = FRAMING_BASE64;
+    static const bool crc32c = false;
+};
+
+struct BoardMedium {
+    static const uint32_t window = 4;
+    static const uint32_t maxPayload = 256;
+    static const Framing framing = FRAMING_BINARY;
+    static const bool crc32c = false;
+};
+
+struct BoardLarge {
+    static const uint32_t window = 16;
+    static const uint32_t maxPayload = 1024;
+    static const Framing framing = FRAMING_BINARY;
+    static const bool crc32c = true;
+};
+
+void benchFootprint() {
+    printf("%-28s %10u bytes\n","embedded w2 p64 base64",(unsigned)sizeof(embedded::Protocol<BoardSmall>));
+    printf("%-28s %10u bytes\n","embedded w4 p256 binary",(unsigned)sizeof(embedded::Protocol<BoardMedium>));
+    printf("%-28s %10u bytes\n","embedded w16 p1024 binary",(unsigned)sizeof(embedded::Protocol<BoardLarge>));
+}
+
+int main (int argc, char const* argv[]) {
+    benchAllocations("packet path allocations",false);
+    benchAllocations("wire path allocations",true);
+    benchBase64();
+    benchChecksum();
+    benchEncode();
+    benchParityRebuild();
+    benchFecReceive();
+    benchCompression();
+    benchFootprint();
+    benchRelay();
+    return 0;
+}
@@ -0,0 +1,376 @@
+#include "buffers.h"
+
+#include <cstring>
+#include <algorithm>
+
+// Packet Buffer
+
+struct PacketBlock {
+    PacketBlock * next;
+    uint32_t refs;
+    uint32_t size;
+    uint8_t bytes[PACKET_BUFFER_CAPACITY];
+};
+
+// Released blocks, kept for reuse rather than freed. The pool only grows to
+// the most payloads that were ever alive at once on this thread.
+static __thread PacketBlock * freeBlocks = NULL;
+
+static PacketBlock * getBlock() {
+    PacketBlock * b = freeBlocks;
+    if (b) {
+        freeBlocks = b->next;
+    } else {
+        b = new PacketBlock;
+    }
+    b->next = NULL;
+    b->refs = 1;
+    b->size = 0;
+    return b;
+}
+
+static void putBlock(PacketBlock * b) {
+    if (b && --b->refs == 0) {
+        b->next = freeBlocks;
+        freeBlocks = b;
+    }
+}
+
+PacketBuffer::PacketBuffer() : block(NULL) {
+
+}
+
+PacketBuffer::PacketBuffer(const PacketBuffer & other) : block(other.block) {
+    if (block) {
+        block->refs++;
+    }
+}
+
+PacketBuffer::PacketBuffer(const std::vector<uint8_t> & v) : block(NULL) {
+    assign(v.empty() ? NULL : &v[0],v.size());
+}
+
+PacketBuffer::PacketBuffer(const uint8_t * data, size_t n) : block(NULL) {
+    assign(data,n);
+}
+
+PacketBuffer::~PacketBuffer() {
+    putBlock(block);
+}
+
+PacketBuffer & PacketBuffer::operator=(const PacketBuffer & other) {
+    if (other.block) {
+        other.block->refs++;
+    }
+    putBlock(block);
+    block = other.block;
+    return *this;
+}
+
+size_t PacketBuffer::size() const {
+    return block ? block->size : 0;
+}
+
+bool PacketBuffer::empty() const {
+    return size() == 0;
+}
+
+const uint8_t * PacketBuffer::begin() const {
+    return block ? block->bytes : NULL;
+}
+
+const uint8_t * PacketBuffer::end() const {
+    return block ? block->bytes + block->size : NULL;
+}
+
+uint8_t * PacketBuffer::begin() {
+    return block ? _writable(block->size) : NULL;
+}
+
+uint8_t * PacketBuffer::end() {
+    return block ? _writable(block->size) + block->size : NULL;
+}
+
+uint8_t PacketBuffer::operator[](size_t i) const {
+    return block->bytes[i];
+}
+
+uint8_t & PacketBuffer::operator[](size_t i) {
+    return _writable(block->size)[i];
+}
+
+bool PacketBuffer::operator==(const PacketBuffer & other) const {
+    return size() == other.size() && (empty() || memcmp(begin(),other.begin(),size()) == 0);
+}
+
+// Makes the block ours alone and big enough for newSize bytes, keeping the
+// current contents.
+uint8_t * PacketBuffer::_writable(size_t newSize) {
+    if (newSize > PACKET_BUFFER_CAPACITY) {
+        std::cerr << "FATAL BUG: PacketBuffer overflow:" << __FILE__ << ":" << __LINE__ << std::endl;
+        exit(1);
+    }
+    if (!block) {
+        block = getBlock();
+    } else if (block->refs > 1) {
+        PacketBlock * b = getBlock();
+        b->size = block->size;
+        memcpy(b->bytes,block->bytes,block->size);
+        putBlock(block);
+        block = b;
+    }
+    return block->bytes;
+}
+
+void PacketBuffer::push_back(uint8_t b) {
+    size_t n = size();
+    _writable(n + 1)[n] = b;
+    block->size = n + 1;
+}
+
+void PacketBuffer::append(const uint8_t * data, size_t n) {
+    if (!n) {
+        return;
+    }
+    size_t old = size();
+    memcpy(_writable(old + n) + old,data,n);
+    block->size = old + n;
+}
+
+void PacketBuffer::assign(const uint8_t * data, size_t n) {
+    if (block && block->refs > 1) {
+        putBlock(block);
+        block = NULL;
+    }
+    if (!n) {
+        clear();
+        return;
+    }
+    memcpy(_writable(n),data,n);
+    block->size = n;
+}
+
+void PacketBuffer::resize(size_t n, uint8_t fill) {
+    size_t old = size();
+    if (n == old) {
+        return;
+    }
+    uint8_t * p = _writable(n);
+    if (n > old) {
+        memset(p + old,fill,n - old);
+    }
+    block->size = n;
+}
+
+void PacketBuffer::erase_front(size_t n) {
+    size_t old = size();
+    n = std::min(n,old);
+    if (!n) {
+        return;
+    }
+    uint8_t * p = _writable(old);
+    memmove(p,p + n,old - n);
+    block->size = old - n;
+}
+
+void PacketBuffer::clear() {
+    putBlock(block);
+    block = NULL;
+}
+
+void PacketBuffer::swap(PacketBuffer & other) {
+    std::swap(block,other.block);
+}
+
+// Byte Queue
+
+ByteQueue::ByteQueue() : head(0) {
+
+}
+
+size_t ByteQueue::size() const {
+    return bytes.size() - head;
+}
+
+bool ByteQueue::empty() const {
+    return size() == 0;
+}
+
+const uint8_t * ByteQueue::front() const {
+    return &bytes[head];
+}
+
+void ByteQueue::append(const uint8_t * data, size_t n) {
+    // slide the unread bytes down rather than grow, once the space in
+    // front of them is worth reclaiming.
+    if (head && head >= bytes.size() / 2) {
+        bytes.erase(bytes.begin(),bytes.begin() + head);
+        head = 0;
+    }
+    bytes.insert(bytes.end(),data,data + n);
+}
+
+void ByteQueue::pop(size_t n) {
+    head += std::min(n,size());
+    if (head == bytes.size()) {
+        bytes.clear();
+        head = 0;
+    }
+}
+
+void ByteQueue::clear() {
+    bytes.clear();
+    head = 0;
+}
+
+// Byte Sink
+
+ByteSink::~ByteSink() {
+
+}
+
+bool ByteSink::full() const {
+    return false;
+}
+
+void ByteSink::write(const uint8_t * data, size_t n) {
+    if (n) {
+        memcpy(reserve(n),data,n);
+        commit(n);
+    }
+}
+
+VectorSink::VectorSink(std::vector<uint8_t> & v, size_t l) : bytes(v) , at(v.size()) , limit(l) {
+
+}
+
+uint8_t * VectorSink::reserve(size_t n) {
+    at = bytes.size();
+    bytes.resize(at + std::max<size_t>(n,1));
+    return &bytes[at];
+}
+
+void VectorSink::commit(size_t n) {
+    bytes.resize(at + n);
+}
+
+bool VectorSink::full() const {
+    return bytes.size() >= limit;
+}
+
+// Chunk Queue
+
+ChunkQueue::ChunkQueue(size_t high, size_t low) : count(0) , highWater(high) , lowWater(low) , paused(false) {
+    this->spareLimit = high == static_cast<size_t>(-1) ? 4 : high / QUEUE_CHUNK_SIZE + 2;
+}
+
+ChunkQueue::~ChunkQueue() {
+    clear();
+    for(size_t i = 0; i < this->spare.size(); i++) {
+        delete[] this->spare[i];
+    }
+}
+
+size_t ChunkQueue::size() const {
+    return this->count;
+}
+
+bool ChunkQueue::empty() const {
+    return this->count == 0;
+}
+
+int ChunkQueue::iovecs(struct iovec * iov, int max) const {
+    int n = 0;
+    for(std::deque<Chunk>::const_iterator it = this->chunks.begin(); it != this->chunks.end() && n < max; it++) {
+        if (it->end > it->begin) {
+            iov[n].iov_base = it->bytes + it->begin;
+            iov[n].iov_len = it->end - it->begin;
+            n++;
+        }
+    }
+    return n;
+}
+
+size_t ChunkQueue::copyOut(uint8_t * to, size_t n) const {
+    size_t done = 0;
+    for(std::deque<Chunk>::const_iterator it = this->chunks.begin(); it != this->chunks.end() && done < n; it++) {
+        size_t take = std::min(n - done,it->end - it->begin);
+        memcpy(to + done,it->bytes + it->begin,take);
+        done += take;
+    }
+    return done;
+}
+
+void ChunkQueue::pop(size_t n) {
+    n = std::min(n,this->count);
+    this->count -= n;
+    while (!this->chunks.empty()) {
+        Chunk & c = this->chunks.front();
+        size_t take = std::min(n,c.end - c.begin);
+        c.begin += take;
+        n -= take;
+        if (c.begin < c.end) {
+            break;
+        }
+        // the last chunk stays to be written into again.
+        if (this->chunks.size() == 1) {
+            c.begin = 0;
+            c.end = 0;
+            break;
+        }
+        _release(c);
+        this->chunks.pop_front();
+    }
+    if (this->count <= this->lowWater) {
+        this->paused = false;
+    }
+}
+
+void ChunkQueue::clear() {
+    for(std::deque<Chunk>::iterator it = this->chunks.begin(); it != this->chunks.end(); it++) {
+        _release(*it);
+    }
+    this->chunks.clear();
+    this->count = 0;
+    this->paused = false;
+}
+
+void ChunkQueue::_release(const Chunk & c) {
+    if (c.capacity == QUEUE_CHUNK_SIZE && this->spare.size() < this->spareLimit) {
+        this->spare.push_back(c.bytes);
+    } else {
+        delete[] c.bytes;
+    }
+}
+
+// A reservation that doesn't fit in what is left of the last chunk starts
+// a new one, which is bigger than usual if it has to be.
+uint8_t * ChunkQueue::reserve(size_t n) {
+    if (this->chunks.empty() || this->chunks.back().capacity - this->chunks.back().end < n) {
+        Chunk c;
+        c.capacity = std::max(n,QUEUE_CHUNK_SIZE);
+        c.begin = 0;
+        c.end = 0;
+        if (c.capacity == QUEUE_CHUNK_SIZE && !this->spare.empty()) {
+            c.bytes = this->spare.back();
+            this->spare.pop_back();
+        } else {
+            c.bytes = new uint8_t[c.capacity];
+        }
+        this->chunks.push_back(c);
+    }
+    Chunk & c = this->chunks.back();
+    return c.bytes + c.end;
+}
+
+void ChunkQueue::commit(size_t n) {
+    this->chunks.back().end += n;
+    this->count += n;
+    if (this->count >= this->highWater) {
+        this->paused = true;
+    }
+}
+
+bool ChunkQueue::full() const {
+    return this->paused;
+}
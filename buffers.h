@@ -0,0 +1,228 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <deque>
+#include <iostream>
+#include <cstdlib>
+#include <sys/uio.h>
+
+// Storage for the hot paths that, once warmed up, doesn't go back to the
+// heap for every packet.
+
+// Largest payload any packet carries: a full DATA payload plus the FEC
+// framing around it, or an ACK's selective bitmap.
+static const uint32_t MAX_PACKET_DATA = 2048 + 64;
+
+// Blocks also hold the encoded frames of packets awaiting retransmission, up
+// to the base64 encoding of a header and MAX_PACKET_DATA.
+static const uint32_t PACKET_BUFFER_CAPACITY = 3072;
+
+struct PacketBlock;
+
+// A packet payload held in a fixed size block from a per thread pool. Copies
+// share the block and a writer gets its own copy first, so packets can be
+// queued, retransmitted and handed around without copying their payloads.
+// Empty payloads, as on most control packets, have no block at all.
+class PacketBuffer {
+
+    public:
+        PacketBuffer();
+        PacketBuffer(const PacketBuffer & other);
+        PacketBuffer(const std::vector<uint8_t> & v);
+        PacketBuffer(const uint8_t * data, size_t n);
+        ~PacketBuffer();
+        PacketBuffer & operator=(const PacketBuffer & other);
+
+        size_t size() const;
+        bool empty() const;
+        const uint8_t * begin() const;
+        const uint8_t * end() const;
+        uint8_t * begin();
+        uint8_t * end();
+        uint8_t operator[](size_t i) const;
+        uint8_t & operator[](size_t i);
+        bool operator==(const PacketBuffer & other) const;
+
+        void push_back(uint8_t b);
+        void append(const uint8_t * data, size_t n);
+        void assign(const uint8_t * data, size_t n);
+        void resize(size_t n, uint8_t fill = 0);
+        void erase_front(size_t n);
+        void clear();
+        void swap(PacketBuffer & other);
+
+    private:
+        PacketBlock * block;
+
+        uint8_t * _writable(size_t newSize);
+};
+
+// A FIFO of bytes that keeps its storage, for application data waiting to
+// be packetised.
+class ByteQueue {
+
+    public:
+        ByteQueue();
+
+        size_t size() const;
+        bool empty() const;
+        const uint8_t * front() const;
+        void append(const uint8_t * data, size_t n);
+        void pop(size_t n);
+        void clear();
+
+    private:
+        std::vector<uint8_t> bytes;
+        size_t head;
+};
+
+// Where the protocol puts the bytes it produces, link bytes for the peer or
+// application data, so they go straight into the caller's own buffers.
+// reserve returns room for at least n bytes and commit says how many of
+// them were written; nothing is seen until then. A sink that is full asks
+// the protocol to hold back new data for now.
+class ByteSink {
+
+    public:
+        virtual ~ByteSink();
+
+        virtual uint8_t * reserve(size_t n) = 0;
+        virtual void commit(size_t n) = 0;
+        virtual bool full() const;
+
+        void write(const uint8_t * data, size_t n);
+};
+
+// A sink appending to a vector, which is full once it holds limit bytes.
+class VectorSink : public ByteSink {
+
+    public:
+        explicit VectorSink(std::vector<uint8_t> & v, size_t limit = static_cast<size_t>(-1));
+
+        uint8_t * reserve(size_t n);
+        void commit(size_t n);
+        bool full() const;
+
+    private:
+        std::vector<uint8_t> & bytes;
+        size_t at;
+        size_t limit;
+};
+
+// Size of the chunks a ChunkQueue is made of.
+static const size_t QUEUE_CHUNK_SIZE = 16384;
+
+// A FIFO of bytes on their way out to an fd, in fixed size chunks. The
+// front chunks go to writev as an iovec, and popping what was written is
+// O(1) however much is queued behind it. Spent chunks are kept for reuse,
+// as many as the high watermark needs. As a sink it is full from reaching
+// its high watermark until it drains to its low one, so whatever fills it
+// holds back for a while rather than trickling in again at once.
+class ChunkQueue : public ByteSink {
+
+    public:
+        explicit ChunkQueue(size_t highWater = static_cast<size_t>(-1), size_t lowWater = 0);
+        ~ChunkQueue();
+
+        size_t size() const;
+        bool empty() const;
+        // Fills in up to max iovecs from the front, returning how many.
+        int iovecs(struct iovec * iov, int max) const;
+        // Copies up to n bytes from the front without popping them.
+        size_t copyOut(uint8_t * to, size_t n) const;
+        void pop(size_t n);
+        void clear();
+
+        uint8_t * reserve(size_t n);
+        void commit(size_t n);
+        bool full() const;
+
+    private:
+        struct Chunk {
+            uint8_t * bytes;
+            size_t capacity;
+            size_t begin;
+            size_t end;
+        };
+
+        std::deque<Chunk> chunks;
+        std::vector<uint8_t *> spare;
+        size_t spareLimit;
+        size_t count;
+        size_t highWater;
+        size_t lowWater;
+        bool paused;
+
+        void _release(const Chunk & c);
+
+        ChunkQueue(const ChunkQueue &);
+        ChunkQueue & operator=(const ChunkQueue &);
+};
+
+// A fixed capacity queue held inline, for the send window. Elements are
+// reset to T() as they leave so they let go of what they hold.
+template <typename T, uint32_t N>
+class Ring {
+
+    public:
+        template <typename R, typename V>
+        class Iter {
+            public:
+                Iter(R * r, uint32_t i) : ring(r) , index(i) {}
+                V & operator*() const { return (*ring)[index]; }
+                V * operator->() const { return &(*ring)[index]; }
+                Iter & operator++() { index++; return *this; }
+                Iter operator++(int) { Iter old = *this; index++; return old; }
+                bool operator==(const Iter & other) const { return index == other.index; }
+                bool operator!=(const Iter & other) const { return index != other.index; }
+            private:
+                R * ring;
+                uint32_t index;
+        };
+        typedef Iter<Ring,T> iterator;
+        typedef Iter<const Ring,const T> const_iterator;
+
+        Ring() : head(0) , count(0) {}
+
+        uint32_t size() const { return count; }
+        bool empty() const { return count == 0; }
+        T & operator[](uint32_t i) { return items[(head + i) % N]; }
+        const T & operator[](uint32_t i) const { return items[(head + i) % N]; }
+        T & front() { return items[head]; }
+        const T & front() const { return items[head]; }
+        T & back() { return items[(head + count - 1) % N]; }
+        const T & back() const { return items[(head + count - 1) % N]; }
+
+        void push_back(const T & t) {
+            if (count == N) {
+                std::cerr << "FATAL BUG: Ring overflow:" << __FILE__ << ":" << __LINE__ << std::endl;
+                exit(1);
+            }
+            items[(head + count) % N] = t;
+            count++;
+        }
+
+        void pop_front() {
+            items[head] = T();
+            head = (head + 1) % N;
+            count--;
+        }
+
+        void clear() {
+            while (count) {
+                pop_front();
+            }
+            head = 0;
+        }
+
+        iterator begin() { return iterator(this,0); }
+        iterator end() { return iterator(this,count); }
+        const_iterator begin() const { return const_iterator(this,0); }
+        const_iterator end() const { return const_iterator(this,count); }
+
+    private:
+        T items[N];
+        uint32_t head;
+        uint32_t count;
+};
@@ -0,0 +1,72 @@
+#include "cobs.h"
+
+#include <cstring>
+
+// Each block is a code byte followed by code - 1 non zero bytes. A code
+// below 0xff stands for a zero after the block, except at the very end.
+CobsEncoder::CobsEncoder(uint8_t * o) : start(o) , out(o + 1) , codePos(o) , code(1) {
+
+}
+
+void CobsEncoder::add(const uint8_t * data, size_t n) {
+    for(size_t i = 0; i < n; i++) {
+        if (data[i] == 0) {
+            *codePos = code;
+            codePos = out++;
+            code = 1;
+            continue;
+        }
+        *out++ = data[i];
+        code++;
+        if (code == 0xff) {
+            *codePos = code;
+            codePos = out++;
+            code = 1;
+        }
+    }
+}
+
+size_t CobsEncoder::finish() {
+    *codePos = code;
+    return out - start;
+}
+
+void cobsEncode(const uint8_t * data, size_t n, std::vector<uint8_t> & out) {
+    size_t at = out.size();
+    out.resize(at + cobsMaxEncodedSize(n));
+    CobsEncoder encoder(&out[at]);
+    encoder.add(data,n);
+    out.resize(at + encoder.finish());
+}
+
+bool cobsDecode(const uint8_t * data, size_t n, std::vector<uint8_t> & out) {
+    size_t at = out.size();
+    size_t written = 0;
+    out.resize(at + n);
+    bool ok = cobsDecode(data,n,n ? &out[at] : NULL,written);
+    out.resize(at + written);
+    return ok;
+}
+
+bool cobsDecode(const uint8_t * data, size_t n, uint8_t * out, size_t & written) {
+    size_t i = 0;
+    written = 0;
+    while (i < n) {
+        uint8_t code = data[i++];
+        if (code == 0 || i + code - 1 > n) {
+            return false;
+        }
+        for(size_t j = 0; j < code - 1u; j++) {
+            if (data[i + j] == 0) {
+                return false;
+            }
+        }
+        memcpy(out + written,data + i,code - 1);
+        written += code - 1;
+        i += code - 1;
+        if (code != 0xff && i < n) {
+            out[written++] = 0;
+        }
+    }
+    return true;
+}
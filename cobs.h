@@ -0,0 +1,42 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// Consistent Overhead Byte Stuffing. Encoded data contains no zero bytes, at
+// a cost of one byte in 254, which leaves zero free to delimit frames on an
+// 8-bit clean link.
+
+// Encodes data given in pieces into a buffer with room for
+// cobsMaxEncodedSize of the total.
+class CobsEncoder {
+
+    public:
+        CobsEncoder(uint8_t * out);
+        void add(const uint8_t * data, size_t n);
+        // Closes the last block and returns the number of bytes written,
+        // without a delimiter.
+        size_t finish();
+
+    private:
+        uint8_t * start;
+        uint8_t * out;
+        uint8_t * codePos;
+        uint8_t code;
+};
+
+// Appends the encoding of data to out, without a delimiter.
+void cobsEncode(const uint8_t * data, size_t n, std::vector<uint8_t> & out);
+
+// Appends the decoding of data, which must not include the delimiter, to
+// out. Returns false if it is not valid COBS.
+bool cobsDecode(const uint8_t * data, size_t n, std::vector<uint8_t> & out);
+
+// As above, into out, which must have room for n bytes, setting written to
+// the length of the decoding.
+bool cobsDecode(const uint8_t * data, size_t n, uint8_t * out, size_t & written);
+
+// Largest encoding of n bytes.
+static inline size_t cobsMaxEncodedSize(size_t n) {
+    return n + n / 254 + 1;
+}
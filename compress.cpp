@@ -0,0 +1,222 @@
+#include "compress.h"
+
+#include <cstring>
+#include <algorithm>
+#include <time.h>
+
+static const uint32_t MIN_MATCH = 4;
+
+static uint64_t cpuNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint32_t read32(const uint8_t * p) {
+    uint32_t v;
+    memcpy(&v,p,sizeof(v));
+    return v;
+}
+
+static void putLength(std::vector<uint8_t> & out, uint32_t len) {
+    while (len >= 255) {
+        out.push_back(255);
+        len -= 255;
+    }
+    out.push_back(len);
+}
+
+static void putSequence(std::vector<uint8_t> & out, const uint8_t * lit, uint32_t nlit,
+                        uint32_t offset, uint32_t matchLen) {
+    
+    uint32_t m = matchLen ? matchLen - MIN_MATCH : 0;
+    uint8_t token = (std::min<uint32_t>(nlit,15) << 4) | std::min<uint32_t>(m,15);
+    
+    out.push_back(token);
+    if (nlit >= 15) {
+        putLength(out,nlit - 15);
+    }
+    out.insert(out.end(),lit,lit + nlit);
+    
+    if (!matchLen) {
+        return;
+    }
+    
+    out.push_back(offset & 0xff);
+    out.push_back(offset >> 8);
+    if (m >= 15) {
+        putLength(out,m - 15);
+    }
+}
+
+CompressionStats::CompressionStats() : plainBytes(0) , codedBytes(0) , nanos(0) {
+
+}
+
+// Compressor
+
+StreamCompressor::StreamCompressor() : base(0) , table(1 << HASH_LOG,0) {
+
+}
+
+bool StreamCompressor::compress(const uint8_t * data, size_t n, std::vector<uint8_t> & out) {
+    
+    uint64_t start = cpuNanos();
+    
+    out.clear();
+    
+    if (n == 0) {
+        return false;
+    }
+    
+    uint32_t hist = buffer.size();
+    buffer.insert(buffer.end(),data,data + n);
+    
+    const uint8_t * b = &buffer[0];
+    uint32_t end = buffer.size();
+    uint32_t i = hist;
+    uint32_t anchor = hist;
+    
+    while (i + MIN_MATCH <= end) {
+        uint32_t h = (read32(b + i) * 2654435761u) >> (32 - HASH_LOG);
+        // table entries are offset by one so zero means empty.
+        uint32_t cand = table[h] - 1 - base;
+        table[h] = base + i + 1;
+        
+        if (cand < i && i - cand <= COMPRESS_WINDOW && read32(b + cand) == read32(b + i)) {
+            uint32_t len = MIN_MATCH;
+            while (i + len < end && b[cand + len] == b[i + len]) {
+                len++;
+            }
+            putSequence(out,b + anchor,i - anchor,i - cand,len);
+            i += len;
+            anchor = i;
+            if (out.size() >= n) {
+                break;
+            }
+        } else {
+            i++;
+        }
+    }
+    
+    bool worthIt = false;
+    if (out.size() < n) {
+        putSequence(out,b + anchor,end - anchor,0,0);
+        worthIt = out.size() < n;
+    }
+    if (!worthIt) {
+        out.clear();
+    }
+    
+    if (buffer.size() > COMPRESS_WINDOW) {
+        uint32_t drop = buffer.size() - COMPRESS_WINDOW;
+        buffer.erase(buffer.begin(),buffer.begin() + drop);
+        base += drop;
+    }
+    
+    counters.plainBytes += n;
+    counters.codedBytes += worthIt ? out.size() : n;
+    counters.nanos += cpuNanos() - start;
+    return worthIt;
+}
+
+const CompressionStats & StreamCompressor::stats() const {
+    return counters;
+}
+
+// Decompressor
+
+StreamDecompressor::StreamDecompressor() {
+
+}
+
+static bool getLength(const uint8_t * & ip, const uint8_t * end, uint32_t & len) {
+    uint8_t v;
+    do {
+        if (ip == end) {
+            return false;
+        }
+        v = *ip++;
+        len += v;
+    } while (v == 255);
+    return true;
+}
+
+bool StreamDecompressor::decompress(const uint8_t * data, size_t n, std::vector<uint8_t> & out, size_t maxOut) {
+    
+    uint64_t start = cpuNanos();
+    
+    size_t hist = history.size();
+    const uint8_t * ip = data;
+    const uint8_t * end = data + n;
+    bool ok = false;
+    
+    while (ip < end) {
+        uint8_t token = *ip++;
+        uint32_t nlit = token >> 4;
+        if (nlit == 15 && !getLength(ip,end,nlit)) {
+            break;
+        }
+        if ((size_t)(end - ip) < nlit || history.size() - hist + nlit > maxOut) {
+            break;
+        }
+        history.insert(history.end(),ip,ip + nlit);
+        ip += nlit;
+        
+        if (ip == end) {
+            ok = true;
+            break;
+        }
+        
+        if (end - ip < 2) {
+            break;
+        }
+        uint32_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        uint32_t len = token & 15;
+        if (len == 15 && !getLength(ip,end,len)) {
+            break;
+        }
+        len += MIN_MATCH;
+        
+        if (offset == 0 || offset > history.size() || history.size() - hist + len > maxOut) {
+            break;
+        }
+        
+        // may overlap itself, so a byte at a time.
+        size_t from = history.size() - offset;
+        for(uint32_t k = 0; k < len; k++) {
+            history.push_back(history[from + k]);
+        }
+    }
+    
+    if (!ok) {
+        history.resize(hist);
+        counters.nanos += cpuNanos() - start;
+        return false;
+    }
+    
+    out.insert(out.end(),history.begin() + hist,history.end());
+    counters.plainBytes += history.size() - hist;
+    counters.codedBytes += n;
+    trim();
+    counters.nanos += cpuNanos() - start;
+    return true;
+}
+
+void StreamDecompressor::addRaw(const uint8_t * data, size_t n) {
+    history.insert(history.end(),data,data + n);
+    counters.plainBytes += n;
+    counters.codedBytes += n;
+    trim();
+}
+
+void StreamDecompressor::trim() {
+    if (history.size() > COMPRESS_WINDOW) {
+        history.erase(history.begin(),history.begin() + (history.size() - COMPRESS_WINDOW));
+    }
+}
+
+const CompressionStats & StreamDecompressor::stats() const {
+    return counters;
+}
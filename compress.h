@@ -0,0 +1,71 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// LZ77 stream compression with a history window shared across packets. Each
+// packet is compressed as the continuation of everything sent before it, so
+// repetitive traffic such as shell output and logs compresses well even when
+// cut into small packets. Both ends must see the same bytes in the same
+// order; packets that don't compress are sent raw but still added to the
+// history on both sides.
+//
+// The encoding is a series of sequences, each a token byte holding the
+// literal count (high nibble) and match length - 4 (low nibble), the
+// literals, a 2 byte little endian match offset and any extra length bytes.
+// Nibbles of 15 are extended by following bytes, added up until one isn't
+// 255. The last sequence has literals only.
+
+static const uint32_t COMPRESS_WINDOW_LOG = 13;
+static const uint32_t COMPRESS_WINDOW = 1 << COMPRESS_WINDOW_LOG;
+
+struct CompressionStats {
+    // application bytes, and the bytes they took on the wire.
+    uint64_t plainBytes;
+    uint64_t codedBytes;
+    // CPU time spent in the codec.
+    uint64_t nanos;
+    CompressionStats();
+};
+
+class StreamCompressor {
+    
+    public:
+        StreamCompressor();
+        
+        // Returns false, leaving out empty, if the data would not get
+        // smaller, in which case it should be sent as is.
+        bool compress(const uint8_t * data, size_t n, std::vector<uint8_t> & out);
+        const CompressionStats & stats() const;
+    
+    private:
+        static const uint32_t HASH_LOG = 12;
+        
+        // history followed by the data being compressed. base is the stream
+        // offset of buffer[0].
+        std::vector<uint8_t> buffer;
+        uint32_t base;
+        // stream offset of the last place each hashed 4 bytes was seen.
+        std::vector<uint32_t> table;
+        CompressionStats counters;
+};
+
+class StreamDecompressor {
+    
+    public:
+        StreamDecompressor();
+        
+        // Appends the decompressed data to out. Returns false if the data is
+        // not valid or would expand past maxOut, leaving the history as it
+        // was.
+        bool decompress(const uint8_t * data, size_t n, std::vector<uint8_t> & out, size_t maxOut);
+        // Adds a packet that was sent uncompressed to the history.
+        void addRaw(const uint8_t * data, size_t n);
+        const CompressionStats & stats() const;
+    
+    private:
+        std::vector<uint8_t> history;
+        CompressionStats counters;
+        
+        void trim();
+};
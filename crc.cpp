@@ -0,0 +1,204 @@
+#include "crc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC_X86 1
+#endif
+
+// All the CRCs here are reflected, and the kernels work on the raw shift
+// register: the public functions invert it on the way in and out.
+
+// Slicing by 8. table[0] is the usual bytewise table, and table[k] gives the
+// effect of a byte followed by k zero bytes, so 8 lookups advance 8 bytes.
+struct SlicingTables {
+    uint32_t table[8][256];
+    SlicingTables(uint32_t poly) {
+        for(uint32_t i = 0; i < 256 ; i++) {
+            uint32_t c = i;
+            for(int j = 0; j < 8 ; j++) {
+                c = (c & 1) ? (c >> 1) ^ poly : c >> 1;
+            }
+            table[0][i] = c;
+        }
+        for(uint32_t i = 0; i < 256 ; i++) {
+            for(int k = 1; k < 8 ; k++) {
+                table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+            }
+        }
+    }
+};
+
+static const SlicingTables crc32Tables(0xedb88320);
+static const SlicingTables crc32cTables(0x82f63b78);
+
+static inline uint32_t load32(const uint8_t * p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static uint32_t crcSlicing(const SlicingTables & tables, uint32_t crc, const uint8_t * p, size_t n) {
+    const uint32_t (*t)[256] = tables.table;
+
+    while (n >= 8) {
+        uint32_t lo = load32(p) ^ crc;
+        uint32_t hi = load32(p + 4);
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+            ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+        p += 8;
+        n -= 8;
+    }
+    while (n--) {
+        crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static uint32_t crc32Slicing(uint32_t crc, const uint8_t * p, size_t n) {
+    return crcSlicing(crc32Tables,crc,p,n);
+}
+
+static uint32_t crc32cSlicing(uint32_t crc, const uint8_t * p, size_t n) {
+    return crcSlicing(crc32cTables,crc,p,n);
+}
+
+#ifdef CRC_X86
+
+// Folding, after Intel's "Fast CRC Computation for Generic Polynomials Using
+// PCLMULQDQ Instruction". Each 128 bit accumulator is multiplied forward
+// past the data that follows it and xor'ed into that, which keeps the
+// message the same modulo the polynomial while shortening it. Four
+// accumulators run 64 bytes apart, then fold into one, and the last 16
+// bytes it leaves go through the tables with the rest of the tail.
+__attribute__((target("pclmul,sse2")))
+static inline __m128i fold(__m128i x, __m128i k) {
+    return _mm_xor_si128(_mm_clmulepi64_si128(x,k,0x00),_mm_clmulepi64_si128(x,k,0x11));
+}
+
+__attribute__((target("pclmul,sse2")))
+static uint32_t crc32Pclmul(uint32_t crc, const uint8_t * p, size_t n) {
+    if (n < 64) {
+        return crc32Slicing(crc,p,n);
+    }
+
+    // x^(512+64) and x^512 mod P, then x^(128+64) and x^128, bit reflected.
+    const __m128i by4 = _mm_set_epi64x(0x1c6e41596LL,0x154442bd4LL);
+    const __m128i by1 = _mm_set_epi64x(0x0ccaa009eLL,0x1751997d0LL);
+
+    const __m128i * v = reinterpret_cast<const __m128i *>(p);
+    __m128i x0 = _mm_xor_si128(_mm_loadu_si128(v),_mm_cvtsi32_si128(crc));
+    __m128i x1 = _mm_loadu_si128(v + 1);
+    __m128i x2 = _mm_loadu_si128(v + 2);
+    __m128i x3 = _mm_loadu_si128(v + 3);
+    p += 64;
+    n -= 64;
+
+    while (n >= 64) {
+        v = reinterpret_cast<const __m128i *>(p);
+        x0 = _mm_xor_si128(fold(x0,by4),_mm_loadu_si128(v));
+        x1 = _mm_xor_si128(fold(x1,by4),_mm_loadu_si128(v + 1));
+        x2 = _mm_xor_si128(fold(x2,by4),_mm_loadu_si128(v + 2));
+        x3 = _mm_xor_si128(fold(x3,by4),_mm_loadu_si128(v + 3));
+        p += 64;
+        n -= 64;
+    }
+
+    __m128i x = _mm_xor_si128(fold(x0,by1),x1);
+    x = _mm_xor_si128(fold(x,by1),x2);
+    x = _mm_xor_si128(fold(x,by1),x3);
+
+    while (n >= 16) {
+        x = _mm_xor_si128(fold(x,by1),_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+        p += 16;
+        n -= 16;
+    }
+
+    uint8_t rest[16];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(rest),x);
+    return crc32Slicing(crc32Slicing(0,rest,16),p,n);
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSse42(uint32_t crc, const uint8_t * p, size_t n) {
+#ifdef __x86_64__
+    uint64_t c = crc;
+    while (n >= 8) {
+        c = _mm_crc32_u64(c,load32(p) | (static_cast<uint64_t>(load32(p + 4)) << 32));
+        p += 8;
+        n -= 8;
+    }
+    crc = c;
+#endif
+    while (n >= 4) {
+        crc = _mm_crc32_u32(crc,load32(p));
+        p += 4;
+        n -= 4;
+    }
+    while (n--) {
+        crc = _mm_crc32_u8(crc,*p++);
+    }
+    return crc;
+}
+
+#endif
+
+// Dispatch
+
+typedef uint32_t (*CrcFunc)(uint32_t crc, const uint8_t * p, size_t n);
+
+static CrcKernel currentKernel = CRC_SLICING;
+static CrcFunc crc32Func = crc32Slicing;
+static CrcFunc crc32cFunc = crc32cSlicing;
+
+bool crcSetKernel(CrcKernel kernel) {
+    CrcFunc c32 = crc32Slicing;
+    CrcFunc c32c = crc32cSlicing;
+
+    if (kernel == CRC_HARDWARE) {
+#ifdef CRC_X86
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("pclmul") && !__builtin_cpu_supports("sse4.2")) {
+            return false;
+        }
+        if (__builtin_cpu_supports("pclmul")) {
+            c32 = crc32Pclmul;
+        }
+        if (__builtin_cpu_supports("sse4.2")) {
+            c32c = crc32cSse42;
+        }
+#else
+        return false;
+#endif
+    }
+
+    currentKernel = kernel;
+    crc32Func = c32;
+    crc32cFunc = c32c;
+    return true;
+}
+
+CrcKernel crcKernel() {
+    return currentKernel;
+}
+
+bool crc32cHardware() {
+#ifdef CRC_X86
+    return crc32cFunc == crc32cSse42;
+#else
+    return false;
+#endif
+}
+
+struct PickCrcKernel {
+    PickCrcKernel() {
+        crcSetKernel(CRC_HARDWARE);
+    }
+};
+
+static PickCrcKernel pickCrcKernel;
+
+uint32_t crc32(const uint8_t * data, size_t n, uint32_t crc) {
+    return ~crc32Func(~crc,data,n);
+}
+
+uint32_t crc32c(const uint8_t * data, size_t n, uint32_t crc) {
+    return ~crc32cFunc(~crc,data,n);
+}
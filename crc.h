@@ -0,0 +1,25 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// Frame checksums. crc32 is the IEEE CRC every peer understands; crc32c is
+// the Castagnoli CRC, which SSE4.2 computes in hardware, used when both ends
+// agree to it. Passing the CRC of earlier data continues it, so
+// crc32(b, m, crc32(a, n)) is the CRC of a followed by b.
+uint32_t crc32(const uint8_t * data, size_t n, uint32_t crc = 0);
+uint32_t crc32c(const uint8_t * data, size_t n, uint32_t crc = 0);
+
+// The kernels the CRCs can run on. Slicing by 8 works 8 bytes at a time
+// from tables; hardware folds crc32 with carry-less multiplies (PCLMULQDQ)
+// and uses the SSE4.2 crc32 instruction for crc32c, each where the CPU has
+// it. The best is picked at startup; tests and benchmarks may pick another.
+enum CrcKernel {
+    CRC_SLICING,
+    CRC_HARDWARE
+};
+
+bool crcSetKernel(CrcKernel kernel);
+CrcKernel crcKernel();
+
+// Whether crc32c runs in hardware here, which is when we offer it to peers.
+bool crc32cHardware();
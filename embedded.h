@@ -0,0 +1,699 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "wire.h"
+#include "arq.h"
+#include "crc.h"
+#include "cobs.h"
+#include "base64.h"
+
+// The protocol for small boards at the far end of a serial line, in fixed
+// storage sized at compile time. It speaks the same wire format as Protocol
+// and interworks with it, but supports less: channel 0 only, no FEC,
+// compression or flow control, and a fixed payload size. Everything that
+// Protocol would negotiate past that is simply not offered. OPT_LIMITS tells
+// the peer how large a payload and how many packets out of order we can
+// hold, so it never sends more than fits, and we obey the peer's in turn.
+// Retransmission timing, attempt numbers and the options both take the same
+// way come from arq.h, as in Protocol.
+//
+// Config supplies the sizes as compile time constants:
+//
+//     struct Config {
+//         static const uint32_t window = 4;        // DATA packets in flight
+//         static const uint32_t maxPayload = 256;  // bytes per DATA packet
+//         static const Framing framing = FRAMING_BINARY;
+//         static const bool crc32c = false;
+//     };
+//
+// FRAMING_BINARY offers COBS framing, taken up if the link proves 8-bit
+// clean, and crc32c offers CRC32C checksums. Both sides must agree to
+// either, and both fall back to base64 and CRC32.
+//
+// Output goes to sinks, anything with write(const uint8_t *, size_t), such
+// as a ByteSink or a UART driver. Nothing is allocated, and nothing fails
+// other than by dropping the connection, which getState shows.
+namespace embedded {
+
+// A decoded packet, pointing into the builder's buffer until it returns.
+struct Packet {
+    PacketType type;
+    uint32_t seqnum;
+    uint8_t attempt;
+    uint8_t channel;
+    uint8_t flags;
+    uint32_t ackSeqnum;
+    uint8_t ackAttempt;
+    uint32_t credit;
+    const uint8_t * data;
+    uint32_t size;
+};
+
+// Buffer sizes for a Config.
+template <class Config>
+struct Sizes {
+    // The largest payload we take in: our own, the SACK bitmap a full window
+    // of the peer's makes, or a probe.
+    static const uint32_t PROBE = Config::framing == FRAMING_BINARY ? 256 : 0;
+    static const uint32_t ACK = 4 + MAX_WINDOW_SIZE / 8;
+    static const uint32_t LARGEST = Config::maxPayload > ACK ? Config::maxPayload : ACK;
+    static const uint32_t RECV_PAYLOAD = LARGEST > PROBE ? LARGEST : PROBE;
+    // A decoded frame we can take, rounded up to whole base64 groups, and
+    // the base64 that makes one, which is longer than COBS.
+    static const uint32_t FRAME = (MAX_HEADER_SIZE + RECV_PAYLOAD + 2) / 3 * 3;
+    static const uint32_t ENCODED = FRAME / 3 * 4;
+    // The most we send at once: a probe between zeros and a newline, or a
+    // DATA packet, our ACK or options with the zero that starts binary
+    // framing.
+    static const uint32_t OWN_ACK = 4 + (Config::window + 7) / 8 > 10 ? 4 + (Config::window + 7) / 8 : 10;
+    static const uint32_t SEND_LARGEST = Config::maxPayload > OWN_ACK ? Config::maxPayload : OWN_ACK;
+    static const uint32_t SEND_FRAME = 12 + (SEND_LARGEST > PROBE ? SEND_LARGEST : PROBE);
+    static const uint32_t SEND_ENCODED = (SEND_FRAME + 2) / 3 * 4 + 3;
+};
+
+static inline uint32_t get32(const uint8_t * p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static inline void put32(uint8_t * p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline uint32_t checksum(const uint8_t * p, size_t n, uint8_t flags, uint32_t crc = 0) {
+    return (flags & FLAG_CRC32C) ? crc32c(p,n,crc) : crc32(p,n,crc);
+}
+
+// Splits the byte stream from the link into packets, one byte at a time, in
+// a buffer that holds the bytes since the last zero. In base64 the current
+// line is the tail of it; the whole may be a COBS frame once a zero ends
+// it, and the first one that is and isn't a probe switches us to COBS.
+template <class Config>
+class PacketBuilder {
+
+    public:
+        PacketBuilder() : framing(FRAMING_BASE64) , binaryAllowed(false) {
+            reset();
+        }
+
+        void allowBinary(bool on) {
+            binaryAllowed = on;
+        }
+
+        Framing getFraming() const {
+            return framing;
+        }
+
+        void reset() {
+            framing = FRAMING_BASE64;
+            used = 0;
+            lineStart = 0;
+            runBroken = false;
+            lineBroken = false;
+        }
+
+        // Calls handler(packet) for each intact packet in the n bytes.
+        template <class Handler>
+        void addData(const uint8_t * p, size_t n, Handler & handler) {
+            for(size_t i = 0; i < n; i++) {
+                uint8_t c = p[i];
+                if (c == 0 && (binaryAllowed || framing == FRAMING_BINARY)) {
+                    _zero(handler);
+                } else if (c == '\n' && framing == FRAMING_BASE64) {
+                    _newline(handler);
+                } else {
+                    _push(c);
+                }
+            }
+        }
+
+    private:
+        typedef Sizes<Config> S;
+
+        Framing framing;
+        bool binaryAllowed;
+        uint8_t run[S::ENCODED];
+        uint32_t used;
+        uint32_t lineStart;
+        // more arrived than fits, so the run can't be a COBS frame, or the
+        // line a base64 one.
+        bool runBroken;
+        bool lineBroken;
+        uint8_t frame[S::FRAME];
+        Packet packet;
+
+        // The start of the run is dropped to make room for the line, as a
+        // run that long can't be a frame anyway.
+        void _push(uint8_t c) {
+            if (used == sizeof(run) && lineStart) {
+                memmove(run,run + lineStart,used - lineStart);
+                used -= lineStart;
+                lineStart = 0;
+                runBroken = true;
+            }
+            if (used == sizeof(run)) {
+                runBroken = true;
+                lineBroken = true;
+                return;
+            }
+            run[used++] = c;
+        }
+
+        template <class Handler>
+        void _newline(Handler & handler) {
+            if (!lineBroken && used > lineStart) {
+                size_t n = b64decode(run + lineStart,used - lineStart,frame);
+                _parse(frame,n,handler);
+            }
+            lineBroken = false;
+            if (!binaryAllowed) {
+                used = 0;
+                lineStart = 0;
+                return;
+            }
+            _push('\n');
+            lineStart = used;
+        }
+
+        template <class Handler>
+        void _zero(Handler & handler) {
+            size_t n = 0;
+            if (!runBroken && used && used <= sizeof(frame) && cobsDecode(run,used,frame,n)) {
+                const Packet * parsed = _parse(frame,n,handler);
+                if (parsed && !(parsed->flags & FLAG_PROBE)) {
+                    framing = FRAMING_BINARY;
+                }
+            }
+            used = 0;
+            lineStart = 0;
+            runBroken = false;
+            lineBroken = false;
+        }
+
+        // Hands an intact packet to handler and returns it, or NULL.
+        template <class Handler>
+        const Packet * _parse(const uint8_t * d, size_t n, Handler & handler) {
+            if (n < 12 || get32(d) != checksum(d + 4,n - 4,d[7])) {
+                return NULL;
+            }
+            uint32_t t = get32(d + 4);
+            packet.type = static_cast<PacketType>(t & 0xff);
+            packet.attempt = (t >> 8) & 0xff;
+            packet.channel = (t >> 16) & 0xff;
+            packet.flags = (t >> 24) & 0xff;
+            packet.seqnum = get32(d + 8);
+            packet.ackSeqnum = 0;
+            packet.ackAttempt = 0;
+            packet.credit = 0;
+            d += 12;
+            n -= 12;
+
+            if (packet.flags & FLAG_ACK) {
+                if (n < 5) {
+                    return NULL;
+                }
+                packet.ackSeqnum = get32(d);
+                packet.ackAttempt = d[4];
+                d += 5;
+                n -= 5;
+            }
+            if (packet.flags & FLAG_CREDIT) {
+                if (n < 4) {
+                    return NULL;
+                }
+                packet.credit = get32(d);
+                d += 4;
+                n -= 4;
+            }
+            packet.data = d;
+            packet.size = n;
+            handler(packet);
+            return &packet;
+        }
+};
+
+template <class Config>
+class Protocol {
+
+    public:
+        Protocol() : state(STATE_UNINIT) , seqnum(0) , sendBase(0) , expected(0) ,
+                     lastKeepAlive(0) , lastPing(0) {
+            memset(sendSlots,0,sizeof(sendSlots));
+            memset(held,0,sizeof(held));
+            _framingReset();
+        }
+
+        void listen() {
+            _reset();
+            state = STATE_LISTENING;
+        }
+
+        template <class Sink>
+        void connect(uint64_t now, Sink & out) {
+            _reset();
+            state = STATE_CONNECTING;
+            lastKeepAlive = now;
+            lastPing = now;
+            if (FRAMING_WANT) {
+                probesSent++;
+                _sendProbe(out);
+            }
+            _sendOptions(TYPE_CON,out);
+        }
+
+        // Bytes from the link. Link bytes for the peer go to out and data
+        // for us to data.
+        template <class Sink, class DataSink>
+        void dataEvent(const uint8_t * in, size_t n, uint64_t now, Sink & out, DataSink & data) {
+            Dispatch<Sink,DataSink> dispatch(this,now,out,data);
+            pb.addData(in,n,dispatch);
+        }
+
+        template <class Sink>
+        void timerEvent(uint64_t now, Sink & out) {
+
+            if (state == STATE_UNINIT || state == STATE_LISTENING) {
+                return;
+            }
+            if (now - lastKeepAlive > TIMEOUT_INTERVAL) {
+                state = STATE_UNINIT;
+                return;
+            }
+            if (state != STATE_CONNECTED) {
+                return;
+            }
+
+            if (now - lastPing > PING_INTERVAL) {
+                lastPing = now;
+                _send(TYPE_PING,0,0,0,NULL,0,out);
+                if (framingOn && !binaryOut && probesSent < MAX_PROBES) {
+                    probesSent++;
+                    _sendProbe(out);
+                }
+            }
+
+            bool resent = false;
+            for(uint32_t seq = sendBase; seq != seqnum; seq++) {
+                Slot & slot = sendSlots[seq % Config::window];
+                if (!slot.acked && now - slot.sentAt > rtt.timeout()) {
+                    slot.sentAt = now;
+                    slot.attempt = sendAttempt(slot.sends,shared.attempts);
+                    slot.sends++;
+                    _send(TYPE_DATA,seq,slot.attempt,0,slot.data,slot.size,out);
+                    resent = true;
+                }
+            }
+            if (resent) {
+                rtt.backOff();
+            }
+        }
+
+        // Sends as much of the n bytes as the window has room for, in
+        // packets no larger than either side takes, returning how many that
+        // was.
+        template <class Sink>
+        size_t sendData(const uint8_t * data, size_t n, uint64_t now, Sink & out) {
+            uint32_t payload = Config::maxPayload < shared.peerPayload ? Config::maxPayload : shared.peerPayload;
+            size_t taken = 0;
+            while (readyForData() && taken < n) {
+                Slot & slot = sendSlots[seqnum % Config::window];
+                slot.size = n - taken < payload ? n - taken : payload;
+                memcpy(slot.data,data + taken,slot.size);
+                slot.attempt = 0;
+                slot.sends = 1;
+                slot.acked = false;
+                slot.sentAt = now;
+                _send(TYPE_DATA,seqnum,0,0,slot.data,slot.size,out);
+                seqnum++;
+                taken += slot.size;
+            }
+            return taken;
+        }
+
+        bool readyForData() const {
+            return state == STATE_CONNECTED && seqnum - sendBase < Config::window && seqnum - sendBase < shared.peerWindow;
+        }
+
+        ProtoState getState() const {
+            return state;
+        }
+
+        Framing getFraming() const {
+            return binaryOut ? FRAMING_BINARY : FRAMING_BASE64;
+        }
+
+        bool getCrc32c() const {
+            return crcOn;
+        }
+
+    private:
+        typedef Sizes<Config> S;
+
+        static const bool FRAMING_WANT = Config::framing == FRAMING_BINARY;
+        static const uint64_t PING_INTERVAL = 1000;
+        static const uint64_t TIMEOUT_INTERVAL = 10000;
+
+        struct Slot {
+            uint64_t sentAt;
+            uint32_t size;
+            // the attempt number of the latest copy, and how many were sent.
+            uint8_t attempt;
+            uint32_t sends;
+            bool acked;
+            uint8_t data[Config::maxPayload];
+        };
+
+        // A DATA packet that arrived ahead of expected.
+        struct Held {
+            uint32_t seqnum;
+            uint32_t size;
+            bool present;
+            uint8_t data[Config::maxPayload];
+        };
+
+        // Binds a dataEvent's time and sinks for the builder's callback.
+        template <class Sink, class DataSink>
+        struct Dispatch {
+            Protocol * p;
+            uint64_t now;
+            Sink & out;
+            DataSink & data;
+            Dispatch(Protocol * pp, uint64_t t, Sink & o, DataSink & d) : p(pp) , now(t) , out(o) , data(d) {}
+            void operator()(const Packet & packet) {
+                p->_packetEvent(packet,now,out,data);
+            }
+        };
+
+        ProtoState state;
+        PacketBuilder<Config> pb;
+
+        // DATA we sent, in sendSlots[seq % window] from sendBase up to seqnum.
+        Slot sendSlots[Config::window];
+        uint32_t seqnum;
+        uint32_t sendBase;
+        // DATA received, in held[seq % window] past expected.
+        Held held[Config::window];
+        uint32_t expected;
+
+        uint64_t lastKeepAlive;
+        uint64_t lastPing;
+        RttEstimator rtt;
+
+        // as in Protocol.
+        bool framingOn;
+        bool crcOn;
+        bool peerProbeOk;
+        bool binaryOut;
+        bool binaryStarted;
+        uint32_t probesSent;
+        // we never send ACKs on DATA, but take them, and say so.
+        SharedOptions shared;
+
+        uint8_t wire[S::SEND_ENCODED];
+
+        void _framingReset() {
+            framingOn = false;
+            crcOn = false;
+            peerProbeOk = false;
+            binaryOut = false;
+            binaryStarted = false;
+            probesSent = 0;
+            pb.reset();
+            pb.allowBinary(FRAMING_WANT);
+        }
+
+        void _reset() {
+            seqnum = 0;
+            sendBase = 0;
+            expected = 0;
+            rtt.backoff = 0;
+            shared.reset();
+            for(uint32_t i = 0; i < Config::window; i++) {
+                held[i].present = false;
+            }
+            _framingReset();
+        }
+
+        template <class Sink, class DataSink>
+        void _packetEvent(const Packet & packet, uint64_t now, Sink & out, DataSink & data) {
+
+            if (state == STATE_CONNECTED) {
+                lastKeepAlive = now;
+            }
+
+            if (packet.type == TYPE_ACK) {
+                _handleAck(packet,now);
+            }
+            if (packet.flags & FLAG_ACK) {
+                if (packet.ackSeqnum > 0) {
+                    _ackOne(packet.ackSeqnum - 1,packet.ackAttempt,now,true);
+                }
+                _ackBelow(packet.ackSeqnum);
+            }
+
+            if (state == STATE_CONNECTED && packet.type == TYPE_DATA) {
+                _receiveData(packet,out,data);
+            }
+
+            if (packet.type == TYPE_PING && (packet.flags & FLAG_PROBE) && FRAMING_WANT && !peerProbeOk) {
+                bool intact = packet.size == 256;
+                for(uint32_t i = 0; intact && i < 256; i++) {
+                    intact = packet.data[i] == i;
+                }
+                // everything we send from now on says so, starting with the
+                // CONACK if we aren't connected yet.
+                peerProbeOk = intact;
+                if (intact && state == STATE_CONNECTED) {
+                    _send(TYPE_PING,0,0,0,NULL,0,out);
+                }
+            }
+
+            if (state == STATE_LISTENING && packet.type == TYPE_CON) {
+                state = STATE_CONNECTED;
+                lastKeepAlive = now;
+                lastPing = now;
+                _applyOptions(packet);
+                if (framingOn) {
+                    probesSent++;
+                    _sendProbe(out);
+                }
+                _sendOptions(TYPE_CONACK,out);
+            }
+
+            if (state == STATE_CONNECTING && packet.type == TYPE_CONACK) {
+                state = STATE_CONNECTED;
+                lastKeepAlive = now;
+                lastPing = now;
+                _applyOptions(packet);
+            }
+
+            if (state == STATE_CONNECTED && (packet.flags & FLAG_CLEAN) && framingOn) {
+                binaryOut = true;
+            }
+        }
+
+        void _applyOptions(const Packet & packet) {
+            framingOn = false;
+            crcOn = false;
+            shared.reset();
+            OptionReader option(packet.data,packet.size);
+            while (option.next()) {
+                if (option.opt == OPT_FRAMING && FRAMING_WANT) {
+                    framingOn = true;
+                }
+                if (option.opt == OPT_CHECKSUM && option.len >= 1 && option.value[0] == 1 && Config::crc32c) {
+                    crcOn = true;
+                }
+                shared.apply(option);
+            }
+        }
+
+        // Our CON, or the CONACK with what was agreed.
+        template <class Sink>
+        void _sendOptions(PacketType type, Sink & out) {
+            bool framing = framingOn;
+            bool crc = crcOn;
+            if (type == TYPE_CON) {
+                framing = FRAMING_WANT;
+                crc = Config::crc32c;
+            }
+            uint8_t options[10 + SharedOptions::SIZE];
+            uint32_t n = 0;
+            if (framing) {
+                options[n++] = OPT_FRAMING;
+                options[n++] = 0;
+            }
+            if (crc) {
+                options[n++] = OPT_CHECKSUM;
+                options[n++] = 1;
+                options[n++] = 1;
+            }
+            n += shared.write(options + n,type == TYPE_CONACK);
+            options[n++] = OPT_LIMITS;
+            options[n++] = 3;
+            options[n++] = Config::maxPayload & 0xff;
+            options[n++] = Config::maxPayload >> 8;
+            options[n++] = Config::window < 255 ? Config::window : 255;
+            _send(type,0,0,0,options,n,out);
+        }
+
+        // In order data goes straight out, and anything after it that was
+        // held. Packets past the window, or larger than we can hold out of
+        // order, go unacknowledged for the peer to send again.
+        template <class Sink, class DataSink>
+        void _receiveData(const Packet & packet, Sink & out, DataSink & data) {
+            bool deliverable = packet.channel == 0 && !(packet.flags & (FLAG_CONTROL | FLAG_COMPRESSED));
+
+            if (packet.seqnum == expected) {
+                if (deliverable) {
+                    data.write(packet.data,packet.size);
+                }
+                expected++;
+                Held * h = &held[expected % Config::window];
+                while (h->present && h->seqnum == expected) {
+                    data.write(h->data,h->size);
+                    h->present = false;
+                    expected++;
+                    h = &held[expected % Config::window];
+                }
+            } else if (packet.seqnum > expected) {
+                if (packet.seqnum - expected >= Config::window || packet.size > Config::maxPayload) {
+                    return;
+                }
+                Held & h = held[packet.seqnum % Config::window];
+                if (!h.present && deliverable) {
+                    h.present = true;
+                    h.seqnum = packet.seqnum;
+                    h.size = packet.size;
+                    memcpy(h.data,packet.data,packet.size);
+                }
+            }
+
+            // named packet, next expected and a bitmap of what we hold past it.
+            uint8_t ack[4 + (Config::window + 7) / 8];
+            memset(ack,0,sizeof(ack));
+            put32(ack,expected);
+            uint32_t n = 4;
+            for(uint32_t i = 1; i < Config::window; i++) {
+                const Held & h = held[(expected + i) % Config::window];
+                if (h.present && h.seqnum == expected + i) {
+                    ack[4 + (i - 1) / 8] |= 1 << ((i - 1) % 8);
+                    n = 4 + (i - 1) / 8 + 1;
+                }
+            }
+            _send(TYPE_ACK,packet.seqnum,packet.attempt,0,ack,n,out);
+        }
+
+        void _handleAck(const Packet & packet, uint64_t now) {
+            _ackOne(packet.seqnum,packet.attempt,now,true);
+            if (packet.size >= 4) {
+                uint32_t cumulative = get32(packet.data);
+                _ackBelow(cumulative);
+                for(uint32_t i = 4; i < packet.size; i++) {
+                    for(uint32_t bit = 0; bit < 8; bit++) {
+                        if (packet.data[i] & (1 << bit)) {
+                            _ackOne(cumulative + 1 + (i - 4) * 8 + bit,0,now,false);
+                        }
+                    }
+                }
+            }
+        }
+
+        void _ackOne(uint32_t seq, uint8_t attempt, uint64_t now, bool explicitAck) {
+            if (seq - sendBase >= seqnum - sendBase) {
+                return;
+            }
+            Slot & slot = sendSlots[seq % Config::window];
+            if (slot.acked) {
+                return;
+            }
+            slot.acked = true;
+            lastKeepAlive = now;
+            rtt.backoff = 0;
+            if (explicitAck && isRttSample(attempt,slot.attempt,slot.sends,shared.attempts)) {
+                rtt.sample(now - slot.sentAt);
+            }
+            while (sendBase != seqnum && sendSlots[sendBase % Config::window].acked) {
+                sendBase++;
+            }
+        }
+
+        void _ackBelow(uint32_t cumulative) {
+            while (sendBase != seqnum && sendBase < cumulative) {
+                sendSlots[sendBase % Config::window].acked = true;
+                sendBase++;
+            }
+        }
+
+        // The header and checksum of a packet, then its payload, framed.
+        template <class Sink>
+        void _send(PacketType type, uint32_t seq, uint8_t attempt, uint8_t flags,
+                   const uint8_t * data, size_t n, Sink & out) {
+            if (peerProbeOk) {
+                flags |= FLAG_CLEAN;
+            }
+            if (crcOn) {
+                flags |= FLAG_CRC32C;
+            }
+
+            uint8_t header[12 + 2];
+            put32(header + 4,static_cast<uint32_t>(type) | (attempt << 8) | (flags << 24));
+            put32(header + 8,seq);
+            put32(header,checksum(data,n,flags,checksum(header + 4,8,flags)));
+
+            size_t len = 0;
+            if (binaryOut && !(flags & FLAG_PROBE)) {
+                if (!binaryStarted) {
+                    wire[len++] = 0;
+                    binaryStarted = true;
+                }
+                len += _cobs(header,data,n,wire + len);
+                out.write(wire,len);
+                return;
+            }
+
+            // 12 header bytes are whole base64 groups.
+            len = b64encode(header,12,wire);
+            len += b64encode(data,n,wire + len);
+            wire[len++] = '\n';
+            out.write(wire,len);
+        }
+
+        template <class Sink>
+        void _sendProbe(Sink & out) {
+            if (binaryStarted) {
+                return;
+            }
+            uint8_t all[256];
+            for(uint32_t i = 0; i < 256; i++) {
+                all[i] = i;
+            }
+            uint8_t flags = FLAG_PROBE | (peerProbeOk ? FLAG_CLEAN : 0) | (crcOn ? FLAG_CRC32C : 0);
+            uint8_t header[12];
+            put32(header + 4,static_cast<uint32_t>(TYPE_PING) | (flags << 24));
+            put32(header + 8,0);
+            put32(header,checksum(all,256,flags,checksum(header + 4,8,flags)));
+
+            size_t len = 0;
+            wire[len++] = 0;
+            len += _cobs(header,all,256,wire + len);
+            wire[len++] = '\n';
+            out.write(wire,len);
+        }
+
+        // COBS frame with its delimiter.
+        static size_t _cobs(const uint8_t * header, const uint8_t * data, size_t n, uint8_t * to) {
+            CobsEncoder encoder(to);
+            encoder.add(header,12);
+            encoder.add(data,n);
+            size_t len = encoder.finish();
+            to[len] = 0;
+            return len + 1;
+        }
+};
+
+}
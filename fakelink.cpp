@@ -1,5 +1,8 @@
 #include <unistd.h>
-#include <sys/select.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
 #include <stdint.h>
 #include <cstdlib>
 #include <string>
@@ -60,13 +63,10 @@ static int write_loop(int fd, uint8_t *buf, uint32_t size)
     while (p - buf < size) {
         n = write(fd, p, size - (p - buf));
         if (n == -1) {
-            break;
+            return -1;
         }
         p += n;
     }
-    if((p - buf) > size) {
-        return -1;
-    }
     return 0;
 }
 
@@ -80,6 +80,58 @@ void doCorruption(uint8_t * data,uint32_t size,double errRate) {
     }
 }
 
+static uint64_t nowMicros() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC,&t);
+    return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+// Most moved at once, by one splice or one read and write.
+static const size_t MAX_MOVE = 1 << 16;
+
+// One way through the link, from in to out.
+struct Direction {
+    int in;
+    int out;
+    // the last move found out full, so wait for it rather than for in
+    bool outFull;
+    // in came to an end, and out has been closed to pass that on
+    bool closed;
+    // whether splice works between in and out, it wants a pipe on one side
+    bool splice;
+    // bytes that may go now, topped up at bps a second to at most burst, so
+    // a busy link moves a few large chunks rather than a sleep per byte
+    double tokens;
+    uint64_t filled;
+};
+
+// Moves what it can from d.in to d.out, up to max bytes. Returns what was
+// moved, 0 at end of file, or -1 with errno EAGAIN when d.out is full.
+// Data to be corrupted has to come through here, everything else is
+// spliced from one pipe to the other without being copied.
+static ssize_t moveSome(Direction & d, size_t max, bool corrupt, double errRate) {
+    if (d.splice && !corrupt) {
+        ssize_t n = splice(d.in,NULL,d.out,NULL,max,SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n >= 0 || errno != EINVAL) {
+            return n;
+        }
+        d.splice = false;
+    }
+    
+    static uint8_t buff[MAX_MOVE];
+    ssize_t n = read(d.in,buff,max < sizeof(buff) ? max : sizeof(buff));
+    if (n <= 0) {
+        return n;
+    }
+    if(corrupt) {
+        doCorruption(buff,n,errRate);
+    }
+    if(write_loop(d.out,buff,n) != 0) {
+        return -1;
+    }
+    return n;
+}
+
 int main(int argc, char * argv[]) {
     
     int opt;
@@ -110,61 +162,87 @@ int main(int argc, char * argv[]) {
     
     subexec(&argv[optind],&childpid,&childin,&childout);
     
-    uint8_t buff[64]; //deliberately small so we can control speeds finely
+    // a chunk no bigger than 20ms of the rate, and no smaller than the 64
+    // bytes it used to go in, and a wait for a quarter of that when empty
+    double burst = 0;
+    double refill = 0;
+    if (speedlimit) {
+        burst = bps / 50.0 > 64 ? bps / 50.0 : 64;
+        refill = burst / 4;
+    }
     
-    int maxfd = (STDIN_FILENO > childout) ? STDIN_FILENO : childout;
+    uint64_t now = nowMicros();
+    Direction dirs[2] = {
+        { STDIN_FILENO, childin, false, false, true, burst, now },
+        { childout, STDOUT_FILENO, false, false, true, burst, now }
+    };
     
-    for (;;) {
+    // until both ways have come to an end, so what is still on its way
+    // out of the child isn't lost when stdin ends
+    while (!dirs[0].closed || !dirs[1].closed) {
         
-        fd_set fds;
-        int r, n_r;
-
-        FD_ZERO(&fds);
-        FD_SET(childout, &fds);
-        FD_SET(STDIN_FILENO, &fds);
-
-        r = select(maxfd + 1, &fds, NULL, NULL, NULL);
+        struct pollfd fds[2];
+        int64_t wait = -1;
+        now = nowMicros();
+        
+        for(int i = 0; i < 2; i++) {
+            Direction & d = dirs[i];
+            fds[i].events = 0;
+            fds[i].revents = 0;
+            fds[i].fd = -1;
+            if (d.closed) {
+                continue;
+            }
+            if (speedlimit) {
+                d.tokens += (now - d.filled) * (double)bps / 1000000;
+                d.tokens = d.tokens < burst ? d.tokens : burst;
+                d.filled = now;
+                if (d.tokens < refill) {
+                    int64_t until = (refill - d.tokens) * 1000000 / bps + 1;
+                    wait = wait < 0 || until < wait ? until : wait;
+                    continue;
+                }
+            }
+            fds[i].fd = d.outFull ? d.out : d.in;
+            fds[i].events = d.outFull ? POLLOUT : POLLIN;
+        }
+        
+        struct timespec t = { (time_t)(wait / 1000000), (long)(wait % 1000000) * 1000 };
+        int r = ppoll(fds, 2, wait < 0 ? NULL : &t, NULL);
         
         if(r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             break;
         }
         
-        if (FD_ISSET(STDIN_FILENO, &fds)) {
-            n_r = read(STDIN_FILENO, buff, sizeof(buff));
-            if (n_r <= 0) {
-                break;
-            }
-            
-            
-            if(corrupt) {
-                doCorruption(buff,n_r,err_rate);
+        bool done = false;
+        for(int i = 0; i < 2 && !done; i++) {
+            Direction & d = dirs[i];
+            if (!fds[i].revents) {
+                continue;
             }
-            
-            if(speedlimit) {
-                usleep((n_r * 1000000)  / bps);
+            if (d.outFull) {
+                // in is looked at again next time round
+                d.outFull = false;
+                continue;
             }
-            
-            if(write_loop(childin, buff, n_r) != 0) {
-                break;
+            size_t max = speedlimit && d.tokens < MAX_MOVE ? (size_t)d.tokens : MAX_MOVE;
+            ssize_t n_r = moveSome(d,max,corrupt,err_rate);
+            if (n_r < 0 && errno == EAGAIN) {
+                d.outFull = true;
+            } else if (n_r == 0) {
+                close(d.out);
+                d.closed = true;
+            } else if (n_r < 0) {
+                done = true;
+            } else {
+                d.tokens -= n_r;
             }
         }
-        if (FD_ISSET(childout, &fds)) {
-            n_r = read(childout, buff, sizeof(buff));
-            if (n_r <= 0) {
-                break;
-            }
-            
-            if(corrupt) {
-                doCorruption(buff,n_r,err_rate);
-            }
-            
-            if(speedlimit) {
-                usleep((n_r * 1000000)  / bps);
-            }
-            
-            if(write_loop(STDOUT_FILENO, buff, n_r) != 0) {
-                break;
-            }
+        if (done) {
+            break;
         }
     }
     
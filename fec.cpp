@@ -0,0 +1,70 @@
+#include "fec.h"
+
+#include <cstring>
+
+
+ParityAccumulator::ParityAccumulator() : length(0) , n(0) {
+
+}
+
+ParityAccumulator::ParityAccumulator(const std::vector<uint8_t> & parity) : length(0) , n(0) {
+    if (parity.size() < 2) {
+        return;
+    }
+    length = parity[0] | (parity[1] << 8);
+    bytes.assign(parity.begin() + 2,parity.end());
+}
+
+void ParityAccumulator::add(const std::vector<uint8_t> & payload) {
+    
+    if (bytes.size() < payload.size()) {
+        bytes.resize(payload.size(),0);
+    }
+    
+    // word at a time where we can, this runs over every byte sent and
+    // received while FEC is on.
+    size_t i = 0;
+    size_t sz = payload.size();
+    uint8_t * out = bytes.empty() ? 0 : &bytes[0];
+    const uint8_t * in = payload.empty() ? 0 : &payload[0];
+    
+    for(; i + sizeof(uint64_t) <= sz; i += sizeof(uint64_t)) {
+        uint64_t a, b;
+        memcpy(&a,out + i,sizeof(a));
+        memcpy(&b,in + i,sizeof(b));
+        a ^= b;
+        memcpy(out + i,&a,sizeof(a));
+    }
+    for(; i < sz; i++) {
+        out[i] ^= in[i];
+    }
+    
+    length ^= payload.size();
+    n += 1;
+}
+
+void ParityAccumulator::reset() {
+    length = 0;
+    n = 0;
+    bytes.clear();
+}
+
+uint32_t ParityAccumulator::count() const {
+    return n;
+}
+
+std::vector<uint8_t> ParityAccumulator::encode() const {
+    std::vector<uint8_t> ret;
+    ret.reserve(bytes.size() + 2);
+    ret.push_back(length & 0xff);
+    ret.push_back(length >> 8);
+    ret.insert(ret.end(),bytes.begin(),bytes.end());
+    return ret;
+}
+
+std::vector<uint8_t> ParityAccumulator::payload() const {
+    if (length > bytes.size()) {
+        return std::vector<uint8_t>();
+    }
+    return std::vector<uint8_t>(bytes.begin(),bytes.begin() + length);
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+// XOR parity over a group of packet payloads. Encoded parity is the XOR of
+// the payload lengths (2 bytes, little endian) followed by the XOR of the
+// payloads, each zero padded to the longest. Given the parity and all but one
+// payload of the group, adding them all to an accumulator leaves the missing
+// payload.
+
+class ParityAccumulator {
+    
+    public:
+        ParityAccumulator();
+        ParityAccumulator(const std::vector<uint8_t> & parity);
+        
+        void add(const std::vector<uint8_t> & payload);
+        void reset();
+        uint32_t count() const;
+        
+        std::vector<uint8_t> encode() const;
+        std::vector<uint8_t> payload() const;
+    
+    private:
+        uint16_t length;
+        uint32_t n;
+        std::vector<uint8_t> bytes;
+};
@@ -0,0 +1,98 @@
+#include "pipeline.h"
+
+#include <sched.h>
+
+LinkPipeline::LinkPipeline(int in, int out) : in(in) , out(out) , started(false) {
+
+}
+
+LinkPipeline::~LinkPipeline() {
+    stop();
+}
+
+bool LinkPipeline::start(int readerCpu, int writerCpu) {
+    if (pthread_create(&reader,NULL,_read,this)) {
+        return false;
+    }
+    if (pthread_create(&writer,NULL,_write,this)) {
+        pthread_cancel(reader);
+        pthread_join(reader,NULL);
+        return false;
+    }
+    started = true;
+    return pinThread(reader,readerCpu) && pinThread(writer,writerCpu);
+}
+
+void LinkPipeline::stop() {
+    if (!started) {
+        return;
+    }
+    started = false;
+    fromLink.close();
+    toLink.close();
+    pthread_join(writer,NULL);
+    // the reader may be blocked in read, which is a cancellation point.
+    pthread_cancel(reader);
+    pthread_join(reader,NULL);
+}
+
+void * LinkPipeline::_read(void * self) {
+    LinkPipeline * l = static_cast<LinkPipeline *>(self);
+    for (;;) {
+        size_t room;
+        uint8_t * to = l->fromLink.writable(room);
+        if (!room) {
+            l->fromLink.waitForRoom();
+            if (l->fromLink.closed()) {
+                break;
+            }
+            continue;
+        }
+        // straight into the ring, no copy.
+        ssize_t n = read(l->in,to,room);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        l->fromLink.produce(n);
+    }
+    l->fromLink.close();
+    return NULL;
+}
+
+void * LinkPipeline::_write(void * self) {
+    LinkPipeline * l = static_cast<LinkPipeline *>(self);
+    for (;;) {
+        size_t n;
+        const uint8_t * from = l->toLink.readable(n);
+        if (!n) {
+            if (l->toLink.closed()) {
+                break;
+            }
+            l->toLink.waitForData();
+            continue;
+        }
+        ssize_t w = write(l->out,from,n);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            break;
+        }
+        l->toLink.consume(w);
+    }
+    l->toLink.close();
+    return NULL;
+}
+
+bool pinThread(pthread_t thread, int cpu) {
+    if (cpu < 0) {
+        return true;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu,&set);
+    return pthread_setaffinity_np(thread,sizeof(set),&set) == 0;
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include "spsc.h"
+
+#include <pthread.h>
+
+// Bytes each way between the link threads and the protocol thread.
+static const uint32_t LINK_RING_SIZE = 1 << 16;
+
+// Threads of their own for the link side of a proxy. The reader moves
+// whatever arrives on the link into fromLink the moment it arrives, so a
+// UART is drained however long the protocol thread spends writing to a slow
+// consumer, and the writer moves toLink onto the link. Neither ever touches
+// application I/O.
+class LinkPipeline {
+
+    public:
+        LinkPipeline(int in, int out);
+        ~LinkPipeline();
+
+        // Starts both threads, each pinned to a cpu unless it is -1.
+        bool start(int readerCpu = -1, int writerCpu = -1);
+        // Lets the writer finish what is in toLink, then stops both.
+        void stop();
+
+        // the reader closes fromLink at end of file or on an error, the
+        // writer closes toLink on an error.
+        SpscRing<LINK_RING_SIZE> fromLink;
+        SpscRing<LINK_RING_SIZE> toLink;
+
+    private:
+        int in;
+        int out;
+        pthread_t reader;
+        pthread_t writer;
+        bool started;
+
+        static void * _read(void * self);
+        static void * _write(void * self);
+};
+
+// Pins a thread to one cpu, a cpu below 0 leaves it alone.
+bool pinThread(pthread_t thread, int cpu);
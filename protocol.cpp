@@ -2,33 +2,153 @@
 
 #include <iostream>
 #include <cstdio>
+#include <cmath>
 #include <algorithm>
 #include "base64.h"
+#include "cobs.h"
+#include "crc.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // Protocol Packet
 
-ProtocolPacket::ProtocolPacket(PacketType t) : type(t) , seqnum(0) {
+ProtocolPacket::ProtocolPacket(PacketType t) : type(t) , seqnum(0) , attempt(0) , channel(0) , flags(0) , ackSeqnum(0) , ackAttempt(0) , credit(0) {
 
 }
 
-ProtocolPacket::ProtocolPacket(PacketType t, uint32_t seq) : type(t) , seqnum(seq) {
+ProtocolPacket::ProtocolPacket(PacketType t, uint32_t seq) : type(t) , seqnum(seq) , attempt(0) , channel(0) , flags(0) , ackSeqnum(0) , ackAttempt(0) , credit(0) {
 
 }
 
 ProtocolPacket::ProtocolPacket(PacketType t,uint32_t seq, char data_in[] , uint32_t n ) 
-    : type(t) , seqnum(seq) , data(data_in,data_in + n) {
+    : type(t) , seqnum(seq) , attempt(0) , channel(0) , flags(0) , ackSeqnum(0) , ackAttempt(0) , credit(0) , data(reinterpret_cast<uint8_t *>(data_in),n) {
 
 }
 
 ProtocolPacket::ProtocolPacket(PacketType t,uint32_t seq, std::string d ) 
-    : type(t) , seqnum(seq) , data(d.begin(),d.end()) {
+    : type(t) , seqnum(seq) , attempt(0) , channel(0) , flags(0) , ackSeqnum(0) , ackAttempt(0) , credit(0) , data(reinterpret_cast<const uint8_t *>(d.data()),d.size()) {
+
+}
+
+
+ProtocolPacket::ProtocolPacket(PacketType t,uint32_t seq, const PacketBuffer & d ) 
+    : type(t) , seqnum(seq) , attempt(0) , channel(0) , flags(0) , ackSeqnum(0) , ackAttempt(0) , credit(0) , data(d) {
+
+}
+
+InFlightPacket::InFlightPacket()
+    : packet(TYPE_DATA) , lastSendAttempt(0) , attempts(0) , acked(false) , frameFlags(0) {
+
+}
+
+InFlightPacket::InFlightPacket(const ProtocolPacket & p, uint64_t now)
+    : packet(p) , lastSendAttempt(now) , attempts(1) , acked(false) , frameFlags(0) {
+
+}
+
+ChannelEvent::ChannelEvent(ChannelEventType t, uint8_t ch, const std::string & tgt)
+    : type(t) , channel(ch) , target(tgt) {
+
+}
+
+SendChannel::SendChannel()
+    : weight(1) , finish(0) , openPending(false) , closePending(false) , closed(false) , peerClosed(false) ,
+      sentBytes(0) , peerLimit(0) , recvConsumed(0) , advertisedConsumed(0) {
+
+}
+
+// Link Quality
+
+LinkQuality::LinkQuality() {
+    total = 0;
+    for(int i = 0; i < NBUCKETS; i++) {
+        sent[i] = 0;
+        failed[i] = 0;
+    }
+}
 
+void LinkQuality::record(uint32_t frameSize, bool ok) {
+    int b = 0;
+    while (b < NBUCKETS - 1 && (2u << b) <= frameSize) {
+        b++;
+    }
+    total += 1;
+    sent[b] += 1;
+    if (!ok) {
+        failed[b] += 1;
+    }
+    //decay old results so we track changes in line quality
+    if (sent[b] > 512) {
+        sent[b] /= 2;
+        failed[b] /= 2;
+    }
 }
 
+// Each bucket gives an estimate of the per byte corruption rate e from its
+// failure rate f and typical frame size n, as f = 1 - (1 - e)^n. The buckets
+// are averaged weighted by how many frames they saw.
+double LinkQuality::byteErrorRate() const {
+    double total = 0;
+    double weighted = 0;
+    for(int b = 0; b < NBUCKETS; b++) {
+        if (sent[b] == 0) {
+            continue;
+        }
+        double n = 1.5 * (1 << b);
+        double f = failed[b] / sent[b];
+        if (f > 0.999) {
+            f = 0.999;
+        }
+        weighted += sent[b] * (1 - pow(1 - f, 1 / n));
+        total += sent[b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    return weighted / total;
+}
 
-ProtocolPacket::ProtocolPacket(PacketType t,uint32_t seq, std::vector<uint8_t> d ) 
-    : type(t) , seqnum(seq) , data(d) {
+uint32_t LinkQuality::samples() const {
+    return total;
+}
 
+uint32_t LinkQuality::bestPayloadSize(uint32_t maxPayload, Framing framing) const {
+    if (total == 0) {
+        return std::min(DEFAULT_PAYLOAD_SIZE,maxPayload);
+    }
+    
+    double e = byteErrorRate();
+    uint32_t best = MIN_PAYLOAD_SIZE;
+    double bestGoodput = -1;
+    
+    for(uint32_t sz = MIN_PAYLOAD_SIZE; ; sz += sz / 4) {
+        if (sz > maxPayload) {
+            sz = maxPayload;
+        }
+        double n = (sz + PACKET_OVERHEAD) * 4.0 / 3 + 1;
+        if (framing == FRAMING_BINARY) {
+            n = (sz + PACKET_OVERHEAD) * 255.0 / 254 + 2;
+        }
+        double goodput = (sz / n) * pow(1 - e, n);
+        if (goodput > bestGoodput) {
+            bestGoodput = goodput;
+            best = sz;
+        }
+        if (sz == maxPayload) {
+            break;
+        }
+    }
+    return best;
+}
+
+uint32_t
+encodedFrameSize(uint32_t payloadSize, Framing framing) {
+    if (framing == FRAMING_BINARY) {
+        return cobsMaxEncodedSize(payloadSize + PACKET_OVERHEAD) + 1;
+    }
+    return ((payloadSize + PACKET_OVERHEAD + 2) / 3) * 4 + 1;
 }
 
 // Protocol
@@ -41,21 +161,360 @@ Protocol::Protocol() {
     this->lastPingSendTime = 0;
     this->pingInterval = 1000;
     this->timeoutInterval = this->pingInterval * 10;
-    this->lastSendAttempt = 0;
-    this->backoff = 0;
-    this->sendAttemptInterval = 500;
+    this->windowSize = 8;
+    this->maxPayloadSize = MAX_PAYLOAD_SIZE;
+    this->targetPayloadSize = DEFAULT_PAYLOAD_SIZE;
+    this->lastResizeSamples = 0;
+    this->channelsWant = true;
+    this->channelsOn = false;
+    this->ackPending = 0;
+    this->ackPendingSince = 0;
+    this->pendingAckSeqnum = 0;
+    this->pendingAckAttempt = 0;
+    this->fecWantGroup = 0;
+    this->fecWantDepth = 0;
+    this->fecGroup = 0;
+    this->fecDepth = 0;
+    this->compressWant = false;
+    this->compressOn = false;
+    this->recvBufferSize = 0;
+    this->framingWant = false;
+    this->crcWant = false;
+    this->initiator = false;
+    this->linkFull = false;
+    _channelReset();
+    _flowReset();
+    _framingReset();
 }
 
 ProtoState Protocol::getState() const {
     return state;
 }
 
-std::vector<ProtocolPacket> Protocol::_timerEvent(uint64_t now) {
+void Protocol::setWindowSize(uint32_t n) {
+    if (n < 1) {
+        n = 1;
+    }
+    if (n > MAX_WINDOW_SIZE) {
+        n = MAX_WINDOW_SIZE;
+    }
+    this->windowSize = n;
+}
+
+uint64_t Protocol::getSmoothedRtt() const {
+    return this->rtt.smoothed();
+}
+
+uint64_t Protocol::getRetransmitTimeout() const {
+    return this->rtt.timeout();
+}
+
+// The earliest time at which timerEvent has something to do, if nothing else
+// happens first: a PING, the keepalive running out, a delayed ACK or window
+// update, a retransmission, or queued data the window has room for. Callers
+// can sleep until then rather than polling, and call timerEvent on waking.
+// Data held back by a full link sink only counts once a call finds it has
+// room again, so a caller draining the link should call timerEvent after.
+uint64_t Protocol::nextTimerEvent(uint64_t now) const {
+    
+    if (this->state == STATE_UNINIT || this->state == STATE_LISTENING) {
+        return NO_TIMER_EVENT;
+    }
+    
+    uint64_t next = this->lastKeepAlive + this->timeoutInterval + 1;
+    
+    if (this->state == STATE_CONNECTED) {
+        next = std::min(next,this->lastPingSendTime + this->pingInterval + 1);
+        
+        if (this->ackPending) {
+            next = std::min(next,this->ackPendingSince + DELAYED_ACK_TIMEOUT);
+        } else if (this->flowOn && this->recvConsumed - this->advertisedConsumed >= this->recvBufferSize / 2) {
+            return now;
+        }
+        
+        uint64_t rto = getRetransmitTimeout();
+        for(SendWindow::const_iterator it = this->sendWindow.begin(); it != this->sendWindow.end() ; it++) {
+            if (!it->acked) {
+                next = std::min(next,it->lastSendAttempt + rto + 1);
+            }
+        }
+        
+        if (!this->linkFull && this->sendWindow.size() < std::min(this->windowSize,this->shared.peerWindow)
+            && _nextChannel() >= 0) {
+            return now;
+        }
+    }
+    
+    return std::max(next,now);
+}
+
+void Protocol::setMaxPayloadSize(uint32_t n) {
+    if (n < MIN_PAYLOAD_SIZE) {
+        n = MIN_PAYLOAD_SIZE;
+    }
+    if (n > MAX_PAYLOAD_SIZE) {
+        n = MAX_PAYLOAD_SIZE;
+    }
+    this->maxPayloadSize = n;
+    this->targetPayloadSize = std::min(this->targetPayloadSize,n);
+}
+
+uint32_t Protocol::getTargetPayloadSize() const {
+    return this->targetPayloadSize;
+}
+
+// Asks for FEC on the next connection. A group of zero turns it off.
+void Protocol::setFec(uint32_t group, uint32_t depth) {
+    if (group == 0) {
+        this->fecWantGroup = 0;
+        this->fecWantDepth = 0;
+        return;
+    }
+    this->fecWantGroup = std::max(MIN_FEC_GROUP,std::min(group,MAX_FEC_GROUP));
+    this->fecWantDepth = std::max(1u,std::min(depth,MAX_FEC_DEPTH));
+}
+
+uint32_t Protocol::getFecGroup() const {
+    return this->fecGroup;
+}
+
+uint32_t Protocol::getFecDepth() const {
+    return this->fecDepth;
+}
+
+// Asks for compression on the next connection.
+void Protocol::setCompression(bool on) {
+    this->compressWant = on;
+}
+
+bool Protocol::getCompression() const {
+    return this->compressOn;
+}
+
+// Turns on flow control for the next connection, if the peer supports it.
+// The application must then report with dataConsumed() as it disposes of
+// received data, or the peer will stop sending. Zero turns it off.
+void Protocol::setReceiveBuffer(uint32_t bytes) {
+    if (bytes && bytes < MIN_RECEIVE_BUFFER) {
+        bytes = MIN_RECEIVE_BUFFER;
+    }
+    this->recvBufferSize = bytes;
+}
+
+// Frees receive credit once the application has written out, or thrown
+// away, data that the protocol handed it on the channel. If the peer's view
+// of our credit has fallen half a buffer behind, the next timer event tells
+// it.
+void Protocol::dataConsumed(uint32_t bytes, uint8_t channel) {
+    if (channel == 0) {
+        this->recvConsumed += bytes;
+        return;
+    }
+    std::map<uint8_t,SendChannel>::iterator it = this->channels.find(channel);
+    if (it != this->channels.end()) {
+        it->second.recvConsumed += bytes;
+    }
+}
+
+void Protocol::_flowReset() {
+    this->flowOn = false;
+    this->recvConsumed = 0;
+    this->advertisedConsumed = 0;
+    this->sentBytes = 0;
+    this->peerLimit = 0;
+    this->peerBufferSize = 0;
+}
+
+void Protocol::_stampCredit(ProtocolPacket & packet) {
+    if (!this->flowOn) {
+        return;
+    }
+    packet.flags |= FLAG_CREDIT;
+    packet.credit = this->recvConsumed + this->recvBufferSize;
+    this->advertisedConsumed = this->recvConsumed;
+}
+
+// Application bytes we may still send on the channel before the peer's
+// buffer for it is full. The counters wrap, so this is only meaningful as a
+// signed difference.
+int32_t Protocol::_sendCredit(uint8_t channel) const {
+    if (!this->flowOn) {
+        return INT32_MAX;
+    }
+    if (channel == 0) {
+        return static_cast<int32_t>(this->peerLimit - this->sentBytes);
+    }
+    std::map<uint8_t,SendChannel>::const_iterator it = this->channels.find(channel);
+    if (it == this->channels.end()) {
+        return 0;
+    }
+    return static_cast<int32_t>(it->second.peerLimit - it->second.sentBytes);
+}
+
+// Whether the peer's view of our credit on a channel other than 0 has
+// fallen half a buffer behind, while it may still send on it.
+bool Protocol::_channelCreditDue(uint8_t id, const SendChannel & ch) const {
+    return this->flowOn && id != 0 && !ch.peerClosed
+           && ch.recvConsumed - ch.advertisedConsumed >= this->recvBufferSize / 2;
+}
+
+void Protocol::setBinaryFraming(bool on) {
+    this->framingWant = on;
+    this->pb.allowBinary(on);
+}
+
+void Protocol::setCrc32c(bool on) {
+    this->crcWant = on;
+}
+
+void Protocol::setChannels(bool on) {
+    this->channelsWant = on;
+}
+
+bool Protocol::getCrc32c() const {
+    return this->crcOn;
+}
+
+// The framing of what we send. The peer may be at a different stage.
+Framing Protocol::getFraming() const {
+    return this->binaryOut ? FRAMING_BINARY : FRAMING_BASE64;
+}
+
+void Protocol::_framingReset() {
+    this->framingOn = false;
+    this->crcOn = false;
+    this->peerProbeOk = false;
+    this->cleanPending = false;
+    this->binaryOut = false;
+    this->binaryStarted = false;
+    this->probesSent = 0;
+    this->pb = PacketBuilder();
+    this->pb.allowBinary(this->framingWant);
+}
+
+ProtocolPacket Protocol::_probe() const {
+    ProtocolPacket probe(TYPE_PING);
+    probe.flags = FLAG_PROBE;
+    for(int i = 0; i < 256 ; i++) {
+        probe.data.push_back(i);
+    }
+    return probe;
+}
+
+uint32_t Protocol::_frameSize(uint32_t payloadSize) const {
+    return encodedFrameSize(payloadSize,getFraming());
+}
+
+// Encodes packets onto out in our current framing. Probes always go COBS
+// framed, but between zeros and with a newline after, so a peer reading
+// base64 lines loses only the probe. Once we switch, a zero ends whatever
+// line the peer's builder was in the middle of, and from then on there are
+// no more probes or base64 lines.
+void Protocol::_encode(std::vector<ProtocolPacket> & packets, ByteSink & out) {
+    for(std::vector<ProtocolPacket>::iterator it = packets.begin(); it != packets.end() ; it++) {
+        if (this->peerProbeOk) {
+            it->flags |= FLAG_CLEAN;
+        }
+        if (this->crcOn) {
+            it->flags |= FLAG_CRC32C;
+        }
+        if ((it->flags & FLAG_PROBE) && this->binaryStarted) {
+            continue;
+        }
+        if (it->type == TYPE_DATA && _encodeResend(*it,out)) {
+            continue;
+        }
+        
+        uint8_t * frame = out.reserve(maxEncodedSize(it->data.size()) + 2);
+        size_t n = 0;
+        
+        if (it->flags & FLAG_PROBE) {
+            frame[n++] = 0;
+            n += encodePacket(*it,frame + n,FRAMING_BINARY);
+            frame[n++] = '\n';
+            out.commit(n);
+            continue;
+        }
+        if (this->binaryOut && !this->binaryStarted) {
+            frame[n++] = 0;
+            this->binaryStarted = true;
+        }
+        
+        size_t len = encodePacket(*it,frame + n,getFraming());
+        InFlightPacket * inflight = it->type == TYPE_DATA ? _inFlightEntry(it->seqnum) : NULL;
+        if (inflight && getFraming() == FRAMING_BASE64) {
+            inflight->frame.assign(frame + n,len);
+            inflight->frameFlags = it->flags;
+        }
+        out.commit(n + len);
+    }
+}
+
+InFlightPacket * Protocol::_inFlightEntry(uint32_t seq) {
+    
+    if (this->sendWindow.empty()) {
+        return NULL;
+    }
+    
+    uint32_t base = this->sendWindow.front().packet.seqnum;
+    
+    if (seq < base || seq - base >= this->sendWindow.size()) {
+        return NULL;
+    }
+    
+    return &this->sendWindow[seq - base];
+}
+
+// Sends a DATA packet again from the frame kept when it was first sent.
+// Attempt, ACK and credit change on every send, and the checksum with them,
+// so the base64 groups the header falls in are encoded again over the kept
+// frame; the payload's groups are reused as they are. A change of framing,
+// or of which of ACK and credit are there, moves the payload within the
+// frame, and the packet is encoded afresh. COBS frames aren't kept, as a
+// changed header byte can move every code byte after it.
+bool Protocol::_encodeResend(const ProtocolPacket & packet, ByteSink & out) {
+    
+    InFlightPacket * inflight = _inFlightEntry(packet.seqnum);
     
+    if (!inflight || inflight->frame.empty() || getFraming() != FRAMING_BASE64) {
+        return false;
+    }
+    
+    const PacketBuffer & sent = inflight->packet.data;
+    
+    if (sent.begin() != packet.data.begin() || ((inflight->frameFlags ^ packet.flags) & (FLAG_ACK | FLAG_CREDIT))) {
+        return false;
+    }
+    
+    uint8_t header[MAX_HEADER_SIZE + 2];
+    size_t n = encodeHeader(packet,header);
+    size_t fill = std::min<size_t>((3 - n % 3) % 3,packet.data.size());
+    memcpy(header + n,packet.data.begin(),fill);
+    b64encode(header,n + fill,inflight->frame.begin());
+    inflight->frameFlags = packet.flags;
+    
+    out.write(inflight->frame.begin(),inflight->frame.size());
+    return true;
+}
+
+const CompressionStats & Protocol::getCompressStats() const {
+    return this->compressor.stats();
+}
+
+const CompressionStats & Protocol::getDecompressStats() const {
+    return this->decompressor.stats();
+}
+
+std::vector<ProtocolPacket> Protocol::_timerEvent(uint64_t now) {
     std::vector<ProtocolPacket> ret;
+    _timerEvent(now,ret);
+    return ret;
+}
+
+void Protocol::_timerEvent(uint64_t now, std::vector<ProtocolPacket> & ret) {
     
     if (this->state == STATE_UNINIT) {
-        return ret;
+        return;
     }
     
     if (this->state != STATE_LISTENING) {
@@ -69,106 +528,779 @@ std::vector<ProtocolPacket> Protocol::_timerEvent(uint64_t now) {
         if ( (now - this->lastPingSendTime) > this->pingInterval ) {
             this->lastPingSendTime = now;
             ret.push_back(ProtocolPacket(TYPE_PING));
+            _stampCredit(ret.back());
+            if (this->framingOn && !this->binaryOut && this->probesSent < MAX_PROBES) {
+                this->probesSent++;
+                ret.push_back(_probe());
+            }
+        }
+        
+        if (this->ackPending && now - this->ackPendingSince >= DELAYED_ACK_TIMEOUT) {
+            ret.push_back(_makeAck(this->pendingAckSeqnum,this->pendingAckAttempt));
+        } else if (this->flowOn && this->recvConsumed - this->advertisedConsumed >= this->recvBufferSize / 2) {
+            // window update. The ACK names the last packet delivered with
+            // an attempt the sender won't match, so it isn't an RTT sample.
+            ret.push_back(_makeAck(this->expectedDataSeqnum - 1,0xff));
+        }
+        
+        bool resent = false;
+        uint64_t rto = getRetransmitTimeout();
+        for(SendWindow::iterator it = this->sendWindow.begin(); it != this->sendWindow.end() ; it++) {
+            if (it->acked) {
+                continue;
+            }
+            if (now - it->lastSendAttempt > rto) {
+                it->lastSendAttempt = now;
+                it->packet.attempt = sendAttempt(it->attempts,this->shared.attempts);
+                it->attempts += 1;
+                resent = true;
+                this->linkQuality.record(_frameSize(it->packet.data.size()),false);
+                ret.push_back(it->packet);
+                _piggybackAck(ret.back());
+            }
         }
+        if (resent) {
+            this->rtt.backOff();
+        }
+        
+        _flushPending(ret,now);
+    }
+}
+
+
+// Marks a single in flight packet as received by the peer. explicitAck is set
+// when seq is the packet the ACK was generated for, as opposed to one covered
+// by the cumulative or selective part of the ACK. Only explicit ACKs whose
+// echoed attempt matches our latest transmission are used as RTT samples, so
+// an ACK for an earlier copy of a retransmitted packet can't skew the estimate.
+// A peer that doesn't take attempt numbers sees every copy as attempt 0, so
+// then only packets sent once are samples (Karn's algorithm).
+void Protocol::_ackOne(uint32_t seq, uint8_t attempt, uint64_t now, bool explicitAck) {
+    
+    InFlightPacket * entry = _inFlightEntry(seq);
+    
+    if (!entry || entry->acked) {
+        return;
+    }
+    
+    InFlightPacket & inflight = *entry;
+    
+    inflight.acked = true;
+    this->lastKeepAlive = now;
+    this->linkQuality.record(_frameSize(inflight.packet.data.size()),true);
+    if (explicitAck && isRttSample(attempt,inflight.packet.attempt,inflight.attempts,this->shared.attempts)) {
+        this->rtt.sample(now - inflight.lastSendAttempt);
+    }
+    this->rtt.backoff = 0;
+}
+
+// ACK packets name the DATA packet they were sent in response to. Peers that
+// support the send window also append the receivers next expected seqnum and a
+// bitmap of the packets it holds beyond that, so a single ACK can repair the
+// sender's view of the whole window after losses.
+void Protocol::_handleAck(const ProtocolPacket & packet, uint64_t now) {
+    
+    _ackOne(packet.seqnum, packet.attempt, now, true);
+    
+    if (packet.data.size() >= 4) {
+        uint32_t cumulative = 0;
+        cumulative |= packet.data[0];
+        cumulative |= packet.data[1] << 8;
+        cumulative |= packet.data[2] << 16;
+        cumulative |= packet.data[3] << 24;
         
+        _ackBelow(cumulative, now);
         
-        if (this->outgoingDataPacket) {
-            if (now - this->lastSendAttempt > (this->sendAttemptInterval + this->backoff )) {
-                this->lastSendAttempt = now;
-                this->backoff += 10;
-                ret.push_back(*(this->outgoingDataPacket));
+        for(uint32_t i = 4; i < packet.data.size(); i++) {
+            for(uint32_t bit = 0; bit < 8; bit++) {
+                if (packet.data[i] & (1 << bit)) {
+                    _ackOne(cumulative + 1 + (i - 4) * 8 + bit, 0, now, false);
+                }
             }
         }
     }
-     
+    
+    while (!this->sendWindow.empty() && this->sendWindow.front().acked) {
+        this->sendWindow.pop_front();
+    }
+}
+
+void Protocol::_ackBelow(uint32_t cumulative, uint64_t now) {
+    for(SendWindow::iterator it = this->sendWindow.begin(); it != this->sendWindow.end() ; it++) {
+        if (it->packet.seqnum >= cumulative) {
+            break;
+        }
+        _ackOne(it->packet.seqnum, 0, now, false);
+    }
+}
+
+ProtocolPacket Protocol::_makeAck(uint32_t seq, uint8_t attempt) {
+    
+    ProtocolPacket ack(TYPE_ACK,seq);
+    ack.attempt = attempt;
+    this->ackPending = 0;
+    uint32_t cumulative = this->expectedDataSeqnum;
+    
+    for(int i = 0; i < 4 ; i++) {
+        ack.data.push_back(cumulative & 0xff);
+        cumulative = cumulative >> 8;
+    }
+    
+    for(std::map<uint32_t,ProtocolPacket>::const_iterator it = this->reorderBuffer.begin(); it != this->reorderBuffer.end() ; it++) {
+        uint32_t offset = it->first - this->expectedDataSeqnum - 1;
+        uint32_t byte = 4 + offset / 8;
+        if (ack.data.size() <= byte) {
+            ack.data.resize(byte + 1,0);
+        }
+        ack.data[byte] |= 1 << (offset % 8);
+    }
+    
+    _stampCredit(ack);
+    return ack;
+}
+
+// Outgoing DATA carries any ACK we owe the peer, so that with traffic in both
+// directions standalone ACK frames are rarely needed. A peer that didn't
+// agree to OPT_PIGGYBACK gets the ACK on its own, once it is due.
+void Protocol::_piggybackAck(ProtocolPacket & packet) {
+    if (!this->ackPending || !this->shared.piggyback) {
+        return;
+    }
+    packet.flags |= FLAG_ACK;
+    packet.ackSeqnum = this->expectedDataSeqnum;
+    packet.ackAttempt = this->pendingAckAttempt;
+    this->ackPending = 0;
+    _stampCredit(packet);
+}
+
+
+std::pair<std::vector<ProtocolPacket>,std::vector<uint8_t> > 
+Protocol::_packetEvent(ProtocolPacket & packet,uint64_t now,bool wantData) {
+    std::pair<std::vector<ProtocolPacket>,std::vector<uint8_t> > ret;
+    VectorSink data(ret.second);
+    _packetEvent(packet,now,wantData,ret.first,data);
+    return ret;
+}
+
+void Protocol::_packetEvent(ProtocolPacket & packet, uint64_t now, bool wantData,
+                            std::vector<ProtocolPacket> & out, ByteSink & data) {
+    
+    if (packet.type == TYPE_ACK) {
+        _handleAck(packet,now);
+    }
+    
+    if ((packet.flags & FLAG_CREDIT) && this->flowOn
+        && static_cast<int32_t>(packet.credit - this->peerLimit) > 0) {
+        this->peerLimit = packet.credit;
+    }
+    
+    if (packet.flags & FLAG_ACK) {
+        if (packet.ackSeqnum > 0) {
+            _ackOne(packet.ackSeqnum - 1, packet.ackAttempt, now, true);
+        }
+        _ackBelow(packet.ackSeqnum, now);
+        while (!this->sendWindow.empty() && this->sendWindow.front().acked) {
+            this->sendWindow.pop_front();
+        }
+    }
+    
+    if(wantData  && this->state == STATE_CONNECTED && packet.type == TYPE_DATA
+       && packet.seqnum < this->expectedDataSeqnum + MAX_WINDOW_SIZE) {
+        _receiveData(packet,now,out,data);
+    }
+    
+    if(wantData && this->state == STATE_CONNECTED && packet.type == TYPE_PARITY && this->fecGroup
+       && packet.seqnum + (this->fecGroup - 1) * this->fecDepth >= this->expectedDataSeqnum
+       && packet.seqnum < this->expectedDataSeqnum + MAX_WINDOW_SIZE) {
+        this->fecParity[packet.seqnum] = std::vector<uint8_t>(packet.data.begin(),packet.data.end());
+        _fecRecover(packet.seqnum,now,out,data);
+    }
+    
+    if (packet.type == TYPE_PING && (this->state == STATE_CONNECTED)) {
+        this->lastKeepAlive = now; 
+    }
+    
+    if (packet.type == TYPE_PING && (packet.flags & FLAG_PROBE) && this->framingWant && !this->peerProbeOk) {
+        bool intact = packet.data.size() == 256;
+        for(uint32_t i = 0; intact && i < 256 ; i++) {
+            intact = packet.data[i] == i;
+        }
+        this->peerProbeOk = intact;
+        this->cleanPending = intact;
+    }
+    
+    if (this->state == STATE_LISTENING) {
+        if(packet.type == TYPE_CON) {
+            this->lastPingSendTime = now;
+            this->lastKeepAlive = now;
+            this->state = STATE_CONNECTED;
+            _applyOptions(packet.data,true);
+            if (this->framingOn) {
+                this->probesSent++;
+                out.push_back(_probe());
+            }
+            out.push_back(ProtocolPacket(TYPE_CONACK,0,_connectOptions()));
+        }
+    }
+    
+    if (this->state == STATE_CONNECTING) {
+        if(packet.type == TYPE_CONACK) {
+            this->lastPingSendTime = now;
+            this->lastKeepAlive = now;
+            this->state = STATE_CONNECTED;
+            _applyOptions(packet.data,false);
+        }
+    }
+    
+    if (this->state == STATE_CONNECTED) {
+        if ((packet.flags & FLAG_CLEAN) && this->framingOn) {
+            this->binaryOut = true;
+        }
+        // everything we send now says our peer's probe got through, so
+        // only send a PING to say so if there is nothing else.
+        if (this->cleanPending) {
+            this->cleanPending = false;
+            if (out.empty()) {
+                out.push_back(ProtocolPacket(TYPE_PING));
+                _stampCredit(out.back());
+            }
+        }
+        _flushPending(out,now);
+    }
+}
+
+// In order data is handed to the application here, decompressing it first if
+// need be. Either way it joins the decompressor's history so both ends stay
+// in step. If the stream can't be decoded the two ends are out of step for
+// good, so the connection is dropped. Channel 0 data goes to out, and data
+// for other channels waits in their inbox. Control messages are never
+// compressed.
+void Protocol::_deliver(const ProtocolPacket & packet, ByteSink & out) {
+    
+    if (packet.flags & FLAG_CONTROL) {
+        _channelControl(packet);
+        return;
+    }
+    
+    const uint8_t * plain = packet.data.begin();
+    size_t n = packet.data.size();
+    
+    if (packet.flags & FLAG_COMPRESSED) {
+        this->scratchPlain.clear();
+        if (!this->compressOn
+            || !this->decompressor.decompress(packet.data.begin(),packet.data.size(),this->scratchPlain,MAX_PAYLOAD_SIZE)) {
+            std::cerr << "Compressed stream corrupt, dropping connection." << std::endl;
+            this->state = STATE_UNINIT;
+            return;
+        }
+        plain = this->scratchPlain.empty() ? NULL : &this->scratchPlain[0];
+        n = this->scratchPlain.size();
+    } else if (this->compressOn && n) {
+        this->decompressor.addRaw(plain,n);
+    }
+    
+    if (packet.channel == 0) {
+        out.write(plain,n);
+    } else if (this->channels.count(packet.channel)) {
+        std::vector<uint8_t> & inbox = this->channelInbox[packet.channel];
+        inbox.insert(inbox.end(),plain,plain + n);
+    }
+}
+
+// The peer opening or closing a channel. An OPEN for a channel that is already
+// open is a protocol error on the peer's part and is ignored. A channel is
+// forgotten once both ends have closed it.
+void Protocol::_channelControl(const ProtocolPacket & packet) {
+    
+    if (packet.data.empty() || packet.channel == 0) {
+        return;
+    }
+    
+    std::map<uint8_t,SendChannel>::iterator it = this->channels.find(packet.channel);
+    
+    if (packet.data[0] == CHANNEL_OPEN && packet.data.size() >= 2 && it == this->channels.end()) {
+        SendChannel & ch = this->channels[packet.channel];
+        ch.peerLimit = this->peerBufferSize;
+        ch.weight = std::max<uint32_t>(packet.data[1],1);
+        ch.target = std::string(packet.data.begin() + 2,packet.data.end());
+        this->channelEvents.push_back(ChannelEvent(CHANNEL_OPENED,packet.channel,ch.target));
+    }
+    
+    if (packet.data[0] == CHANNEL_CREDIT && packet.data.size() >= 5 && it != this->channels.end() && this->flowOn) {
+        uint32_t limit = packet.data[1] | (packet.data[2] << 8) | (packet.data[3] << 16) | (packet.data[4] << 24);
+        if (static_cast<int32_t>(limit - it->second.peerLimit) > 0) {
+            it->second.peerLimit = limit;
+        }
+    }
+    
+    if (packet.data[0] == CHANNEL_CLOSE && it != this->channels.end() && !it->second.peerClosed) {
+        it->second.peerClosed = true;
+        this->channelEvents.push_back(ChannelEvent(CHANNEL_CLOSED,packet.channel,""));
+        if (it->second.closed) {
+            this->channels.erase(it);
+        }
+    }
+}
+
+void Protocol::_channelReset() {
+    this->channels.clear();
+    this->channels[0] = SendChannel();
+    this->virtualTime = 0;
+    this->channelInbox.clear();
+    this->channelEvents.clear();
+}
+
+// FEC covers the payload, its channel and the flags that still matter once a
+// packet has been received.
+static std::vector<uint8_t> fecUnit(const ProtocolPacket & packet) {
+    std::vector<uint8_t> unit;
+    unit.reserve(packet.data.size() + 2);
+    unit.push_back(packet.flags & (FLAG_COMPRESSED | FLAG_CONTROL));
+    unit.push_back(packet.channel);
+    unit.insert(unit.end(),packet.data.begin(),packet.data.end());
+    return unit;
+}
+
+void Protocol::_receiveData(ProtocolPacket & packet, uint64_t now,
+                            std::vector<ProtocolPacket> & out, ByteSink & data) {
+    
+    // Out of order and duplicate packets are acknowledged straight away
+    // so the sender learns about holes quickly, as is filling a hole.
+    // Plain in order data waits a little for reverse traffic.
+    bool ackNow = true;
+    bool isNew = false;
+    
+    if (packet.seqnum == this->expectedDataSeqnum) {
+        isNew = true;
+        this->expectedDataSeqnum += 1;
+        _deliver(packet,data);
+        
+        ackNow = !this->reorderBuffer.empty();
+        
+        std::map<uint32_t,ProtocolPacket>::iterator it = this->reorderBuffer.begin();
+        while (it != this->reorderBuffer.end() && it->first == this->expectedDataSeqnum) {
+            _deliver(it->second,data);
+            this->expectedDataSeqnum += 1;
+            this->reorderBuffer.erase(it++);
+        }
+    } else if (packet.seqnum > this->expectedDataSeqnum) {
+        isNew = this->reorderBuffer.insert(std::make_pair(packet.seqnum,packet)).second;
+    }
+    
+    if (!this->ackPending) {
+        this->ackPendingSince = now;
+    }
+    this->ackPending += 1;
+    this->pendingAckSeqnum = packet.seqnum;
+    this->pendingAckAttempt = packet.attempt;
+    
+    if (ackNow || this->ackPending >= DELAYED_ACK_COUNT) {
+        out.push_back(_makeAck(packet.seqnum,packet.attempt));
+    }
+    
+    if (isNew && this->fecGroup) {
+        uint32_t block = this->fecGroup * this->fecDepth;
+        
+        this->fecReceived[packet.seqnum] = fecUnit(packet);
+        _fecRecover(packet.seqnum - (packet.seqnum % block) + (packet.seqnum % this->fecDepth),now,out,data);
+        
+        // a missing packet can only need others from its own block.
+        if (this->expectedDataSeqnum > block) {
+            uint32_t oldest = this->expectedDataSeqnum - block;
+            this->fecReceived.erase(this->fecReceived.begin(),this->fecReceived.lower_bound(oldest));
+        }
+        while (!this->fecParity.empty()
+               && this->fecParity.begin()->first + (this->fecGroup - 1) * this->fecDepth < this->expectedDataSeqnum) {
+            this->fecParity.erase(this->fecParity.begin());
+        }
+    }
+}
+
+// Rebuilds the one missing packet of the group starting at first, if we have
+// its parity and every other member. The rebuilt packet is received like any
+// other. Its ACK echoes attempt 0xff, which the sender won't have reached, so
+// it isn't taken as an RTT sample.
+void Protocol::_fecRecover(uint32_t first, uint64_t now,
+                           std::vector<ProtocolPacket> & out, ByteSink & data) {
+    
+    std::map<uint32_t,std::vector<uint8_t> >::iterator parity = this->fecParity.find(first);
+    
+    if (parity == this->fecParity.end()) {
+        return;
+    }
+    
+    ParityAccumulator acc(parity->second);
+    uint32_t missing = 0;
+    uint32_t nmissing = 0;
+    
+    for(uint32_t i = 0; i < this->fecGroup; i++) {
+        uint32_t seq = first + i * this->fecDepth;
+        std::map<uint32_t,std::vector<uint8_t> >::iterator it = this->fecReceived.find(seq);
+        if (it == this->fecReceived.end()) {
+            missing = seq;
+            nmissing += 1;
+        } else {
+            acc.add(it->second);
+        }
+    }
+    
+    if (nmissing > 1) {
+        return;
+    }
+    
+    this->fecParity.erase(parity);
+    
+    if (nmissing == 0 || missing < this->expectedDataSeqnum) {
+        return;
+    }
+    
+    std::vector<uint8_t> unit = acc.payload();
+    if (unit.size() < 2) {
+        return;
+    }
+    
+    ProtocolPacket recovered(TYPE_DATA,missing,PacketBuffer(&unit[2],unit.size() - 2));
+    recovered.attempt = 0xff;
+    recovered.flags = unit[0];
+    recovered.channel = unit[1];
+    _receiveData(recovered,now,out,data);
+}
+
+// Adds a freshly sent DATA packet to the parity for its group, and sends the
+// parity once the group is complete. Groups we joined part way through, such
+// as just after connecting with a nonzero seqnum, are skipped.
+void Protocol::_fecSent(const ProtocolPacket & packet, std::vector<ProtocolPacket> & out) {
+    
+    if (!this->fecGroup) {
+        return;
+    }
+    
+    uint32_t block = this->fecGroup * this->fecDepth;
+    uint32_t index = (packet.seqnum % block) / this->fecDepth;
+    ParityAccumulator & acc = this->fecLanes[packet.seqnum % this->fecDepth];
+    
+    if (index == 0) {
+        acc.reset();
+    }
+    
+    if (acc.count() != index) {
+        return;
+    }
+    
+    acc.add(fecUnit(packet));
+    
+    if (acc.count() == this->fecGroup) {
+        out.push_back(ProtocolPacket(TYPE_PARITY,packet.seqnum - index * this->fecDepth,acc.encode()));
+        acc.reset();
+    }
+}
+
+void Protocol::_fecReset() {
+    this->fecGroup = 0;
+    this->fecDepth = 0;
+    this->fecLanes.clear();
+    this->fecReceived.clear();
+    this->fecParity.clear();
+}
+
+void Protocol::_compressReset() {
+    this->compressOn = false;
+    this->compressor = StreamCompressor();
+    this->decompressor = StreamDecompressor();
+}
+
+// Options for our CON, or once connected the agreed options for our CONACK.
+std::vector<uint8_t> Protocol::_connectOptions() const {
+    std::vector<uint8_t> ret;
+    
+    uint32_t group = this->fecWantGroup;
+    uint32_t depth = this->fecWantDepth;
+    if (this->state == STATE_CONNECTED) {
+        group = this->fecGroup;
+        depth = this->fecDepth;
+    }
+    
+    if (group) {
+        ret.push_back(OPT_FEC);
+        ret.push_back(2);
+        ret.push_back(group);
+        ret.push_back(depth);
+    }
+    
+    if (this->state == STATE_CONNECTED ? this->compressOn : this->compressWant) {
+        ret.push_back(OPT_COMPRESS);
+        ret.push_back(1);
+        ret.push_back(COMPRESS_WINDOW_LOG);
+    }
+    
+    if (this->state == STATE_CONNECTED ? this->flowOn : this->recvBufferSize != 0) {
+        ret.push_back(OPT_FLOW);
+        ret.push_back(4);
+        for(int i = 0; i < 4 ; i++) {
+            ret.push_back((this->recvBufferSize >> (8 * i)) & 0xff);
+        }
+    }
+    
+    if (this->state == STATE_CONNECTED ? this->framingOn : this->framingWant) {
+        ret.push_back(OPT_FRAMING);
+        ret.push_back(0);
+    }
+    
+    if (this->state == STATE_CONNECTED ? this->crcOn : this->crcWant && crc32cHardware()) {
+        ret.push_back(OPT_CHECKSUM);
+        ret.push_back(1);
+        ret.push_back(1);
+    }
+    
+    uint8_t shared[SharedOptions::SIZE];
+    size_t n = this->shared.write(shared,this->state == STATE_CONNECTED);
+    ret.insert(ret.end(),shared,shared + n);
+    
+    if (this->state == STATE_CONNECTED ? this->channelsOn : this->channelsWant) {
+        ret.push_back(OPT_CHANNELS);
+        ret.push_back(0);
+    }
+    
     return ret;
 }
 
-
-std::pair<std::vector<ProtocolPacket>,std::vector<uint8_t> > 
-Protocol::_packetEvent(ProtocolPacket & packet,uint64_t now,bool wantData) {
+// The listener agrees to the stronger of the two FEC settings if both sides
+// asked for FEC, and to compression if both sides asked for it with the same
+// window. The connecting side takes whatever the CONACK says.
+void Protocol::_applyOptions(const PacketBuffer & options, bool listener) {
     
-    std::pair<std::vector<ProtocolPacket>,std::vector<uint8_t> > ret;
+    _fecReset();
+    _compressReset();
+    _flowReset();
+    this->framingOn = false;
+    this->crcOn = false;
+    this->shared.reset();
+    this->channelsOn = false;
     
-    if (this->outgoingDataPacket) {
-        if (packet.type == TYPE_ACK) {
-            if (packet.seqnum == this->outgoingDataPacket->seqnum) {
-                this->outgoingDataPacket.reset();
-                this->seqnum += 1;
-                this->lastKeepAlive = now;
-                if(this->backoff == 0) {
-                    uint64_t interval = (now - this->lastSendAttempt) + 50;
-                    this->sendAttemptInterval = interval;
+    OptionReader option(options.begin(),options.size());
+    while (option.next()) {
+        uint8_t opt = option.opt;
+        uint8_t len = option.len;
+        const uint8_t * value = option.value;
+        this->shared.apply(option);
+        
+        if (opt == OPT_FEC && len >= 2) {
+            uint32_t group = value[0];
+            uint32_t depth = value[1];
+            if (listener) {
+                if (!this->fecWantGroup) {
+                    group = 0;
+                } else {
+                    group = std::min(group,this->fecWantGroup);
+                    depth = std::max(depth,this->fecWantDepth);
                 }
-                this->backoff = 0;
-            } else if (packet.seqnum < this->outgoingDataPacket->seqnum) {
-                //Got an ack for an old packet, i guess sendAttemptInterval is too high.
-                this->sendAttemptInterval += 10;
+            }
+            if (group >= MIN_FEC_GROUP && group <= MAX_FEC_GROUP && depth >= 1 && depth <= MAX_FEC_DEPTH) {
+                this->fecGroup = group;
+                this->fecDepth = depth;
+                this->fecLanes.resize(depth);
             }
         }
-    }
-    
-    
-    if(wantData  && this->state == STATE_CONNECTED && packet.type == TYPE_DATA && packet.seqnum <= this->expectedDataSeqnum) {
-        ret.first.push_back(ProtocolPacket(TYPE_ACK,packet.seqnum));
-        if (packet.seqnum == this->expectedDataSeqnum) {
-            this->expectedDataSeqnum += 1;
-            for(std::vector<uint8_t>::iterator it = packet.data.begin(); it != packet.data.end() ; it++) {
-                ret.second.push_back(*it);
+        
+        if (opt == OPT_COMPRESS && len >= 1) {
+            if (value[0] == COMPRESS_WINDOW_LOG && (!listener || this->compressWant)) {
+                this->compressOn = true;
             }
-                
         }
-    }
-    
-    if (packet.type == TYPE_PING && (this->state == STATE_CONNECTED)) {
-        this->lastKeepAlive = now; 
-    }
-    
-    if (this->state == STATE_LISTENING) {
-        if(packet.type == TYPE_CON) {
-            this->lastPingSendTime = now;
-            this->lastKeepAlive = now;
-            this->state = STATE_CONNECTED;
-            ret.first.push_back(ProtocolPacket(TYPE_CONACK));
+        
+        if (opt == OPT_FLOW && len >= 4 && this->recvBufferSize) {
+            this->flowOn = true;
+            this->peerLimit = value[0] | (value[1] << 8) | (value[2] << 16) | (value[3] << 24);
+            this->peerBufferSize = this->peerLimit;
         }
-    }
-    
-    if (this->state == STATE_CONNECTING) {
-        if(packet.type == TYPE_CONACK) {
-            this->lastPingSendTime = now;
-            this->lastKeepAlive = now;
-            this->state = STATE_CONNECTED;
+        
+        if (opt == OPT_FRAMING && this->framingWant) {
+            this->framingOn = true;
+        }
+        
+        if (opt == OPT_CHECKSUM && len >= 1 && value[0] == 1 && this->crcWant && crc32cHardware()) {
+            this->crcOn = true;
+        }
+        
+        if (opt == OPT_CHANNELS && this->channelsWant) {
+            this->channelsOn = true;
         }
     }
-    
-    return ret;
 }
 
 
-bool Protocol::readyForData() const {
+// A channel can take more data once its queue has drained, as long as the
+// window isn't entirely its own packets. So a bulk channel that fills the
+// window still leaves others free to queue data, which goes out ahead of the
+// bulk data as soon as a slot frees up.
+bool Protocol::readyForData(uint8_t channel) const {
     if (this->state != STATE_CONNECTED)
         return false;
     
-    if (this->outgoingDataPacket)
+    std::map<uint8_t,SendChannel>::const_iterator it = this->channels.find(channel);
+    
+    if (it == this->channels.end() || it->second.closed || it->second.closePending)
+        return false;
+    
+    if (!it->second.queue.empty())
+        return false;
+    
+    uint32_t window = std::min(this->windowSize,this->shared.peerWindow);
+    
+    if (this->sendWindow.size() >= window && _inFlight(channel) >= window)
         return false;
     
     return true;
 }
 
+uint32_t Protocol::_inFlight(uint8_t channel) const {
+    uint32_t n = 0;
+    for(SendWindow::const_iterator it = this->sendWindow.begin(); it != this->sendWindow.end() ; it++) {
+        if (it->packet.channel == channel && !it->acked) {
+            n += 1;
+        }
+    }
+    return n;
+}
+
 
 std::vector<ProtocolPacket> Protocol::_sendData(std::vector<uint8_t>  data, uint64_t now) {
+    return _sendData(0,data,now);
+}
+
+std::vector<ProtocolPacket> Protocol::_sendData(uint8_t channel, std::vector<uint8_t>  data, uint64_t now) {
     std::vector<ProtocolPacket> ret;
+    _sendData(channel,data.empty() ? NULL : &data[0],data.size(),now,ret);
+    return ret;
+}
+
+void Protocol::_sendData(uint8_t channel, const uint8_t * data, size_t n, uint64_t now, std::vector<ProtocolPacket> & out) {
     
-    if (! this->readyForData()) {
+    if (! this->readyForData(channel)) {
         std::cerr << "FATAL BUG: _sendData:" << __FILE__ << ":" << __LINE__ << std::endl;
         exit(1);
     }
     
-    this->outgoingDataPacket = std::tr1::shared_ptr<ProtocolPacket>(new ProtocolPacket(TYPE_DATA,this->seqnum,data));
-    this->lastSendAttempt = now;
-    ret.push_back(*(this->outgoingDataPacket));
+    this->channels[channel].queue.append(data,n);
+    _flushPending(out,now);
+}
+
+// The channel with something to send whose next packet has the earliest
+// virtual start time. A channel that has been idle starts at the current
+// virtual time rather than where it left off, so it can't save up credit.
+// Channels with data that the peer has no room for are passed over.
+int Protocol::_nextChannel() const {
+    int best = -1;
+    double bestStart = 0;
+    for(std::map<uint8_t,SendChannel>::const_iterator it = this->channels.begin(); it != this->channels.end() ; it++) {
+        const SendChannel & ch = it->second;
+        bool creditDue = _channelCreditDue(it->first,ch);
+        if (!ch.openPending && !creditDue && ch.queue.empty() && !ch.closePending) {
+            continue;
+        }
+        // control messages don't use the peer's buffer, data waits until
+        // a whole packet's worth fits.
+        if (!ch.openPending && !creditDue && !ch.queue.empty()
+            && static_cast<int32_t>(std::min<size_t>(this->targetPayloadSize,ch.queue.size())) > _sendCredit(it->first)) {
+            continue;
+        }
+        double start = std::max(ch.finish,this->virtualTime);
+        if (best < 0 || start < bestStart) {
+            best = it->first;
+            bestStart = start;
+        }
+    }
+    return best;
+}
+
+// Cuts queued application data into DATA packets of the size the link
+// currently favours, for as long as the send window has room. Channels take
+// turns by weighted fair queueing, and a channel's OPEN goes before its data
+// and its CLOSE after. A channel's credit goes ahead of its data.
+void Protocol::_flushPending(std::vector<ProtocolPacket> & out, uint64_t now) {
     
-    return ret;
+    if (this->linkFull) {
+        return;
+    }
+    
+    int next = _nextChannel();
+    
+    if (next < 0) {
+        return;
+    }
+    
+    uint32_t best = this->linkQuality.bestPayloadSize(std::min(this->maxPayloadSize,this->shared.peerPayload),getFraming());
+    uint32_t samples = this->linkQuality.samples();
+    
+    if (best < this->targetPayloadSize) {
+        this->targetPayloadSize = best;
+        this->lastResizeSamples = samples;
+    } else if (best > this->targetPayloadSize && samples - this->lastResizeSamples >= PAYLOAD_GROWTH_SAMPLES) {
+        this->targetPayloadSize = std::min(best,this->targetPayloadSize * 2);
+        this->lastResizeSamples = samples;
+    }
+    
+    uint32_t window = std::min(this->windowSize,this->shared.peerWindow);
+    
+    for(; next >= 0 && this->sendWindow.size() < window; next = _nextChannel()) {
+        uint8_t id = next;
+        SendChannel * ch = &this->channels[id];
+        PacketBuffer payload;
+        uint8_t flags = 0;
+        
+        if (ch->openPending) {
+            flags = FLAG_CONTROL;
+            payload.push_back(CHANNEL_OPEN);
+            payload.push_back(std::min<uint32_t>(ch->weight,255));
+            payload.append(reinterpret_cast<const uint8_t *>(ch->target.data()),ch->target.size());
+            ch->openPending = false;
+        } else if (_channelCreditDue(id,*ch)) {
+            flags = FLAG_CONTROL;
+            uint32_t limit = ch->recvConsumed + this->recvBufferSize;
+            payload.push_back(CHANNEL_CREDIT);
+            for(int i = 0; i < 4 ; i++) {
+                payload.push_back((limit >> (8 * i)) & 0xff);
+            }
+            ch->advertisedConsumed = ch->recvConsumed;
+        } else if (!ch->queue.empty()) {
+            uint32_t n = std::min<size_t>(this->targetPayloadSize,ch->queue.size());
+            payload.assign(ch->queue.front(),n);
+            ch->queue.pop(n);
+            if (id == 0) {
+                this->sentBytes += n;
+            } else {
+                ch->sentBytes += n;
+            }
+        } else {
+            flags = FLAG_CONTROL;
+            payload.push_back(CHANNEL_CLOSE);
+            ch->closePending = false;
+            ch->closed = true;
+        }
+        
+        double start = std::max(ch->finish,this->virtualTime);
+        this->virtualTime = start;
+        ch->finish = start + double(payload.size()) / ch->weight;
+        
+        if (ch->closed && ch->peerClosed) {
+            this->channels.erase(id);
+        }
+        
+        if (this->compressOn && !(flags & FLAG_CONTROL)) {
+            if (this->compressor.compress(payload.begin(),payload.size(),this->scratchCompressed)) {
+                payload.assign(&this->scratchCompressed[0],this->scratchCompressed.size());
+                flags |= FLAG_COMPRESSED;
+            }
+        }
+        
+        this->sendWindow.push_back(InFlightPacket(ProtocolPacket(TYPE_DATA,this->seqnum,payload),now));
+        this->sendWindow.back().packet.flags = flags;
+        this->sendWindow.back().packet.channel = id;
+        this->seqnum += 1;
+        out.push_back(this->sendWindow.back().packet);
+        _piggybackAck(out.back());
+        _fecSent(this->sendWindow.back().packet,out);
+    }
 }
 
 std::vector<ProtocolPacket> Protocol::_sendData(const char * s, uint64_t now) {
@@ -178,117 +1310,190 @@ std::vector<ProtocolPacket> Protocol::_sendData(const char * s, uint64_t now) {
 
 
 void Protocol::listen() {
-    this->outgoingDataPacket.reset();
+    this->sendWindow.clear();
+    _channelReset();
+    this->initiator = false;
+    _fecReset();
+    _compressReset();
+    _flowReset();
+    _framingReset();
     this->state = STATE_LISTENING;
 }
 
 
 std::vector<ProtocolPacket> Protocol::_connect(uint64_t now) {   
     std::vector<ProtocolPacket> ret;
-    this->outgoingDataPacket.reset();
+    this->sendWindow.clear();
+    _channelReset();
+    this->initiator = true;
+    _fecReset();
+    _compressReset();
+    _flowReset();
+    _framingReset();
     this->state = STATE_CONNECTING;
     this->lastKeepAlive = now;
     this->lastPingSendTime = now;
-    ret.push_back(ProtocolPacket(TYPE_CON));
+    if (this->framingWant) {
+        this->probesSent++;
+        ret.push_back(_probe());
+    }
+    ret.push_back(ProtocolPacket(TYPE_CON,0,_connectOptions()));
     return ret;
 }
 
 std::vector<uint8_t> Protocol::timerEvent(uint64_t time) {
-    return encodePackets(_timerEvent(time));
+    std::vector<uint8_t> ret;
+    timerEvent(time,ret);
+    return ret;
 }
 
 std::pair<std::vector<uint8_t>,std::vector<uint8_t> > 
 Protocol::dataEvent(const std::vector<uint8_t> & datain,uint64_t time, bool wantData) {
+    std::pair<std::vector<uint8_t>,std::vector<uint8_t> > ret;
+    dataEvent(datain.empty() ? NULL : &datain[0],datain.size(),time,wantData,ret.first,ret.second);
+    return ret;
+}
+
+void Protocol::timerEvent(uint64_t time, std::vector<uint8_t> & out) {
+    VectorSink sink(out);
+    timerEvent(time,sink);
+}
+
+void Protocol::dataEvent(const uint8_t * datain, size_t n, uint64_t time, bool wantData,
+                         std::vector<uint8_t> & out, std::vector<uint8_t> & data) {
+    VectorSink outSink(out);
+    VectorSink dataSink(data);
+    dataEvent(datain,n,time,wantData,outSink,dataSink);
+}
+
+void Protocol::sendData(uint8_t channel, const uint8_t * data, size_t n, uint64_t time, std::vector<uint8_t> & out) {
+    VectorSink sink(out);
+    sendData(channel,data,n,time,sink);
+}
+
+void Protocol::timerEvent(uint64_t time, ByteSink & out) {
+    this->linkFull = out.full();
+    this->scratchPackets.clear();
+    _timerEvent(time,this->scratchPackets);
+    _encode(this->scratchPackets,out);
+}
+
+void Protocol::dataEvent(const uint8_t * datain, size_t n, uint64_t time, bool wantData,
+                         ByteSink & out, ByteSink & data) {
     
-    std::vector<ProtocolPacket> ret;
-    std::vector<uint8_t> dataout;
-    std::vector<ProtocolPacket> arrived = pb.addData(datain);
+    this->linkFull = out.full();
+    this->scratchArrived.clear();
+    this->scratchPackets.clear();
+    pb.addData(datain,n,&this->linkQuality,this->scratchArrived);
     
-    for(std::vector<ProtocolPacket>::iterator it = arrived.begin(); it != arrived.end() ; it++) {
-        std::pair<std::vector<ProtocolPacket>,std::vector<uint8_t> > presp = _packetEvent(*it,time,wantData);
-        
-        ret.insert(ret.end(),presp.first.begin(),presp.first.end());
-        dataout.insert(dataout.end(),presp.second.begin(),presp.second.end());
-        
+    for(std::vector<ProtocolPacket>::iterator it = this->scratchArrived.begin(); it != this->scratchArrived.end() ; it++) {
+        _packetEvent(*it,time,wantData,this->scratchPackets,data);
     }
     
-    return std::pair<std::vector<uint8_t>,std::vector<uint8_t> >(encodePackets(ret),dataout);
-    
+    _encode(this->scratchPackets,out);
+}
+
+void Protocol::sendData(uint8_t channel, const uint8_t * data, size_t n, uint64_t time, ByteSink & out) {
+    this->linkFull = out.full();
+    this->scratchPackets.clear();
+    _sendData(channel,data,n,time,this->scratchPackets);
+    _encode(this->scratchPackets,out);
+}
+
+void Protocol::connect(uint64_t time, ByteSink & out) {
+    std::vector<ProtocolPacket> packets = _connect(time);
+    _encode(packets,out);
 }
 
 std::vector<uint8_t> Protocol::sendData(std::vector<uint8_t>  data, uint64_t time) {
-    return encodePackets(_sendData(data,time));
+    return sendData(0,data,time);
 }
 
 std::vector<uint8_t> Protocol::sendData(const char * c, uint64_t time){
-    return encodePackets(_sendData(c,time));
+    std::vector<uint8_t> ret;
+    sendData(0,reinterpret_cast<const uint8_t *>(c),strlen(c),time,ret);
+    return ret;
+}
+
+std::vector<uint8_t> Protocol::sendData(uint8_t channel, std::vector<uint8_t>  data, uint64_t time) {
+    std::vector<uint8_t> ret;
+    sendData(channel,data.empty() ? NULL : &data[0],data.size(),time,ret);
+    return ret;
 }
 
 std::vector<uint8_t> Protocol::connect(uint64_t time) {
-    return encodePackets(_connect(time));   
-}
-
-
-
-
-
-static uint32_t crc32_tab[] = {
-	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
-	0xe963a535, 0x9e6495a3,	0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
-	0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
-	0xf3b97148, 0x84be41de,	0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
-	0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec,	0x14015c4f, 0x63066cd9,
-	0xfa0f3d63, 0x8d080df5,	0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
-	0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,	0x35b5a8fa, 0x42b2986c,
-	0xdbbbc9d6, 0xacbcf940,	0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
-	0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
-	0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
-	0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d,	0x76dc4190, 0x01db7106,
-	0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
-	0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
-	0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
-	0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
-	0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
-	0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
-	0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
-	0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
-	0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
-	0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
-	0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
-	0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
-	0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
-	0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
-	0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
-	0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
-	0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
-	0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
-	0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
-	0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
-	0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
-	0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
-	0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
-	0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
-	0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
-	0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
-	0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
-	0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
-	0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
-	0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
-	0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
-	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
-};
-
-
-template <typename T>
-uint32_t  checksumFunc(T it, T end)
-{
-    uint32_t crc = 0;
-	crc = crc ^ ~0U;
-
-	while (it != end)
-		crc = crc32_tab[(crc ^ *it++) & 0xFF] ^ (crc >> 8);
-
-	return crc ^ ~0U;
+    std::vector<uint8_t> ret;
+    VectorSink sink(ret);
+    connect(time,sink);
+    return ret;
+}
+
+// Opens a new channel to the named target at the far end, returning its
+// number, or -1 if all are in use or the peer didn't agree to OPT_CHANNELS.
+// The OPEN goes out with the next packets sent, and data may be queued on
+// the channel straight away.
+int Protocol::openChannel(const std::string & target, uint32_t weight) {
+    
+    if (this->state != STATE_CONNECTED || !this->channelsOn) {
+        return -1;
+    }
+    
+    for(uint32_t id = this->initiator ? 1 : 2; id < MAX_CHANNELS; id += 2) {
+        if (this->channels.count(id)) {
+            continue;
+        }
+        SendChannel & ch = this->channels[id];
+        ch.weight = std::max(1u,std::min(weight,255u));
+        ch.target = target;
+        ch.openPending = true;
+        ch.peerLimit = this->peerBufferSize;
+        ch.finish = this->virtualTime;
+        return id;
+    }
+    return -1;
+}
+
+// Sends a CLOSE once the data already queued on the channel has gone. Data
+// may still arrive on it until the peer closes its end too.
+void Protocol::closeChannel(uint8_t channel) {
+    std::map<uint8_t,SendChannel>::iterator it = this->channels.find(channel);
+    if (channel == 0 || it == this->channels.end() || it->second.closed) {
+        return;
+    }
+    it->second.closePending = true;
+}
+
+void Protocol::setChannelWeight(uint8_t channel, uint32_t weight) {
+    std::map<uint8_t,SendChannel>::iterator it = this->channels.find(channel);
+    if (it != this->channels.end()) {
+        it->second.weight = std::max(1u,std::min(weight,255u));
+    }
+}
+
+std::vector<uint8_t> Protocol::takeChannelData(uint8_t channel) {
+    std::vector<uint8_t> ret;
+    std::map<uint8_t,std::vector<uint8_t> >::iterator it = this->channelInbox.find(channel);
+    if (it != this->channelInbox.end()) {
+        ret.swap(it->second);
+        this->channelInbox.erase(it);
+    }
+    return ret;
+}
+
+std::vector<ChannelEvent> Protocol::takeChannelEvents() {
+    std::vector<ChannelEvent> ret;
+    ret.swap(this->channelEvents);
+    return ret;
+}
+
+
+
+
+
+// The checksum covers everything after it. Frames flagged FLAG_CRC32C use
+// the Castagnoli polynomial, everything else the IEEE one.
+static uint32_t frameChecksum(const uint8_t * p, size_t n, uint8_t flags, uint32_t crc = 0) {
+    return (flags & FLAG_CRC32C) ? crc32c(p,n,crc) : crc32(p,n,crc);
 }
 
 
@@ -306,68 +1511,257 @@ PacketBuilder::addData(const std::string & data) {
 }
 
 std::vector<ProtocolPacket>
-PacketBuilder::addData(const std::vector<uint8_t> & data) {
-    
+PacketBuilder::addData(const std::vector<uint8_t> & data, LinkQuality * quality) {
     std::vector<ProtocolPacket> ret;
-    
-    //stop unlimited memory use...
-    if(buffered.size() > 1000000) {
-        //no way a meg is a valid packet.
-        buffered.clear();
+    addData(data.empty() ? NULL : &data[0],data.size(),quality,ret);
+    return ret;
+}
+
+PacketBuilder::PacketBuilder() : framing(FRAMING_BASE64) , binaryAllowed(false) , discarding(false) , discarded(0) , trialActive(false) {
+
+}
+
+void PacketBuilder::allowBinary(bool on) {
+    this->binaryAllowed = on;
+}
+
+Framing PacketBuilder::getFraming() const {
+    return this->framing;
+}
+
+// Longest run of bytes between delimiters that can be a valid frame, base64
+// being the larger encoding.
+static const size_t MAX_ENCODED_FRAME = b64encodedSize(MAX_FRAME_SIZE);
+
+// The first newline or zero. SSE2 is always there on x86-64, so this needs
+// no dispatch.
+static const uint8_t * findLineOrZero(const uint8_t * p, size_t n) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    for(; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+        int m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v,nl),_mm_cmpeq_epi8(v,zero)));
+        if (m) {
+            return p + i + __builtin_ctz(m);
+        }
     }
+#endif
+    for(; i < n; i++) {
+        if (p[i] == '\n' || p[i] == 0) {
+            return p + i;
+        }
+    }
+    return NULL;
+}
+
+void
+PacketBuilder::addData(const uint8_t * p, size_t n, LinkQuality * quality, std::vector<ProtocolPacket> & ret) {
     
-    buffered.insert(buffered.end(),data.begin(),data.end());
-    
-    while(true) {
-        std::vector<uint8_t>::iterator it;
-        
-        it = std::find(buffered.begin(),buffered.end(),'\n');
-        
-        if (it == buffered.end()) {
-            break;
+    while (n) {
+        const uint8_t * d;
+        if (framing == FRAMING_BINARY) {
+            d = static_cast<const uint8_t *>(memchr(p,0,n));
+        } else if (binaryAllowed) {
+            d = findLineOrZero(p,n);
+        } else {
+            d = static_cast<const uint8_t *>(memchr(p,'\n',n));
         }
+        size_t len = d ? d - p : n;
         
-        std::vector<uint8_t> packetData(buffered.begin(),it);
-        buffered.erase(buffered.begin(),it + 1);
-        
-        std::vector<uint8_t> decoded = b64decode(packetData);
-        
-        uint32_t checksum = 0;
-        
-        if(decoded.size() < 12) {
-            continue;
+        if (trialActive) {
+            trial.insert(trial.end(),p,p + len);
+            if (d && *d == '\n') {
+                trial.push_back('\n');
+            }
+            if (trial.size() > MAX_ENCODED_FRAME) {
+                _endTrial(quality);
+            }
         }
         
-        checksum |= decoded[0];
-        checksum |= decoded[1] << 8;
-        checksum |= decoded[2] << 16;
-        checksum |= decoded[3] << 24;
-        
-        if( checksum != checksumFunc(decoded.begin() + 4,decoded.end()) ) {
-            continue;
+        if (!discarding && partial.size() + len > MAX_ENCODED_FRAME) {
+            discarding = true;
+            discarded = partial.size();
+            partial.clear();
+        }
+        if (discarding) {
+            discarded += len;
         }
         
-        uint32_t t = 0;
-        uint32_t seqnum = 0;
-        
-        t |= decoded[4];
-        t |= decoded[5] << 8;
-        t |= decoded[6] << 16;
-        t |= decoded[7] << 24;
-        
-        seqnum |= decoded[8];
-        seqnum |= decoded[9] << 8;
-        seqnum |= decoded[10] << 16;
-        seqnum |= decoded[11] << 24;
-        
-        PacketType type = static_cast<PacketType>(t);;
-        
-        std::vector<uint8_t> data(decoded.begin() + 12,decoded.end());
-        
-        ret.push_back(ProtocolPacket(type,seqnum,data));
+        if (!d) {
+            if (!discarding) {
+                partial.insert(partial.end(),p,p + len);
+            }
+            break;
+        }
         
+        if (discarding) {
+            _frameEnd(NULL,discarded,*d,quality,ret);
+        } else if (!partial.empty()) {
+            partial.insert(partial.end(),p,p + len);
+            _frameEnd(&partial[0],partial.size(),*d,quality,ret);
+        } else {
+            _frameEnd(p,len,*d,quality,ret);
+        }
+        partial.clear();
+        discarding = false;
+        p += len + 1;
+        n -= len + 1;
     }
-    return ret;
+}
+
+// Handles the n bytes before a delimiter, which are NULL if there were too
+// many to be a frame.
+void
+PacketBuilder::_frameEnd(const uint8_t * p, size_t n, uint8_t delimiter, LinkQuality * quality, std::vector<ProtocolPacket> & ret) {
+    
+    if (framing == FRAMING_BINARY) {
+        if (n) {
+            frame.clear();
+            bool ok = p && cobsDecode(p,n,frame) && _parseFrame(frame.empty() ? NULL : &frame[0],frame.size(),ret);
+            if (quality) {
+                quality->record(n + 1,ok);
+            }
+        }
+        return;
+    }
+    
+    if (delimiter == '\n') {
+        if (n) {
+            bool ok = false;
+            if (p) {
+                frame.resize(b64decodedSize(n));
+                frame.resize(b64decode(p,n,&frame[0]));
+                ok = _parseFrame(frame.empty() ? NULL : &frame[0],frame.size(),ret);
+            }
+            if (quality && (ok || !trialActive)) {
+                quality->record(n + 1,ok);
+            } else if (quality) {
+                trialFailures.push_back(n + 1);
+            }
+        }
+        return;
+    }
+    
+    // A zero in base64 text, so whatever line it cut short was garbage. If
+    // there was a zero before it, the bytes in between may be a COBS frame.
+    if (trialActive) {
+        size_t before = ret.size();
+        frame.clear();
+        if (cobsDecode(trial.empty() ? NULL : &trial[0],trial.size(),frame)
+            && _parseFrame(frame.empty() ? NULL : &frame[0],frame.size(),ret)) {
+            if (quality) {
+                quality->record(trial.size() + 1,true);
+            }
+            if (ret.size() == before || !(ret.back().flags & FLAG_PROBE)) {
+                framing = FRAMING_BINARY;
+            }
+            trialFailures.clear();
+            trial.clear();
+            trialActive = false;
+            return;
+        }
+        _endTrial(quality);
+    }
+    trialActive = true;
+}
+
+// The bytes since the last zero weren't a COBS frame after all, so the lines
+// in them that failed count.
+void
+PacketBuilder::_endTrial(LinkQuality * quality) {
+    if (quality) {
+        for(std::vector<uint32_t>::iterator it = trialFailures.begin(); it != trialFailures.end() ; it++) {
+            quality->record(*it,false);
+        }
+    }
+    trialFailures.clear();
+    trial.clear();
+    trialActive = false;
+}
+
+// Parses one decoded frame onto out, returning whether its checksum was good.
+bool
+PacketBuilder::_parseFrame(const uint8_t * decoded, size_t n, std::vector<ProtocolPacket> & out) {
+    
+    uint32_t checksum = 0;
+    
+    if(n < 12) {
+        return false;
+    }
+    
+    checksum |= decoded[0];
+    checksum |= decoded[1] << 8;
+    checksum |= decoded[2] << 16;
+    checksum |= decoded[3] << 24;
+    
+    if( checksum != frameChecksum(decoded + 4,n - 4,decoded[7]) ) {
+        return false;
+    }
+    
+    uint32_t t = 0;
+    uint32_t seqnum = 0;
+    
+    t |= decoded[4];
+    t |= decoded[5] << 8;
+    t |= decoded[6] << 16;
+    t |= decoded[7] << 24;
+    
+    seqnum |= decoded[8];
+    seqnum |= decoded[9] << 8;
+    seqnum |= decoded[10] << 16;
+    seqnum |= decoded[11] << 24;
+    
+    PacketType type = static_cast<PacketType>(t & 0xff);
+    
+    const uint8_t * data = decoded + 12;
+    size_t len = n - 12;
+    
+    uint8_t flags = (t >> 24) & 0xff;
+    uint32_t ackSeqnum = 0;
+    uint8_t ackAttempt = 0;
+    
+    uint32_t credit = 0;
+    
+    if (flags & FLAG_ACK) {
+        if (len < 5) {
+            return true;
+        }
+        ackSeqnum |= data[0];
+        ackSeqnum |= data[1] << 8;
+        ackSeqnum |= data[2] << 16;
+        ackSeqnum |= data[3] << 24;
+        ackAttempt = data[4];
+        data += 5;
+        len -= 5;
+    }
+    
+    if (flags & FLAG_CREDIT) {
+        if (len < 4) {
+            return true;
+        }
+        credit |= data[0];
+        credit |= data[1] << 8;
+        credit |= data[2] << 16;
+        credit |= data[3] << 24;
+        data += 4;
+        len -= 4;
+    }
+    
+    if (len > MAX_PACKET_DATA) {
+        return true;
+    }
+    
+    out.push_back(ProtocolPacket(type,seqnum));
+    out.back().data.assign(data,len);
+    out.back().attempt = (t >> 8) & 0xff;
+    out.back().channel = (t >> 16) & 0xff;
+    out.back().flags = flags;
+    out.back().ackSeqnum = ackSeqnum;
+    out.back().ackAttempt = ackAttempt;
+    out.back().credit = credit;
+    return true;
 }
 
 
@@ -381,52 +1775,87 @@ encodePacket_s(const ProtocolPacket & p) {
 std::vector<uint8_t>
 encodePackets(const std::vector<ProtocolPacket> & pkts) {
     std::vector<uint8_t> ret;
-    
+    encodePackets(pkts,ret);
+    return ret;
+}
+
+void
+encodePackets(const std::vector<ProtocolPacket> & pkts, std::vector<uint8_t> & out, Framing framing) {
     for(std::vector<ProtocolPacket>::const_iterator it = pkts.begin(); it != pkts.end() ; it++) {
-        std::vector<uint8_t> curout = encodePacket(*it);
-        ret.insert(ret.end(),curout.begin(),curout.end());
+        encodePacket(*it,out,framing);
     }
-    return ret;
 }
 
 std::vector<uint8_t>
 encodePacket(const ProtocolPacket & p) {
-    
     std::vector<uint8_t> ret;
+    encodePacket(p,ret,FRAMING_BASE64);
+    return ret;
+}
+
+void
+encodePacket(const ProtocolPacket & p, std::vector<uint8_t> & out, Framing framing) {
+    size_t at = out.size();
+    out.resize(at + maxEncodedSize(p.data.size()));
+    out.resize(at + encodePacket(p,&out[at],framing));
+}
+
+static inline void put32(uint8_t * p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+size_t
+encodeHeader(const ProtocolPacket & p, uint8_t * out) {
     
-    uint32_t type = static_cast<uint32_t>(p.type);
-    uint32_t seqnum = p.seqnum;
+    size_t n = 4;
     
-    for(int i = 0; i < 4 ; i++) {
-        uint8_t x = type & 0xff;
-        ret.push_back(x);
-        type = type >> 8;
-    }
+    put32(out + n,static_cast<uint32_t>(p.type) | (p.attempt << 8) | (p.channel << 16) | (p.flags << 24));
+    n += 4;
+    put32(out + n,p.seqnum);
+    n += 4;
     
-    for(int i = 0; i < 4 ; i++) {
-        uint8_t x = seqnum & 0xff;
-        ret.push_back(x);
-        seqnum = seqnum >> 8;
+    if (p.flags & FLAG_ACK) {
+        put32(out + n,p.ackSeqnum);
+        out[n + 4] = p.ackAttempt;
+        n += 5;
     }
     
-    ret.insert(ret.end(),p.data.begin(),p.data.end());
-    
-    uint32_t checksum = checksumFunc(ret.begin(),ret.end());
-    
-    
-    for(int i = 0; i < 4 ; i++) {
-        uint8_t x = (checksum) &  0xff;
-        ret.insert(ret.begin(),x);
-        checksum = checksum >> 8;
+    if (p.flags & FLAG_CREDIT) {
+        put32(out + n,p.credit);
+        n += 4;
     }
     
-    std::reverse(ret.begin(),ret.begin() + 4);
+    uint32_t checksum = frameChecksum(out + 4,n - 4,p.flags);
+    put32(out,frameChecksum(p.data.begin(),p.data.size(),p.flags,checksum));
+    return n;
+}
+
+size_t
+encodePacket(const ProtocolPacket & p, uint8_t * out, Framing framing) {
     
-    ret = b64encode_v(ret);
+    uint8_t header[MAX_HEADER_SIZE + 2];
+    size_t n = encodeHeader(p,header);
+    const uint8_t * data = p.data.begin();
+    size_t len = p.data.size();
     
-    ret.push_back('\n');
+    if (framing == FRAMING_BINARY) {
+        CobsEncoder encoder(out);
+        encoder.add(header,n);
+        encoder.add(data,len);
+        size_t written = encoder.finish();
+        out[written] = 0;
+        return written + 1;
+    }
     
-    return ret;
-        
+    // base64 works in groups of 3 bytes, so the header is made up to a whole
+    // number of them from the payload, and the two encode separately.
+    size_t fill = std::min<size_t>((3 - n % 3) % 3,len);
+    memcpy(header + n,data,fill);
+    size_t written = b64encode(header,n + fill,out);
+    written += b64encode(data + fill,len - fill,out + written);
+    out[written] = '\n';
+    return written + 1;
 }
-
@@ -1,49 +1,202 @@
 #pragma once
 #include <stdint.h>
-#include <tr1/memory>
 #include <string>
 #include <vector>
+#include <map>
 
 #include <cstring>
 
-enum ProtoState {
-    STATE_UNINIT,
-    STATE_LISTENING,
-    STATE_CONNECTING,
-    STATE_CONNECTED,
-};
-
-enum PacketType {
-    TYPE_PING,
-    TYPE_CON,
-    TYPE_CONACK,
-    TYPE_ACK,
-    TYPE_DATA
-};
+#include "fec.h"
+#include "compress.h"
+#include "buffers.h"
+#include "wire.h"
+#include "arq.h"
 
 class ProtocolPacket {
 
     public:
         PacketType type;
         uint32_t seqnum;
-        std::vector<uint8_t> data;
+        // Which transmission of a DATA packet this is, echoed back in the
+        // ACK so retransmissions still give valid RTT samples. Carried in
+        // the second byte of the type word, so zero is the original format.
+        uint8_t attempt;
+        // Logical channel of a DATA packet, carried in the third byte of the
+        // type word.
+        uint8_t channel;
+        // Option bits, carried in the top byte of the type word.
+        uint8_t flags;
+        // With FLAG_ACK set, the senders next expected DATA seqnum and the
+        // attempt number of the packet just before it.
+        uint32_t ackSeqnum;
+        uint8_t ackAttempt;
+        // With FLAG_CREDIT set, the total number of application bytes the
+        // sender of this packet is prepared to receive since connecting,
+        // modulo 2^32.
+        uint32_t credit;
+        PacketBuffer data;
         ProtocolPacket(PacketType t,uint32_t seqnum, char data[], uint32_t n );
         ProtocolPacket(PacketType t,uint32_t seqnum, std::string d );
-        ProtocolPacket(PacketType t,uint32_t seqnum, std::vector<uint8_t> data );
+        ProtocolPacket(PacketType t,uint32_t seqnum, const PacketBuffer & data );
         ProtocolPacket(PacketType t,uint32_t seqnum);
         ProtocolPacket(PacketType t);
 
 };
 
+// A DATA packet that has been sent but not yet acknowledged by the peer.
+struct InFlightPacket {
+    ProtocolPacket packet;
+    uint64_t lastSendAttempt;
+    uint32_t attempts;
+    bool acked;
+    // The base64 frame it was last sent as, and the flags it had then. A
+    // retransmission with the same header layout rewrites only the header
+    // part of the frame rather than encoding it all again.
+    PacketBuffer frame;
+    uint8_t frameFlags;
+    InFlightPacket();
+    InFlightPacket(const ProtocolPacket & p, uint64_t now);
+};
+
+// How long in ms an in order DATA packet may go unacknowledged while we wait
+// for reverse traffic to carry the ACK, and how many may pile up before we
+// ACK anyway.
+static const uint64_t DELAYED_ACK_TIMEOUT = 10;
+static const uint32_t DELAYED_ACK_COUNT = 4;
+
+// What nextTimerEvent returns when only other events can wake us.
+static const uint64_t NO_TIMER_EVENT = static_cast<uint64_t>(-1);
+
+// FEC sends one TYPE_PARITY packet for every group of DATA packets. Groups
+// are interleaved, so a group is every depth'th packet of a block of
+// group * depth packets and a burst of up to depth lost packets costs each
+// group at most one.
+static const uint32_t MIN_FEC_GROUP = 2;
+static const uint32_t MAX_FEC_GROUP = 16;
+static const uint32_t MAX_FEC_DEPTH = 8;
+
+typedef Ring<InFlightPacket,MAX_WINDOW_SIZE> SendWindow;
+
+// Payload size used before anything is known about the link.
+static const uint32_t DEFAULT_PAYLOAD_SIZE = 256;
+
+// Frame outcomes that must be seen between increases of the payload size. A
+// packet that proves too big for the link keeps its size until it gets
+// through, so growth is cautious while shrinking is immediate.
+static const uint32_t PAYLOAD_GROWTH_SAMPLES = 32;
+
+// Smallest receive buffer that may be advertised, so there is always room
+// for a full sized packet once the application catches up.
+static const uint32_t MIN_RECEIVE_BUFFER = 2 * MAX_PAYLOAD_SIZE;
+
+// Header, checksum and piggybacked ACK bytes added to every DATA payload.
+static const uint32_t PACKET_OVERHEAD = 17;
+
+// Frame outcomes bucketed by encoded frame size, used to estimate the
+// per byte corruption rate of the link and from that the payload size that
+// gives the best expected goodput.
+class LinkQuality {
+    
+    public:
+        LinkQuality();
+        
+        void record(uint32_t frameSize, bool ok);
+        double byteErrorRate() const;
+        uint32_t bestPayloadSize(uint32_t maxPayload, Framing framing = FRAMING_BASE64) const;
+        uint32_t samples() const;
+    
+    private:
+        uint32_t total;
+        static const int NBUCKETS = 16;
+        double sent[NBUCKETS];
+        double failed[NBUCKETS];
+};
+
+uint32_t
+encodedFrameSize(uint32_t payloadSize, Framing framing = FRAMING_BASE64);
+
+enum ChannelEventType {
+    CHANNEL_OPENED,
+    CHANNEL_CLOSED
+};
+
+// Something the peer did to a channel that the application should act on.
+// target is only set for CHANNEL_OPENED.
+struct ChannelEvent {
+    ChannelEventType type;
+    uint8_t channel;
+    std::string target;
+    ChannelEvent(ChannelEventType t, uint8_t ch, const std::string & target);
+};
+
+// Send side state of an open channel. Channels with data waiting are served
+// in order of virtual start time, start-time fair queueing, so each gets a
+// share of the link in proportion to its weight.
+struct SendChannel {
+    ByteQueue queue;
+    uint32_t weight;
+    double finish;
+    // control messages still to be sent.
+    bool openPending;
+    bool closePending;
+    // we have sent, or received, a CLOSE for the channel.
+    bool closed;
+    bool peerClosed;
+    std::string target;
+    // Flow control on channels other than 0, which each have their own
+    // credit so that a stalled reader holds up nobody else. The send side
+    // counts as Protocol does for channel 0, and the receive side's credit
+    // goes to the peer with CHANNEL_CREDIT.
+    uint32_t sentBytes;
+    uint32_t peerLimit;
+    uint32_t recvConsumed;
+    uint32_t advertisedConsumed;
+    SendChannel();
+};
+
+// Largest decoded frame a valid packet makes: checksum, header, ACK, credit
+// and a full payload buffer.
+static const uint32_t MAX_FRAME_SIZE = MAX_HEADER_SIZE + MAX_PACKET_DATA;
+
+// Splits the byte stream from the link into frames and parses them. Complete
+// frames are decoded straight from the caller's data; only a frame split
+// across calls is copied, into a buffer that never grows past the largest
+// valid frame. A frame that runs longer than that is garbage, and is skipped
+// up to the next delimiter.
 class PacketBuilder {
     
     public:
        std::vector<ProtocolPacket> addData(uint8_t * p,int sz);
-       std::vector<ProtocolPacket> addData(const std::vector<uint8_t> & data);
+       std::vector<ProtocolPacket> addData(const std::vector<uint8_t> & data, LinkQuality * quality = NULL);
        std::vector<ProtocolPacket> addData(const std::string & data);
+       void addData(const uint8_t * p, size_t n, LinkQuality * quality, std::vector<ProtocolPacket> & out);
+       
+       PacketBuilder();
+       // Lets a zero byte in base64 text start a COBS frame. The first intact
+       // one that isn't a probe switches the builder to COBS for good.
+       void allowBinary(bool on);
+       Framing getFraming() const;
     
     private:
-        std::vector<uint8_t> buffered;
+        Framing framing;
+        bool binaryAllowed;
+        // the start of a frame whose delimiter hasn't arrived, or how much
+        // of an overlong one has been skipped so far.
+        std::vector<uint8_t> partial;
+        bool discarding;
+        size_t discarded;
+        // the bytes since a zero seen in base64 text, which may be a COBS
+        // frame. Lines in them are parsed as usual in case they aren't,
+        // and the sizes of those that failed kept to be counted only then.
+        bool trialActive;
+        std::vector<uint8_t> trial;
+        std::vector<uint32_t> trialFailures;
+        // decoded frame, reused.
+        std::vector<uint8_t> frame;
+        
+        void _frameEnd(const uint8_t * p, size_t n, uint8_t delimiter, LinkQuality * quality, std::vector<ProtocolPacket> & out);
+        void _endTrial(LinkQuality * quality);
+        bool _parseFrame(const uint8_t * decoded, size_t n, std::vector<ProtocolPacket> & out);
 };
 
 
@@ -54,17 +207,63 @@ class Protocol {
 
 
         void listen();
-        bool readyForData() const;
+        void setWindowSize(uint32_t n);
+        void setMaxPayloadSize(uint32_t n);
+        void setFec(uint32_t group, uint32_t depth);
+        void setCompression(bool on);
+        void setReceiveBuffer(uint32_t bytes);
+        void setBinaryFraming(bool on);
+        void setCrc32c(bool on);
+        bool getCrc32c() const;
+        // whether to offer OPT_CHANNELS, on by default. Off, neither side can
+        // open channels on the connection.
+        void setChannels(bool on);
+        Framing getFraming() const;
+        void dataConsumed(uint32_t bytes, uint8_t channel = 0);
+        bool readyForData(uint8_t channel = 0) const;
         ProtoState getState() const;
+        uint64_t getSmoothedRtt() const;
+        uint64_t getRetransmitTimeout() const;
+        uint64_t nextTimerEvent(uint64_t now) const;
+        uint32_t getTargetPayloadSize() const;
+        uint32_t getFecGroup() const;
+        uint32_t getFecDepth() const;
+        bool getCompression() const;
+        const CompressionStats & getCompressStats() const;
+        const CompressionStats & getDecompressStats() const;
         
         std::vector<uint8_t> timerEvent(uint64_t time);
         std::pair<std::vector<uint8_t>,std::vector<uint8_t> > 
         dataEvent(const std::vector<uint8_t> & datain,uint64_t time, bool wantData = false);
+        
+        // As above, but appending to buffers the caller keeps, so that steady
+        // traffic doesn't allocate.
+        void timerEvent(uint64_t time, std::vector<uint8_t> & out);
+        void dataEvent(const uint8_t * datain, size_t n, uint64_t time, bool wantData,
+                       std::vector<uint8_t> & out, std::vector<uint8_t> & data);
+        void sendData(uint8_t channel, const uint8_t * data, size_t n, uint64_t time, std::vector<uint8_t> & out);
+        
+        // As above, writing link bytes for the peer to out and channel 0 data
+        // to data, straight into wherever the sinks keep them. While out is
+        // full no new DATA is packetised; ACKs, pings and retransmissions
+        // still go.
+        void timerEvent(uint64_t time, ByteSink & out);
+        void dataEvent(const uint8_t * datain, size_t n, uint64_t time, bool wantData,
+                       ByteSink & out, ByteSink & data);
+        void sendData(uint8_t channel, const uint8_t * data, size_t n, uint64_t time, ByteSink & out);
+        void connect(uint64_t time, ByteSink & out);
     
         std::vector<uint8_t> sendData(std::vector<uint8_t>  data, uint64_t time);
         std::vector<uint8_t> sendData(const char * c, uint64_t time);
+        std::vector<uint8_t> sendData(uint8_t channel, std::vector<uint8_t> data, uint64_t time);
         std::vector<uint8_t> connect(uint64_t time);    
         
+        int openChannel(const std::string & target, uint32_t weight);
+        void closeChannel(uint8_t channel);
+        void setChannelWeight(uint8_t channel, uint32_t weight);
+        std::vector<uint8_t> takeChannelData(uint8_t channel);
+        std::vector<ChannelEvent> takeChannelEvents();
+        
         
     private:
         
@@ -73,32 +272,186 @@ class Protocol {
     
         std::vector<ProtocolPacket> _sendData(std::vector<uint8_t>  data, uint64_t time);
         std::vector<ProtocolPacket> _sendData(const char * c, uint64_t time);
+        std::vector<ProtocolPacket> _sendData(uint8_t channel, std::vector<uint8_t> data, uint64_t time);
+        
+        void _timerEvent(uint64_t time, std::vector<ProtocolPacket> & out);
+        void _packetEvent(ProtocolPacket & packet, uint64_t time, bool wantData,
+                          std::vector<ProtocolPacket> & out, ByteSink & data);
+        void _sendData(uint8_t channel, const uint8_t * data, size_t n, uint64_t time, std::vector<ProtocolPacket> & out);
         std::vector<ProtocolPacket> _connect(uint64_t time);   
         
+        void _handleAck(const ProtocolPacket & packet, uint64_t time);
+        void _ackOne(uint32_t seq, uint8_t attempt, uint64_t time, bool explicitAck);
+        void _ackBelow(uint32_t cumulative, uint64_t time);
+        ProtocolPacket _makeAck(uint32_t seq, uint8_t attempt);
+        void _piggybackAck(ProtocolPacket & packet);
+        void _flushPending(std::vector<ProtocolPacket> & out, uint64_t time);
+        void _receiveData(ProtocolPacket & packet, uint64_t time,
+                          std::vector<ProtocolPacket> & out, ByteSink & data);
+        void _deliver(const ProtocolPacket & packet, ByteSink & out);
+        void _channelControl(const ProtocolPacket & packet);
+        void _channelReset();
+        int _nextChannel() const;
+        bool _channelCreditDue(uint8_t id, const SendChannel & ch) const;
+        uint32_t _inFlight(uint8_t channel) const;
+        
+        void _flowReset();
+        void _stampCredit(ProtocolPacket & packet);
+        int32_t _sendCredit(uint8_t channel) const;
+        
+        void _framingReset();
+        void _encode(std::vector<ProtocolPacket> & packets, ByteSink & out);
+        ProtocolPacket _probe() const;
+        InFlightPacket * _inFlightEntry(uint32_t seq);
+        bool _encodeResend(const ProtocolPacket & packet, ByteSink & out);
+        uint32_t _frameSize(uint32_t payloadSize) const;
+        
+        std::vector<uint8_t> _connectOptions() const;
+        void _applyOptions(const PacketBuffer & options, bool listener);
+        
+        void _fecReset();
+        void _compressReset();
+        void _fecSent(const ProtocolPacket & packet, std::vector<ProtocolPacket> & out);
+        void _fecRecover(uint32_t first, uint64_t time,
+                         std::vector<ProtocolPacket> & out, ByteSink & data);
     
+
         ProtoState state;
         uint32_t seqnum;
         uint32_t expectedDataSeqnum;
         uint64_t timeoutInterval;
         uint64_t lastKeepAlive;
         uint64_t lastPingSendTime;
-        uint64_t lastSendAttempt;
-        uint64_t sendAttemptInterval;
+        RttEstimator rtt;
         uint64_t pingInterval;
-        std::tr1::shared_ptr<ProtocolPacket> outgoingDataPacket;
+        uint32_t windowSize;
+        
+        // unacknowledged DATA packets, oldest first. seqnum is the next
+        // sequence number to be assigned.
+        SendWindow sendWindow;
+        // open channels, each with the application data accepted by sendData
+        // but not yet packetised because the window was full. virtualTime is
+        // the start tag of the last packet sent.
+        std::map<uint8_t,SendChannel> channels;
+        double virtualTime;
+        // whether we connected rather than listened, which decides the
+        // numbers we give channels we open.
+        bool initiator;
+        // data received on channels other than 0 and channel events, until
+        // the application collects them.
+        std::map<uint8_t,std::vector<uint8_t> > channelInbox;
+        std::vector<ChannelEvent> channelEvents;
+        uint32_t maxPayloadSize;
+        uint32_t targetPayloadSize;
+        uint32_t lastResizeSamples;
+        LinkQuality linkQuality;
+        // DATA packets that arrived ahead of expectedDataSeqnum.
+        std::map<uint32_t,ProtocolPacket> reorderBuffer;
+        
+        // in order DATA packets received but not yet acknowledged, the
+        // latest of which is pendingAckSeqnum.
+        uint32_t ackPending;
+        uint64_t ackPendingSince;
+        uint32_t pendingAckSeqnum;
+        uint8_t pendingAckAttempt;
+        
+        // FEC strength we ask for, and what was agreed with the peer. A
+        // group size of zero means FEC is off.
+        uint32_t fecWantGroup;
+        uint32_t fecWantDepth;
+        uint32_t fecGroup;
+        uint32_t fecDepth;
+        // parity being built for each lane of the current block.
+        std::vector<ParityAccumulator> fecLanes;
+        // recently received payloads and parity, by seqnum and by the
+        // seqnum of the first packet in the group.
+        std::map<uint32_t,std::vector<uint8_t> > fecReceived;
+        std::map<uint32_t,std::vector<uint8_t> > fecParity;
+        
+        // Flow control. The receive side counts the bytes the application
+        // has consumed, and lets the peer send until recvBufferSize more
+        // than that. The send side counts the application bytes it has
+        // packetised and stops at the latest limit the peer advertised.
+        uint32_t recvBufferSize;
+        bool flowOn;
+        uint32_t recvConsumed;
+        uint32_t advertisedConsumed;
+        uint32_t sentBytes;
+        uint32_t peerLimit;
+        // the peer's receive buffer, each new channel's first credit.
+        uint32_t peerBufferSize;
+        
+        // Binary framing. We send COBS frames once the peer agreed to take
+        // them and has seen our probe arrive intact; peerProbeOk says we have
+        // seen theirs, which we tell them with FLAG_CLEAN.
+        bool framingWant;
+        bool framingOn;
+        bool peerProbeOk;
+        bool cleanPending;
+        bool binaryOut;
+        bool binaryStarted;
+        uint32_t probesSent;
+        
+        // whether we check our frames with CRC32C, as asked for and agreed.
+        bool crcWant;
+        bool crcOn;
+        
+        // whether DATA we resend may carry its attempt number and DATA may
+        // carry an ACK, as agreed, and what the peer said it can take with
+        // OPT_LIMITS, for this connection.
+        SharedOptions shared;
+        // whether channels other than 0 may be opened, as offered and agreed.
+        bool channelsWant;
+        bool channelsOn;
+        
+        bool compressWant;
+        bool compressOn;
+        StreamCompressor compressor;
+        StreamDecompressor decompressor;
         
         PacketBuilder pb;
         
+        // reused between calls by the appending entry points.
+        std::vector<ProtocolPacket> scratchPackets;
+        std::vector<ProtocolPacket> scratchArrived;
+        std::vector<uint8_t> scratchCompressed;
+        std::vector<uint8_t> scratchPlain;
+        
+        // set while the caller's link sink is full, holding back new DATA.
+        bool linkFull;
+        
             
 };
 
 
+// Room needed to encode a packet with this much payload in either framing,
+// delimiter included.
+static inline size_t maxEncodedSize(size_t payloadSize) {
+    return (MAX_HEADER_SIZE + payloadSize + 2) / 3 * 4 + 1;
+}
+
+// Writes the header of p into out, checksum first, and returns its length.
+// The checksum covers the payload too.
+size_t
+encodeHeader(const ProtocolPacket & p, uint8_t * out);
+
+// Writes the framed packet to out, which must have room for maxEncodedSize,
+// and returns the number of bytes written.
+size_t
+encodePacket(const ProtocolPacket & p, uint8_t * out, Framing framing);
+
 std::vector<uint8_t>
 encodePacket(const ProtocolPacket & p);
 
 std::vector<uint8_t>
 encodePackets(const std::vector<ProtocolPacket> & pkts);
 
+void
+encodePackets(const std::vector<ProtocolPacket> & pkts, std::vector<uint8_t> & out, Framing framing = FRAMING_BASE64);
+
+void
+encodePacket(const ProtocolPacket & p, std::vector<uint8_t> & out, Framing framing);
+
 std::string
 encodePacket_s(const ProtocolPacket & p);
 
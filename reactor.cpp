@@ -0,0 +1,156 @@
+#include "reactor.h"
+
+#include <iostream>
+#include <cstdlib>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+// epoll events per wait.
+static const int MAX_EVENTS = 64;
+
+IoHandler::~IoHandler() {
+
+}
+
+LoopHandler::~LoopHandler() {
+
+}
+
+void LoopHandler::deadline() {
+
+}
+
+void LoopHandler::signal(int signo) {
+
+}
+
+uint64_t monotonicMicros() {
+    struct timespec ts;
+    
+    if(clock_gettime(CLOCK_MONOTONIC,&ts)) {
+        std::cerr << "error failed to get system time\n.";
+        exit(1);
+    }
+    
+    return (ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
+// The timerfd and signalfd are told apart from handlers by their data.ptr,
+// which points at the member holding them.
+Reactor::Reactor(LoopHandler & loop) : loop(loop) , signalFd(-1) , deadlineMicros(NO_DEADLINE) , running(false) {
+    this->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    this->timerFd = timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK | TFD_CLOEXEC);
+    if (this->epollFd >= 0 && this->timerFd >= 0) {
+        struct epoll_event e;
+        e.events = EPOLLIN | EPOLLET;
+        e.data.ptr = &this->timerFd;
+        epoll_ctl(this->epollFd,EPOLL_CTL_ADD,this->timerFd,&e);
+    }
+}
+
+Reactor::~Reactor() {
+    if (this->signalFd >= 0) {
+        close(this->signalFd);
+    }
+    if (this->timerFd >= 0) {
+        close(this->timerFd);
+    }
+    if (this->epollFd >= 0) {
+        close(this->epollFd);
+    }
+}
+
+bool Reactor::ok() const {
+    return this->epollFd >= 0 && this->timerFd >= 0;
+}
+
+bool Reactor::add(int fd, IoHandler * handler, uint32_t events) {
+    struct epoll_event e;
+    e.events = events | EPOLLET;
+    e.data.ptr = handler;
+    return epoll_ctl(this->epollFd,EPOLL_CTL_ADD,fd,&e) == 0;
+}
+
+bool Reactor::remove(int fd) {
+    struct epoll_event e;
+    return epoll_ctl(this->epollFd,EPOLL_CTL_DEL,fd,&e) == 0;
+}
+
+void Reactor::setDeadline(uint64_t micros) {
+    if (micros == this->deadlineMicros) {
+        return;
+    }
+    this->deadlineMicros = micros;
+    
+    // an all zero it_value disarms the timer, so a deadline at 0 is 1us.
+    struct itimerspec when;
+    when.it_interval.tv_sec = 0;
+    when.it_interval.tv_nsec = 0;
+    when.it_value.tv_sec = 0;
+    when.it_value.tv_nsec = 0;
+    if (micros != NO_DEADLINE) {
+        micros = micros ? micros : 1;
+        when.it_value.tv_sec = micros / 1000000;
+        when.it_value.tv_nsec = (micros % 1000000) * 1000;
+    }
+    timerfd_settime(this->timerFd,TFD_TIMER_ABSTIME,&when,NULL);
+}
+
+bool Reactor::catchSignals(const sigset_t & signals) {
+    if (pthread_sigmask(SIG_BLOCK,&signals,NULL)) {
+        return false;
+    }
+    this->signalFd = signalfd(this->signalFd,&signals,SFD_NONBLOCK | SFD_CLOEXEC);
+    if (this->signalFd < 0) {
+        return false;
+    }
+    struct epoll_event e;
+    e.events = EPOLLIN | EPOLLET;
+    e.data.ptr = &this->signalFd;
+    return epoll_ctl(this->epollFd,EPOLL_CTL_ADD,this->signalFd,&e) == 0 || errno == EEXIST;
+}
+
+void Reactor::_dispatch(const struct epoll_event & e) {
+    if (e.data.ptr == &this->timerFd) {
+        uint64_t expirations;
+        while (read(this->timerFd,&expirations,sizeof(expirations)) > 0) {
+        }
+        this->deadlineMicros = NO_DEADLINE;
+        this->loop.deadline();
+    } else if (e.data.ptr == &this->signalFd) {
+        struct signalfd_siginfo info;
+        while (read(this->signalFd,&info,sizeof(info)) == sizeof(info)) {
+            this->loop.signal(info.ssi_signo);
+        }
+    } else {
+        static_cast<IoHandler *>(e.data.ptr)->ioEvent(e.events);
+    }
+}
+
+void Reactor::run() {
+    struct epoll_event events[MAX_EVENTS];
+    
+    this->running = true;
+    bool busy = this->loop.afterEvents();
+    while (this->running) {
+        int n = epoll_wait(this->epollFd,events,MAX_EVENTS,busy ? 0 : -1);
+        if (n < 0 && errno != EINTR) {
+            std::cerr << "epoll_wait failed" << std::endl;
+            break;
+        }
+        for(int i = 0; i < n && this->running; i++) {
+            _dispatch(events[i]);
+        }
+        if (this->running) {
+            busy = this->loop.afterEvents();
+        }
+    }
+}
+
+void Reactor::stop() {
+    this->running = false;
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <stdint.h>
+#include <signal.h>
+#include <sys/epoll.h>
+
+// What setDeadline takes to mean no deadline.
+static const uint64_t NO_DEADLINE = static_cast<uint64_t>(-1);
+
+// Something watching an fd on a Reactor.
+class IoHandler {
+
+    public:
+        virtual ~IoHandler();
+        // events is what epoll reported, EPOLLIN, EPOLLOUT, EPOLLERR and
+        // EPOLLHUP.
+        virtual void ioEvent(uint32_t events) = 0;
+};
+
+// What a Reactor calls out to besides the handlers of its fds.
+class LoopHandler {
+
+    public:
+        virtual ~LoopHandler();
+        // the deadline given to setDeadline has come.
+        virtual void deadline();
+        // one of the signals given to catchSignals arrived.
+        virtual void signal(int signo);
+        // Called once each time round, after the ioEvents, so handlers can
+        // just note what became ready and the work be done here. Returning
+        // true means there is more to do now, and the loop only polls before
+        // calling again.
+        virtual bool afterEvents() = 0;
+};
+
+// An epoll loop. fds are edge triggered, so a handler is told once each time
+// its fd becomes ready, and it is up to the owner to keep reading or writing
+// until EAGAIN. A timerfd carries a single deadline on CLOCK_MONOTONIC and a
+// signalfd turns signals into calls, so both arrive as ordinary events.
+class Reactor {
+
+    public:
+        explicit Reactor(LoopHandler & loop);
+        ~Reactor();
+
+        bool ok() const;
+
+        // fd should be non blocking. remove must come before the handler
+        // goes away, unless the fd is closed first.
+        bool add(int fd, IoHandler * handler, uint32_t events = EPOLLIN | EPOLLOUT);
+        bool remove(int fd);
+
+        // microseconds on CLOCK_MONOTONIC, replacing any earlier deadline.
+        void setDeadline(uint64_t micros);
+
+        // Blocks the signals, in this thread and in threads it starts after,
+        // and hands them to the LoopHandler instead.
+        bool catchSignals(const sigset_t & signals);
+
+        // Dispatches events until stop.
+        void run();
+        void stop();
+
+    private:
+        LoopHandler & loop;
+        int epollFd;
+        int timerFd;
+        int signalFd;
+        uint64_t deadlineMicros;
+        bool running;
+
+        void _dispatch(const struct epoll_event & e);
+};
+
+// microseconds on the clock Reactor deadlines use.
+uint64_t monotonicMicros();
@@ -0,0 +1,74 @@
+#include "serial.h"
+#include "tty.h"
+
+#include <cstdlib>
+#include <vector>
+#include <signal.h>
+#include <unistd.h>
+
+// The ports open, and how they were before. Only opened and closed outside
+// the loops, a console server opens all of its ports before it starts any.
+struct OpenPort {
+    int fd;
+    struct termios2 original;
+};
+static std::vector<OpenPort> opened;
+
+static void _restore() {
+    for(size_t i = 0; i < opened.size(); i++) {
+        ttyRestore(opened[i].fd,&opened[i].original);
+    }
+}
+
+static void _restoreAndDie(int signo) {
+    _restore();
+    _exit(1);
+}
+
+bool parseSerial(const char * spec, std::string & path, uint32_t & baud) {
+    std::string s(spec);
+    size_t colon = s.rfind(':');
+    baud = 115200;
+    if (colon != std::string::npos) {
+        char * end;
+        unsigned long b = strtoul(s.c_str() + colon + 1,&end,10);
+        if (*end || !b || b > 0xffffffffUL) {
+            return false;
+        }
+        baud = b;
+        s.erase(colon);
+    }
+    path = s;
+    return !path.empty();
+}
+
+int openSerial(const char * path, uint32_t baud) {
+    OpenPort port;
+    // a read returns as soon as there is a byte
+    port.fd = ttyOpenRaw(path,baud,1,0,&port.original);
+    if (port.fd < 0) {
+        return -1;
+    }
+    
+    opened.push_back(port);
+    static bool registered = false;
+    if (!registered) {
+        atexit(_restore);
+        registered = true;
+    }
+    // until the proxy loop takes signals over
+    signal(SIGINT,_restoreAndDie);
+    signal(SIGTERM,_restoreAndDie);
+    return port.fd;
+}
+
+void closeSerial(int fd) {
+    for(size_t i = 0; i < opened.size(); i++) {
+        if (opened[i].fd == fd) {
+            ttyRestore(fd,&opened[i].original);
+            opened.erase(opened.begin() + i);
+            break;
+        }
+    }
+    close(fd);
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+
+// Opens a serial port for the link, raw, 8N1, no flow control of either
+// kind, at baud bits a second. The usual rates go in as themselves, any
+// other is asked of the driver as is. Returns -1, having said why, if the
+// port can't be had. The port is put back as it was at exit, or on
+// closeSerial.
+int openSerial(const char * path, uint32_t baud);
+
+// PATH[:BAUD], baud defaulting to 115200.
+bool parseSerial(const char * spec, std::string & path, uint32_t & baud);
+
+void closeSerial(int fd);
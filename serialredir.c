@@ -8,25 +8,29 @@
 #include <stdarg.h>
 #include <signal.h>
 #include <unistd.h>
-#include <termios.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
 #include <limits.h>
+#include <linux/serial.h>
 
-/* this program disables echo and sets the baud rate on the specified tty
+#include "tty.h"
+
+/* this program puts the specified tty in raw mode and sets its baud rate
    it then redirects all stdin into the tty and gets all its stdout from the tty 
  */
 
-static struct termios orig_termios;  /* TERMinal I/O Structure */
+static struct termios2 orig_termios;  /* TERMinal I/O Structure */
 static int toreset = -1;
 
 int tty_reset() {
     /* flush and reset */
     
     if(toreset != -1) {
-        if (tcsetattr(toreset,TCSAFLUSH,&orig_termios) < 0) 
+        if (ttyRestore(toreset,&orig_termios) < 0) 
             return -1;
     }
     return 0;
@@ -75,114 +79,124 @@ static int write_all(int fd, uint8_t buff[],unsigned int sz) {
 }
 
 
-struct SpeedTab_e {
-    char * str; 
-    speed_t speed;
-} ;
-
-static struct SpeedTab_e bauds[] = {
-    {"300",B300},	
-    {"600",B600},	
-    {"1200",B1200},	
-    {"1800",B1800},	
-    {"2400",B2400},
-    {"4800",B4800},
-    {"9600",B9600},
-    {"19200",B19200},
-    {"38400",B38400},
-    {"57600",B57600},
-    {"115200",B115200},
-    {"230400",B230400},
-    {"460800",B460800},
-    {"500000",B500000},
-    {"576000",B576000},
-    {"921600",B921600},
-    {"1000000",B1000000},
-    {"1152000",B1152000},
-    {"1500000",B1500000},
-    {"2000000",B2000000},
-    {NULL, 0}
-};
-
-
-static
-speed_t str2speed(char * s) {
-    struct SpeedTab_e * e = bauds;
-    while(e->str) {
-        if(strcmp(e->str,s) == 0) {
-            return e->speed;
-        }
-        
-        e++;
+/* any rate the driver takes, not only those with a B constant, for the
+   3 and 4 Mbaud adapters and the like */
+static int parse_rate(char * s, uint32_t * rate) {
+    char * end;
+    unsigned long r = strtoul(s,&end,10);
+    if(*end || r == 0 || r > UINT_MAX) {
+        return -1;
     }
+    *rate = r;
     return 0;
 }
 
 
+static int parse_cc(char * s, int * v) {
+    char * end;
+    long l = strtol(s,&end,10);
+    if(*end || l < 0 || l > 255) {
+        return -1;
+    }
+    *v = l;
+    return 0;
+}
+
+
+/* asks the driver to push received bytes up at once rather than on its
+   next tick, not every driver has it (usb serial adapters tend to keep a
+   latency timer of their own, in sysfs) */
+static void set_low_latency(int fd) {
+    struct serial_struct ss;
+    if(ioctl(fd,TIOCGSERIAL,&ss) < 0) {
+        perror("no low latency on this port");
+        return;
+    }
+    ss.flags |= ASYNC_LOW_LATENCY;
+    if(ioctl(fd,TIOCSSERIAL,&ss) < 0) {
+        perror("can't set low latency");
+    }
+}
+
+
+static void usage() {
+    fprintf(stderr,"usage: serialredir [-l] [-m vmin] [-t vtime] tty baud\n"
+                   "  -l        low latency, where the driver has it\n"
+                   "  -m vmin   bytes a read waits for, 1 by default\n"
+                   "  -t vtime  tenths of a second a read waits after a byte, 0 by default\n");
+    exit(1);
+}
+
+
 int 
 main (int argc, char *argv[])
 {
     
     int err;
     int n_r;
-    
-    if(argc < 3) {
-        fprintf(stderr,"Bad args\n");
-        exit(1);
+    int opt;
+    int lowLatency = 0;
+    /* a read returns as soon as there is a byte: select only says the tty is
+       readable once there are vmin bytes, or with vtime set, after the first,
+       and then the read waits up to vtime for the rest of a batch. bigger
+       batches mean fewer wakeups at the cost of that wait, during which
+       stdin isn't looked at */
+    int vmin = 1;
+    int vtime = 0;
+    
+    while((opt = getopt(argc,argv,"lm:t:")) != -1) {
+        switch(opt) {
+        case 'l':
+            lowLatency = 1;
+            break;
+        case 'm':
+            if(parse_cc(optarg,&vmin) < 0) {
+                usage();
+            }
+            break;
+        case 't':
+            if(parse_cc(optarg,&vtime) < 0) {
+                usage();
+            }
+            break;
+        default:
+            usage();
+        }
     }
-
-    int serport = open(argv[1],O_RDWR);
     
-    if(serport < 0) {
-        perror("cannot open serial port!");
-        exit(1);
+    if(argc - optind < 2) {
+        usage();
     }
     
-
-    /* check that input is from a tty */
-    if (! isatty(serport)) {
-        fprintf(stderr,"%s not on a tty!",argv[1]);
+    char * path = argv[optind];
+    char * baud = argv[optind + 1];
+    
+    uint32_t rate;
+    if(parse_rate(baud,&rate) < 0) {
+        fprintf(stderr,"invalid baud rate %s\n",baud);
         exit(1);
     }
-
-    /* store current tty settings in orig_termios */
-    if (tcgetattr(serport,&orig_termios) < 0) {
-        perror("can't get tty settings");
+    
+    int serport = ttyOpenRaw(path,rate,vmin,vtime,&orig_termios);
+    if(serport < 0) {
         exit(1);
     }
-
+    
+    toreset = serport;
+    
     /* register the tty reset with the exit handler */
     if (atexit(tty_atexit) != 0) {
         perror("atexit: can't register tty reset");
+        tty_reset();
         exit(1);
     }
     
-    toreset = serport;
-    
     signal(SIGINT, sig_handler);
+    signal(SIGTERM, sig_handler);
+    signal(SIGHUP, sig_handler);
     
-    struct termios newTermios;
-    
-    
-    newTermios = orig_termios;
-    
-    newTermios.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
-    
-    speed_t s = str2speed(argv[2]);
-    
-    if(s == 0) {
-        fprintf(stderr,"invalid baud rate %s\n",argv[2]);
-        exit(1);
-    }
-    
-    if(cfsetspeed(&newTermios,s) < 0) {
-        perror("cant set port speed");
-        exit(1);
-    }
-    
-    if (tcsetattr(serport,TCSANOW,&newTermios) < 0) {
-        perror("can't set new tty settings");
-        exit(1);
+    if(lowLatency) {
+        set_low_latency(serport);
     }
     
     uint8_t buff[4096];
@@ -0,0 +1,212 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+// A lock-free ring of bytes between one producer thread and one consumer
+// thread. Each side owns one index and only reads the other's, so the only
+// synchronisation is an acquire load of the other side's index and a
+// release store of its own.
+//
+// A side with nothing to do may sleep until the other makes progress, on an
+// eventfd the other side signals only when asked to, so a busy ring makes
+// no system calls. A side that waits in select or poll instead arms the
+// wakeup first and watches dataFd or roomFd. Either side may close the ring,
+// which wakes the other for good.
+template <uint32_t N>
+class SpscRing {
+
+    public:
+        SpscRing() : head(0) , tail(0) , dataWanted(false) , roomWanted(false) , isClosed(false) {
+            dataEvent = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+            roomEvent = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+        }
+
+        ~SpscRing() {
+            ::close(dataEvent);
+            ::close(roomEvent);
+        }
+
+        // Producer side. writable returns where up to n contiguous bytes
+        // may be written, and produce makes that many visible.
+        uint8_t * writable(size_t & n) {
+            uint64_t h = head;
+            uint64_t free = N - (h - __atomic_load_n(&tail,__ATOMIC_ACQUIRE));
+            uint64_t toEnd = N - (h & (N - 1));
+            n = free < toEnd ? free : toEnd;
+            return bytes + (h & (N - 1));
+        }
+
+        void produce(size_t n) {
+            if (!n) {
+                return;
+            }
+            __atomic_store_n(&head,head + n,__ATOMIC_RELEASE);
+            _wake(dataWanted,dataEvent);
+        }
+
+        // Copies in as much of the n bytes as fits and returns how many.
+        size_t write(const uint8_t * p, size_t n) {
+            size_t done = 0;
+            while (done < n) {
+                size_t room;
+                uint8_t * to = writable(room);
+                if (!room) {
+                    break;
+                }
+                room = room < n - done ? room : n - done;
+                memcpy(to,p + done,room);
+                produce(room);
+                done += room;
+            }
+            return done;
+        }
+
+        size_t room() const {
+            return N - (head - __atomic_load_n(&tail,__ATOMIC_ACQUIRE));
+        }
+
+        // Consumer side. readable returns up to n contiguous bytes, and
+        // consume frees that many.
+        const uint8_t * readable(size_t & n) {
+            uint64_t t = tail;
+            uint64_t used = __atomic_load_n(&head,__ATOMIC_ACQUIRE) - t;
+            uint64_t toEnd = N - (t & (N - 1));
+            n = used < toEnd ? used : toEnd;
+            return bytes + (t & (N - 1));
+        }
+
+        void consume(size_t n) {
+            if (!n) {
+                return;
+            }
+            __atomic_store_n(&tail,tail + n,__ATOMIC_RELEASE);
+            _wake(roomWanted,roomEvent);
+        }
+
+        // Copies out up to n bytes and returns how many.
+        size_t read(uint8_t * p, size_t n) {
+            size_t done = 0;
+            while (done < n) {
+                size_t avail;
+                const uint8_t * from = readable(avail);
+                if (!avail) {
+                    break;
+                }
+                avail = avail < n - done ? avail : n - done;
+                memcpy(p + done,from,avail);
+                consume(avail);
+                done += avail;
+            }
+            return done;
+        }
+
+        size_t size() const {
+            return __atomic_load_n(&head,__ATOMIC_ACQUIRE) - tail;
+        }
+
+        // Ask to be woken through dataFd when data arrives, returning true
+        // if there is some already, or the ring is closed.
+        bool armData() {
+            _arm(dataWanted);
+            return size() > 0 || closed();
+        }
+
+        bool armRoom() {
+            _arm(roomWanted);
+            return room() > 0 || closed();
+        }
+
+        void waitForData() {
+            while (!armData()) {
+                _sleep(dataEvent);
+            }
+            _drain(dataEvent);
+        }
+
+        void waitForRoom() {
+            while (!armRoom()) {
+                _sleep(roomEvent);
+            }
+            _drain(roomEvent);
+        }
+
+        int dataFd() const {
+            return dataEvent;
+        }
+
+        int roomFd() const {
+            return roomEvent;
+        }
+
+        // Clears a wakeup seen through dataFd or roomFd.
+        void clearData() {
+            _drain(dataEvent);
+        }
+
+        void clearRoom() {
+            _drain(roomEvent);
+        }
+
+        void close() {
+            __atomic_store_n(&isClosed,true,__ATOMIC_SEQ_CST);
+            _signal(dataEvent);
+            _signal(roomEvent);
+        }
+
+        bool closed() const {
+            return __atomic_load_n(&isClosed,__ATOMIC_SEQ_CST);
+        }
+
+    private:
+        // each index on its own cache line, away from the other side's.
+        uint64_t head __attribute__((aligned(64)));
+        uint64_t tail __attribute__((aligned(64)));
+        bool dataWanted __attribute__((aligned(64)));
+        bool roomWanted;
+        bool isClosed;
+        int dataEvent;
+        int roomEvent;
+        uint8_t bytes[N] __attribute__((aligned(64)));
+
+        // The flag is set, then the ring checked, on one side; the index
+        // moved, then the flag checked, on the other. The fences make sure
+        // at least one of them sees the other's write.
+        static void _arm(bool & wanted) {
+            __atomic_store_n(&wanted,true,__ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        }
+
+        static void _wake(bool & wanted, int fd) {
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&wanted,__ATOMIC_SEQ_CST)) {
+                __atomic_store_n(&wanted,false,__ATOMIC_SEQ_CST);
+                _signal(fd);
+            }
+        }
+
+        static void _signal(int fd) {
+            uint64_t one = 1;
+            while (::write(fd,&one,sizeof(one)) < 0 && errno == EINTR) {
+            }
+        }
+
+        static void _sleep(int fd) {
+            struct pollfd p;
+            p.fd = fd;
+            p.events = POLLIN;
+            p.revents = 0;
+            while (poll(&p,1,-1) < 0 && errno == EINTR) {
+            }
+        }
+
+        static void _drain(int fd) {
+            uint64_t count;
+            while (::read(fd,&count,sizeof(count)) < 0 && errno == EINTR) {
+            }
+        }
+};
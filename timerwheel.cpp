@@ -0,0 +1,198 @@
+#include "timerwheel.h"
+
+// The first of slots idx + 1, idx + 2, ... idx + 64, all mod 64, that is set
+// in mask, as how far on it is.
+static int nextSlot(uint64_t mask, int idx) {
+    int shift = (idx + 1) & 63;
+    uint64_t rotated = shift ? (mask >> shift) | (mask << (64 - shift)) : mask;
+    return __builtin_ctzll(rotated) + 1;
+}
+
+static void initList(WheelLink & head) {
+    head.prev = &head;
+    head.next = &head;
+}
+
+WheelTimer::WheelTimer() : when(0) , level(0) , slot(0) {
+    this->prev = NULL;
+    this->next = NULL;
+}
+
+WheelTimer::~WheelTimer() {
+
+}
+
+bool WheelTimer::pending() const {
+    return this->next != NULL;
+}
+
+TimerWheel::TimerWheel(uint64_t now) : current(now) , count(0) {
+    for(int l = 0; l < WHEEL_LEVELS; l++) {
+        for(int s = 0; s < WHEEL_SLOTS; s++) {
+            initList(this->slots[l][s]);
+        }
+        this->occupied[l] = 0;
+    }
+}
+
+TimerWheel::~TimerWheel() {
+
+}
+
+uint32_t TimerWheel::size() const {
+    return this->count;
+}
+
+void TimerWheel::schedule(WheelTimer & t, uint64_t when) {
+    cancel(t);
+    t.when = when;
+    _insert(t);
+    this->count++;
+}
+
+void TimerWheel::cancel(WheelTimer & t) {
+    if (t.pending()) {
+        _unlink(t);
+        this->count--;
+    }
+}
+
+// On the finest level that spans the time until it is due, in the slot for
+// that time. Past the top level's span it goes in the top level anyway, and
+// is put back there each time round until it is in reach.
+void TimerWheel::_insert(WheelTimer & t) {
+    uint64_t when = t.when > this->current ? t.when : this->current;
+    uint64_t delta = when - this->current;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && (delta >> (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    int slot = (when >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    
+    WheelLink & head = this->slots[level][slot];
+    t.level = level;
+    t.slot = slot;
+    t.prev = head.prev;
+    t.next = &head;
+    head.prev->next = &t;
+    head.prev = &t;
+    this->occupied[level] |= 1ULL << slot;
+}
+
+void TimerWheel::_unlink(WheelTimer & t) {
+    t.prev->next = t.next;
+    t.next->prev = t.prev;
+    t.prev = NULL;
+    t.next = NULL;
+    WheelLink & head = this->slots[t.level][t.slot];
+    if (head.next == &head) {
+        this->occupied[t.level] &= ~(1ULL << t.slot);
+    }
+}
+
+// Moves a whole slot's list onto into, so that what is taken can be worked
+// through while callbacks schedule more into the same slot.
+void TimerWheel::_take(WheelLink & slot, WheelLink & into) {
+    initList(into);
+    if (slot.next == &slot) {
+        return;
+    }
+    into.next = slot.next;
+    into.prev = slot.prev;
+    into.next->prev = &into;
+    into.prev->next = &into;
+    initList(slot);
+}
+
+// current has just come to the start of this level's slot, so whatever is in
+// it goes down to where it now belongs.
+void TimerWheel::_cascade(int level) {
+    int slot = (this->current >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    WheelLink taken;
+    _take(this->slots[level][slot],taken);
+    this->occupied[level] &= ~(1ULL << slot);
+    while (taken.next != &taken) {
+        WheelTimer & t = *static_cast<WheelTimer *>(taken.next);
+        taken.next = t.next;
+        t.next->prev = &taken;
+        _insert(t);
+    }
+}
+
+void TimerWheel::_expireSlot() {
+    int slot = this->current & (WHEEL_SLOTS - 1);
+    if (!(this->occupied[0] & (1ULL << slot))) {
+        return;
+    }
+    WheelLink taken;
+    _take(this->slots[0][slot],taken);
+    this->occupied[0] &= ~(1ULL << slot);
+    while (taken.next != &taken) {
+        WheelTimer & t = *static_cast<WheelTimer *>(taken.next);
+        taken.next = t.next;
+        t.next->prev = &taken;
+        t.prev = NULL;
+        t.next = NULL;
+        this->count--;
+        t.expire(this->current);
+    }
+}
+
+void TimerWheel::advance(uint64_t now) {
+    if (!this->count) {
+        this->current = now > this->current ? now : this->current;
+        return;
+    }
+    
+    _expireSlot();
+    while (this->current < now) {
+        // straight to the next slot with anything in it, or to the end of
+        // the level, where the levels above may have some to hand down.
+        int idx = this->current & (WHEEL_SLOTS - 1);
+        uint64_t ahead = idx == WHEEL_SLOTS - 1 ? 0 : this->occupied[0] >> (idx + 1);
+        uint64_t step = ahead ? __builtin_ctzll(ahead) + 1 : WHEEL_SLOTS - idx;
+        step = step < now - this->current ? step : now - this->current;
+        this->current += step;
+        
+        if (!(this->current & (WHEEL_SLOTS - 1))) {
+            int top = 1;
+            while (top < WHEEL_LEVELS - 1 && !((this->current >> (WHEEL_BITS * top)) & (WHEEL_SLOTS - 1))) {
+                top++;
+            }
+            for(int l = top; l > 0; l--) {
+                _cascade(l);
+            }
+        }
+        _expireSlot();
+        
+        if (!this->count) {
+            this->current = now;
+        }
+    }
+}
+
+uint64_t TimerWheel::nextExpiry() const {
+    if (!this->count) {
+        return NO_EXPIRY;
+    }
+    
+    int idx = this->current & (WHEEL_SLOTS - 1);
+    if (this->occupied[0] & (1ULL << idx)) {
+        return this->current;
+    }
+    
+    uint64_t next = NO_EXPIRY;
+    if (this->occupied[0]) {
+        next = this->current + nextSlot(this->occupied[0],idx);
+    }
+    // a coarser slot is due for sorting at the start of its span
+    for(int l = 1; l < WHEEL_LEVELS; l++) {
+        if (!this->occupied[l]) {
+            continue;
+        }
+        uint64_t base = this->current >> (WHEEL_BITS * l);
+        uint64_t at = (base + nextSlot(this->occupied[l],base & (WHEEL_SLOTS - 1))) << (WHEEL_BITS * l);
+        next = at < next ? at : next;
+    }
+    return next;
+}
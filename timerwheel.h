@@ -0,0 +1,76 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// What nextExpiry returns when nothing is scheduled.
+static const uint64_t NO_EXPIRY = static_cast<uint64_t>(-1);
+
+// A place in one of a TimerWheel's lists. The lists are circular, each
+// headed by a bare WheelLink in a slot.
+struct WheelLink {
+    WheelLink * prev;
+    WheelLink * next;
+};
+
+// Something a TimerWheel calls back. The links are the wheel's, so that
+// scheduling and cancelling never allocate.
+class WheelTimer : private WheelLink {
+
+    public:
+        WheelTimer();
+        // cancel must come first if it is still pending.
+        virtual ~WheelTimer();
+
+        virtual void expire(uint64_t now) = 0;
+        bool pending() const;
+
+    private:
+        friend class TimerWheel;
+        uint64_t when;
+        uint8_t level;
+        uint8_t slot;
+};
+
+// Timers by the tick, in levels of WHEEL_SLOTS slots each a WHEEL_SLOTS
+// times coarser than the one below, so scheduling and cancelling are O(1)
+// however many timers there are, and the far off ones are only sorted
+// finer as they come near. Ticks are whatever the caller counts in, tunclient
+// uses the protocol's milliseconds.
+class TimerWheel {
+
+    public:
+        explicit TimerWheel(uint64_t now);
+        ~TimerWheel();
+
+        // replaces any earlier schedule of t. A time already past expires on
+        // the next advance.
+        void schedule(WheelTimer & t, uint64_t when);
+        void cancel(WheelTimer & t);
+
+        // Expires everything due by now, in order of level 0 slot.
+        void advance(uint64_t now);
+
+        // When advance next needs calling. It may be early, when the first
+        // timer is still on a coarse level, but never late.
+        uint64_t nextExpiry() const;
+
+        uint32_t size() const;
+
+    private:
+        static const int WHEEL_BITS = 6;
+        static const int WHEEL_SLOTS = 1 << WHEEL_BITS;
+        static const int WHEEL_LEVELS = 6;
+
+        // each slot is the head of a circular list
+        WheelLink slots[WHEEL_LEVELS][WHEEL_SLOTS];
+        // which slots have anything in them
+        uint64_t occupied[WHEEL_LEVELS];
+        uint64_t current;
+        uint32_t count;
+
+        void _insert(WheelTimer & t);
+        void _unlink(WheelTimer & t);
+        void _take(WheelLink & slot, WheelLink & into);
+        void _cascade(int level);
+        void _expireSlot();
+};
@@ -0,0 +1,99 @@
+#include "tty.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+struct SpeedTab {
+    uint32_t baud;
+    unsigned int speed;
+};
+
+static const struct SpeedTab bauds[] = {
+    { 300, B300 },
+    { 600, B600 },
+    { 1200, B1200 },
+    { 1800, B1800 },
+    { 2400, B2400 },
+    { 4800, B4800 },
+    { 9600, B9600 },
+    { 19200, B19200 },
+    { 38400, B38400 },
+    { 57600, B57600 },
+    { 115200, B115200 },
+    { 230400, B230400 },
+    { 460800, B460800 },
+    { 500000, B500000 },
+    { 576000, B576000 },
+    { 921600, B921600 },
+    { 1000000, B1000000 },
+    { 1152000, B1152000 },
+    { 1500000, B1500000 },
+    { 2000000, B2000000 },
+    { 0, 0 }
+};
+
+int ttyOpenRaw(const char * path, uint32_t baud, int vmin, int vtime, struct termios2 * original) {
+    /* non blocking so it doesn't wait for carrier, CLOCAL sees to that after */
+    int fd = open(path,O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        perror("cannot open serial port");
+        return -1;
+    }
+    if (!isatty(fd)) {
+        fprintf(stderr,"%s is not a tty\n",path);
+        close(fd);
+        return -1;
+    }
+
+    struct termios2 t;
+    if (ioctl(fd,TCGETS2,&t) < 0) {
+        perror("can't get tty settings");
+        close(fd);
+        return -1;
+    }
+    *original = t;
+
+    /* what cfmakeraw does, and no software or hardware flow control either:
+       XON and XOFF are just bytes to the protocol, and a three wire link
+       would never see CTS */
+    t.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF | IXANY);
+    t.c_oflag &= ~OPOST;
+    t.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    t.c_cflag &= ~(CSIZE | PARENB | CSTOPB | CRTSCTS);
+    t.c_cflag |= CS8 | CLOCAL | CREAD;
+    t.c_cc[VMIN] = vmin;
+    t.c_cc[VTIME] = vtime;
+
+    /* input at the output rate */
+    t.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    const struct SpeedTab * e = bauds;
+    while (e->baud && e->baud != baud) {
+        e++;
+    }
+    t.c_cflag |= e->baud ? e->speed : BOTHER;
+    t.c_ispeed = baud;
+    t.c_ospeed = baud;
+
+    if (ioctl(fd,TCSETS2,&t) < 0) {
+        perror("can't set new tty settings");
+        close(fd);
+        return -1;
+    }
+
+    /* a driver may round a rate it can't do exactly */
+    if (ioctl(fd,TCGETS2,&t) == 0 && (t.c_cflag & CBAUD) == BOTHER && t.c_ospeed != baud) {
+        fprintf(stderr,"serial port running at %u baud\n",t.c_ospeed);
+    }
+
+    /* nothing left over from whoever had it before */
+    ioctl(fd,TCFLSH,TCIOFLUSH);
+    fcntl(fd,F_SETFL,fcntl(fd,F_GETFL) & ~O_NONBLOCK);
+    return fd;
+}
+
+int ttyRestore(int fd, const struct termios2 * original) {
+    /* TCSETSF2 is TCSAFLUSH */
+    return ioctl(fd,TCSETSF2,original);
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <stdint.h>
+/* termios2, for rates with no B constant. It can't be had alongside
+   <termios.h>, so whatever includes this sets the tty up with the ioctls. */
+#include <asm/termbits.h>
+
+/* Serial port setup shared by serialredir and tunclient's openSerial, in C
+   so that both build from it. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Opens a serial port raw, 8N1, no flow control of either kind, at baud
+   bits a second, with reads waiting for vmin bytes and vtime tenths of a
+   second after the first. The usual rates go in as themselves, any other
+   is asked of the driver as is. The settings it had go in original, for
+   ttyRestore. Returns the fd, blocking and close on exec, or -1, having
+   said why, if the port can't be had. */
+int ttyOpenRaw(const char * path, uint32_t baud, int vmin, int vtime, struct termios2 * original);
+
+/* Puts a port back as it was, once what was written to it has gone. Safe
+   in a signal handler. */
+int ttyRestore(int fd, const struct termios2 * original);
+
+#ifdef __cplusplus
+}
+#endif
@@ -7,43 +7,153 @@
 #include <cstdio>
 #include <signal.h>
 #include <time.h>
+#include <limits.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
 
 #include "protocol.h"
+#include "pipeline.h"
+#include "reactor.h"
+#include "uring.h"
+#include "serial.h"
+#include "timerwheel.h"
 
+// Unsent link bytes past which new data is held back, in the protocol and
+// on the local fds, until they are down to LINK_LOW_WATER.
+static const size_t LINK_HIGH_WATER = 32768;
+static const size_t LINK_LOW_WATER = 8192;
 
+// Chunks handed to one writev.
+static const int WRITE_IOVECS = 16;
+
+
+// How the proxy loop runs: on io_uring or epoll, and whether with link
+// reader and writer threads, and where to pin them and the protocol.
+// pipeSize, if not 0, is the kernel buffer asked for on fds that are pipes.
+struct LoopOptions {
+    int pipeSize;
+    bool uring;
+    bool threads;
+    int readerCpu;
+    int writerCpu;
+    int protocolCpu;
+};
+
+// The protocol options from the command line, kept apart from any Protocol
+// so that each thread of a console server can set up Protocols of its own:
+// a Protocol's packets hold blocks from the pool of the thread that made
+// them, and a copy shares them.
+struct ProtocolSettings {
+    int window;
+    int payload;
+    unsigned int fecGroup;
+    unsigned int fecDepth;
+    int compress;
+    int recvBuffer;
+    int binary;
+    int crc32c;
+    // channels, only offered by a side that forwards or takes them.
+    int channels;
+
+    void apply(Protocol & p) const {
+        if(this->window) {
+            p.setWindowSize(this->window);
+        }
+        if(this->payload) {
+            p.setMaxPayloadSize(this->payload);
+        }
+        if(this->fecGroup) {
+            p.setFec(this->fecGroup,this->fecDepth);
+        }
+        p.setCompression(this->compress);
+        p.setReceiveBuffer(this->recvBuffer);
+        p.setBinaryFraming(this->binary);
+        p.setCrc32c(this->crc32c);
+        p.setChannels(this->channels);
+    }
+};
+
+
+// For a child forked from a process that may have other threads: no
+// stdio or iostreams, whose locks another thread may have held at the fork,
+// and no atexit handlers, which would put the parent's serial ports back.
+static void childFail(const char * what, const char * name) {
+    const char * parts[3] = { what, name, "\n" };
+    for(int i = 0; i < 3; i++) {
+        if (write(STDERR_FILENO,parts[i],strlen(parts[i])) < 0) {
+            break;
+        }
+    }
+    _exit(127);
+}
 
 //more code borrowed from ncat
-void subexec(char * cmdexec[],int * childpid, int * childin,int * childout) {
+// envp, if given, is the child's whole environment. Returns false if the
+// command can't be started, for the caller to give up on just it.
+bool subexec(char * cmdexec[],int * childpid, int * childin,int * childout, char * const * envp = NULL) {
     int child_stdin[2];
     int child_stdout[2];
     int pid;
 
-    if (pipe(child_stdin) == -1 || pipe(child_stdout) == -1) {
+    // close on exec, so that a console server's other sessions don't hold
+    // these open, only the child's own 0 and 1.
+    if (pipe2(child_stdin,O_CLOEXEC) == -1) {
         perror("Can't create child pipes");
-        exit(1);
+        return false;
+    }
+    if (pipe2(child_stdout,O_CLOEXEC) == -1) {
+        perror("Can't create child pipes");
+        close(child_stdin[0]);
+        close(child_stdin[1]);
+        return false;
     }
 
 
     if ( (pid = fork()) < 0) {
 	    perror("fork error");
-	    exit(1);
+        close(child_stdin[0]);
+        close(child_stdin[1]);
+        close(child_stdout[0]);
+        close(child_stdout[1]);
+	    return false;
     } else if ( pid == 0 ) {
         close(child_stdin[1]);
         close(child_stdout[0]);
 
-        if(dup2(child_stdin[0], STDIN_FILENO) < 0) {
-            perror("dup2 failed");
-            exit(1);
+        if(dup2(child_stdin[0], STDIN_FILENO) < 0 || dup2(child_stdout[1], STDOUT_FILENO) < 0) {
+            childFail("dup2 failed for ",cmdexec[0]);
         }
         
-        if(dup2(child_stdout[1], STDOUT_FILENO) < 0) {
-            perror("dup2 failed");
-            exit(1);
+        // a copy made by dup2 is open across exec, but a pipe end that was
+        // 0 or 1 already wasn't copied.
+        if (child_stdin[0] == STDIN_FILENO) {
+            fcntl(STDIN_FILENO,F_SETFD,0);
+        }
+        if (child_stdout[1] == STDOUT_FILENO) {
+            fcntl(STDOUT_FILENO,F_SETFD,0);
         }
         
-        execvp(cmdexec[0],cmdexec);
-        std::cerr << "error starting command " << cmdexec[0] << std::endl;
-        exit(1);
+        // a console server has its signals blocked, for signalfd
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK,&none,NULL);
+        
+        if (envp) {
+            execvpe(cmdexec[0],cmdexec,envp);
+        } else {
+            execvp(cmdexec[0],cmdexec);
+        }
+        childFail("error starting command ",cmdexec[0]);
         
 	    /* do child stuff */
     } else {
@@ -52,184 +162,912 @@ void subexec(char * cmdexec[],int * childpid, int * childin,int * childout) {
 	    /* do parent stuff */
 	    *childin = child_stdin[1];
 	    *childout = child_stdout[0];
+	    *childpid = pid;
+    }
+    return true;
+}
+
+// A local socket whose connections are each carried over a new channel to
+// target at the far end.
+struct Forward {
+    int listenfd;
+    std::string target;
+    uint32_t weight;
+};
+
+// An fd on the loop, remembering what it was last reported ready for until
+// a read or write on it comes back with EAGAIN. Errors and hangups count as
+// ready, and turn up when the read or write fails.
+struct Endpoint : public IoHandler {
+    int fd;
+    bool readable;
+    bool writable;
+    
+    Endpoint() : fd(-1) , readable(false) , writable(false) {
+    }
+    
+    void ioEvent(uint32_t events) {
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            this->readable = true;
+        }
+        if (events & (EPOLLOUT | EPOLLERR)) {
+            this->writable = true;
+        }
     }
+};
+
+static bool wouldBlock(ssize_t r) {
+    return r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
 }
 
-static int max(int a, int b) {
-    if (a > b) {
-        return a;
+// A read on an endpoint if it may be ready, as read would return, or -1
+// with EAGAIN if it is known not to be.
+static ssize_t readSome(Endpoint & e, uint8_t * buff, size_t n) {
+    if (!e.readable) {
+        errno = EAGAIN;
+        return -1;
     }
-    return b;
+    ssize_t r = read(e.fd,buff,n);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        e.readable = false;
+    }
+    return r;
 }
 
-uint64_t getNow() {
-    struct timespec ts;
+// Writes as much of q as the fd takes, and pops it.
+static ssize_t writeQueue(Endpoint & e, ChunkQueue & q) {
+    if (!e.writable) {
+        errno = EAGAIN;
+        return -1;
+    }
+    struct iovec iov[WRITE_IOVECS];
+    ssize_t r = writev(e.fd,iov,q.iovecs(iov,WRITE_IOVECS));
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        e.writable = false;
+    }
+    if (r > 0) {
+        q.pop(r);
+    }
+    return r;
+}
+
+// A local connection carried over a channel. io.fd is -1 once it has failed.
+struct ChannelConn {
+    Endpoint io;
+    ChunkQueue out;
+    bool reading;
+    bool peerClosed;
+    bool shutDown;
+};
+
+// Everything on the loop is edge triggered, so must be non blocking.
+static int nonBlocking(int fd) {
+    if (fd >= 0) {
+        fcntl(fd,F_SETFL,fcntl(fd,F_GETFL) | O_NONBLOCK);
+    }
+    return fd;
+}
+
+static bool isPort(const std::string & s) {
+    return !s.empty() && s.find_first_not_of("0123456789") == std::string::npos;
+}
+
+// LOCAL is a TCP port on the loopback interface or a unix socket path.
+int listenLocal(const std::string & local) {
+    int fd;
     
-    if(clock_gettime(CLOCK_REALTIME,&ts)) {
-        std::cerr << "error failed to get system time\n.";
-        exit(1);
+    if (isPort(local)) {
+        struct sockaddr_in addr;
+        int one = 1;
+        memset(&addr,0,sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(atoi(local.c_str()));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET,SOCK_STREAM,0);
+        if (fd < 0) {
+            return -1;
+        }
+        setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+        if (bind(fd,(struct sockaddr *)&addr,sizeof(addr)) < 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct sockaddr_un addr;
+        if (local.size() >= sizeof(addr.sun_path)) {
+            return -1;
+        }
+        memset(&addr,0,sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path,local.c_str());
+        unlink(local.c_str());
+        fd = socket(AF_UNIX,SOCK_STREAM,0);
+        if (fd < 0) {
+            return -1;
+        }
+        if (bind(fd,(struct sockaddr *)&addr,sizeof(addr)) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    
+    if (::listen(fd,16) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// target is host:port or a unix socket path.
+int connectTarget(const std::string & target) {
+    size_t colon = target.rfind(':');
+    
+    if (colon != std::string::npos && isPort(target.substr(colon + 1))) {
+        struct addrinfo hints;
+        struct addrinfo * res;
+        memset(&hints,0,sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(target.substr(0,colon).c_str(),target.substr(colon + 1).c_str(),&hints,&res)) {
+            return -1;
+        }
+        int fd = -1;
+        for(struct addrinfo * ai = res; ai ; ai = ai->ai_next) {
+            fd = socket(ai->ai_family,ai->ai_socktype | SOCK_CLOEXEC,ai->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+            if (connect(fd,ai->ai_addr,ai->ai_addrlen) == 0) {
+                break;
+            }
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+        return fd;
     }
     
-    return (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+    struct sockaddr_un addr;
+    if (target.size() >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path,target.c_str());
+    int fd = socket(AF_UNIX,SOCK_STREAM | SOCK_CLOEXEC,0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd,(struct sockaddr *)&addr,sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
+// LOCAL=REMOTE[@weight]
+bool parseForward(const std::string & spec, Forward & f) {
+    size_t eq = spec.find('=');
+    if (eq == std::string::npos || eq == 0 || eq + 1 == spec.size()) {
+        return false;
+    }
+    f.target = spec.substr(eq + 1);
+    f.weight = 1;
+    size_t at = f.target.rfind('@');
+    if (at != std::string::npos) {
+        f.weight = atoi(f.target.substr(at + 1).c_str());
+        f.target = f.target.substr(0,at);
+        if (f.weight < 1 || f.weight > 255 || f.target.empty()) {
+            return false;
+        }
+    }
+    f.listenfd = listenLocal(spec.substr(0,eq));
+    if (f.listenfd < 0) {
+        perror(("Can't listen on " + spec.substr(0,eq)).c_str());
+        exit(1);
+    }
+    return true;
+}
 
-void proxy_forever(Protocol & p, std::vector<uint8_t> & initialProtoData ,int protoin,int protoout,int datain, int dataout) {
+// the protocol's clock, in ms, on a clock that setting the date can't move
+// so a jump in wall time can't set off timeouts.
+uint64_t getNow() {
+    return monotonicMicros() / 1000;
+}
+
+
+// The protocol between the link and the local data fds and channel sockets,
+// driven by a Reactor. Handlers only note what became ready, and afterEvents
+// does one round of work over everything that is, as the select loop used
+// to, and sets the reactor's deadline to the protocol's next timer event.
+class Proxy : public LoopHandler {
+
+    public:
+        Proxy(Protocol & p, std::vector<uint8_t> & initialProtoData, int protoin, int protoout,
+              int datain, int dataout, std::vector<Forward> & forwards,
+              const std::vector<std::string> & allowed, const LoopOptions & options);
+        ~Proxy();
+
+        void run();
+        void signal(int signo);
+        bool afterEvents();
+
+    private:
+        Protocol & p;
+        Reactor reactor;
+        LinkPipeline * pipeline;
+        std::vector<Forward> & forwards;
+        // the targets the peer may open channels to, from -R.
+        const std::vector<std::string> & allowed;
+        std::vector<Endpoint> listeners;
+        std::map<uint8_t,ChannelConn> conns;
+        Endpoint linkIn;
+        Endpoint linkOut;
+        Endpoint dataIn;
+        Endpoint dataOut;
+        // bytes for the link and for the local data fd.
+        ChunkQueue link;
+        ChunkQueue local;
+        // The protocol cuts data into frames sized for the link, so reads
+        // can be as large as is convenient.
+        uint8_t buff[4096];
+
+        bool _watch(Endpoint & e, int fd, uint32_t events);
+        bool _service(uint64_t now);
+        void _serviceChannels(uint64_t now);
+        bool _busy();
+};
+
+// Sets up the loop, or exits.
+Proxy::Proxy(Protocol & p, std::vector<uint8_t> & initialProtoData, int protoin, int protoout,
+             int datain, int dataout, std::vector<Forward> & forwards,
+             const std::vector<std::string> & allowed, const LoopOptions & options)
+    : p(p) , reactor(*this) , pipeline(NULL) , forwards(forwards) , allowed(allowed) , listeners(forwards.size()) ,
+      // the protocol writes straight into our queues. Once the link has
+      // LINK_HIGH_WATER bytes it hasn't taken yet, new data waits in the
+      // protocol and the local fds rather than piling up here.
+      link(LINK_HIGH_WATER,LINK_LOW_WATER) {
     
-    int maxfd = datain;
+    this->link.write(initialProtoData.empty() ? NULL : &initialProtoData[0],initialProtoData.size());
     
-    maxfd = max(datain,maxfd);
-    maxfd = max(dataout,maxfd);
-    maxfd = max(protoout,maxfd);
-    maxfd = max(protoin,maxfd);
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals,SIGINT);
+    sigaddset(&signals,SIGTERM);
+    sigaddset(&signals,SIGHUP);
     
-    int64_t now = getNow();
+    // signals first, so the link threads start with them blocked.
+    bool ok = this->reactor.ok() && this->reactor.catchSignals(signals);
     
-    std::vector<uint8_t> out;
-    std::vector<uint8_t> bufferedProtocolData;
-    std::vector<uint8_t> bufferedData;
+    // with threads the link fds belong to them, and we only see the rings
+    // and their wakeups, which never block.
+    if (ok && options.threads) {
+        this->pipeline = new LinkPipeline(protoin,protoout);
+        if (!this->pipeline->start(options.readerCpu,options.writerCpu)
+            || !pinThread(pthread_self(),options.protocolCpu)) {
+            std::cerr << "Can't start or pin link threads." << std::endl;
+            exit(1);
+        }
+        ok = _watch(this->linkIn,this->pipeline->fromLink.dataFd(),EPOLLIN)
+             && _watch(this->linkOut,this->pipeline->toLink.roomFd(),EPOLLIN);
+    } else if (ok) {
+        ok = _watch(this->linkIn,nonBlocking(protoin),EPOLLIN)
+             && _watch(this->linkOut,nonBlocking(protoout),EPOLLOUT);
+    }
     
-    bufferedProtocolData = initialProtoData;
+    ok = ok && _watch(this->dataIn,nonBlocking(datain),EPOLLIN)
+            && _watch(this->dataOut,nonBlocking(dataout),EPOLLOUT);
     
-    uint8_t  buff[256];
+    for(size_t i = 0; ok && i < forwards.size(); i++) {
+        ok = _watch(this->listeners[i],nonBlocking(forwards[i].listenfd),EPOLLIN);
+    }
+    
+    if (!ok) {
+        perror("Can't set up event loop");
+        exit(1);
+    }
+}
+
+Proxy::~Proxy() {
+    if (this->pipeline) {
+        this->pipeline->stop();
+        delete this->pipeline;
+    }
+}
+
+// Regular files can't be watched, but never block either, so they are
+// simply always ready.
+static bool watch(Reactor & reactor, Endpoint & e, int fd, uint32_t events) {
+    e.fd = fd;
+    if (reactor.add(fd,&e,events)) {
+        return true;
+    }
+    if (errno == EPERM) {
+        e.readable = true;
+        e.writable = true;
+        return true;
+    }
+    return false;
+}
+
+bool Proxy::_watch(Endpoint & e, int fd, uint32_t events) {
+    return watch(this->reactor,e,fd,events);
+}
+
+void Proxy::run() {
+    this->reactor.run();
+}
+
+void Proxy::signal(int signo) {
+    std::cerr << "Closing on signal " << signo << std::endl;
+    this->reactor.stop();
+}
+
+bool Proxy::afterEvents() {
+    uint64_t now = getNow();
     
+    if (!_service(now)) {
+        this->reactor.stop();
+        return false;
+    }
     
-    for (;;) {
-        fd_set readfds;
-        fd_set writefds;
-        fd_set errfds;
-        
-        int r, n_r,n_w;
-        now = getNow();
-        if (p.getState() == STATE_UNINIT) {
-            std::cerr << "Connection terminated." << std::endl;
-            break;
-        }
+    uint64_t next = this->p.nextTimerEvent(now);
+    this->reactor.setDeadline(next == NO_TIMER_EVENT ? NO_DEADLINE : next * 1000);
+    return _busy();
+}
 
-        FD_ZERO(&readfds);
-        FD_ZERO(&writefds);
-        FD_ZERO(&errfds);
-        
-        int doDataIn = p.readyForData();
-        int doBufferedOut = bufferedData.size() > 0;
-        int doBufferedProtoOut = bufferedProtocolData.size() > 0;
-        
-        FD_SET(protoin, &readfds);
-        
-        if(doDataIn) {
-            FD_SET(datain, &readfds);
+// One round of work, returning false when the connection is over.
+bool Proxy::_service(uint64_t now) {
+    
+    ssize_t n_r, n_w;
+    
+    if (this->p.readyForData() && !this->link.full()) {
+        n_r = readSome(this->dataIn,this->buff,sizeof(this->buff));
+        if (!wouldBlock(n_r)) {
+            if (n_r <= 0) {
+                return false;
+            }
+            this->p.sendData(0,this->buff,n_r,now,this->link);
         }
-        
-        if(doBufferedProtoOut) {
-            FD_SET(protoout,&writefds);
+    }
+    
+    if (this->pipeline) {
+        this->pipeline->fromLink.clearData();
+        size_t avail;
+        const uint8_t * in = this->pipeline->fromLink.readable(avail);
+        if (avail) {
+            this->p.dataEvent(in,avail,now,true,this->link,this->local);
+            this->pipeline->fromLink.consume(avail);
+        } else if (this->pipeline->fromLink.closed() && this->pipeline->fromLink.size() == 0) {
+            return false;
         }
-        
-        if(doBufferedOut) {
-            FD_SET(dataout,&writefds);
+    } else {
+        n_r = readSome(this->linkIn,this->buff,sizeof(this->buff));
+        if (!wouldBlock(n_r)) {
+            if (n_r <= 0) {
+                return false;
+            }
+            this->p.dataEvent(this->buff,n_r,now,true,this->link,this->local);
         }
-        
-        FD_SET(datain,&errfds);
-        FD_SET(dataout,&errfds);
-        FD_SET(protoin,&errfds);
-        FD_SET(protoout,&errfds);
-        
-        struct timeval tv;
-        
-        tv.tv_sec  = 0;
-        tv.tv_usec = 1000; 
-        
-        r = select(maxfd + 1, &readfds, &writefds, &errfds, &tv);
-        if (r == -1) {
-            break;
+    }
+    
+    if (!this->local.empty()) {
+        n_w = writeQueue(this->dataOut,this->local);
+        if (!wouldBlock(n_w)) {
+            if (n_w <= 0) {
+                return false;
+            }
+            this->p.dataConsumed(n_w);
         }
-        
-        
-        if(doDataIn) {
-            if (FD_ISSET(datain, &readfds)) {
-                
-                if(!p.readyForData()) {
-                    std::cerr << "BUG: bad assertion. not ready for data." << std::endl;
-                    exit(1);
-                }
-                n_r = read(datain, buff, sizeof(buff));
-                if (n_r <= 0) {
+    }
+    
+    if (!this->link.empty()) {
+        if (this->pipeline) {
+            this->pipeline->toLink.clearRoom();
+            if (this->pipeline->toLink.closed()) {
+                return false;
+            }
+            struct iovec iov[WRITE_IOVECS];
+            int n = this->link.iovecs(iov,WRITE_IOVECS);
+            size_t moved = 0;
+            for(int i = 0; i < n; i++) {
+                size_t w = this->pipeline->toLink.write((const uint8_t *)iov[i].iov_base,iov[i].iov_len);
+                moved += w;
+                if (w < iov[i].iov_len) {
                     break;
                 }
-                
-                out = p.sendData(std::vector<uint8_t>(buff,buff+n_r),now);
-                bufferedProtocolData.insert(bufferedProtocolData.end(),out.begin(),out.end());
+            }
+            this->link.pop(moved);
+        } else {
+            n_w = writeQueue(this->linkOut,this->link);
+            if (!wouldBlock(n_w) && n_w <= 0) {
+                return false;
             }
         }
-        
-        if (FD_ISSET(protoin, &readfds)) {
-            n_r = read(protoin, buff, sizeof(buff));
-            if (n_r <= 0) {
+    }
+    
+    _serviceChannels(now);
+    
+    this->p.timerEvent(now,this->link);
+    // checked last, as once the keepalive runs out there is no timer left
+    // to come back for it.
+    if (this->p.getState() == STATE_UNINIT) {
+        std::cerr << "Connection terminated." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void Proxy::_serviceChannels(uint64_t now) {
+    
+    ssize_t n_r, n_w;
+    Protocol & p = this->p;
+    
+    for(size_t i = 0; i < this->listeners.size(); i++) {
+        Endpoint & l = this->listeners[i];
+        while (l.readable) {
+            int fd = nonBlocking(accept(l.fd,NULL,NULL));
+            if (fd < 0) {
+                // EAGAIN, or nothing we can do about it until a new
+                // connection comes along.
+                l.readable = false;
                 break;
             }
-            
-            out = std::vector<uint8_t>(buff,buff+n_r);
-            
-            std::pair<std::vector<uint8_t>,std::vector<uint8_t> > eventRet;
-            
-            eventRet = p.dataEvent(out,now,true);
-            
-            bufferedProtocolData.insert(bufferedProtocolData.end(),eventRet.first.begin(),eventRet.first.end());
-            
-            if(eventRet.second.size()) {
-                bufferedData.insert(bufferedData.end(),eventRet.second.begin(),eventRet.second.end());
+            int ch = p.openChannel(this->forwards[i].target,this->forwards[i].weight);
+            if (ch < 0) {
+                std::cerr << "No channel for " << this->forwards[i].target << ": none free, or the peer takes none." << std::endl;
+                close(fd);
+                continue;
+            }
+            ChannelConn & c = this->conns[ch];
+            c.io = Endpoint();
+            c.reading = true;
+            c.peerClosed = false;
+            c.shutDown = false;
+            if (!_watch(c.io,fd,EPOLLIN | EPOLLOUT)) {
+                close(fd);
+                c.io.fd = -1;
+                c.reading = false;
+                p.closeChannel(ch);
             }
         }
+    }
     
-        if(doBufferedOut) {
-            if (FD_ISSET(dataout, &writefds)) {
-                if(!bufferedData.size()) {
-                        std::cerr << "BUG: bad assertion. not for sending buffered data." << std::endl;
-                        exit(1);
-                }
-                
-                n_w = write(dataout,&bufferedData.front(),bufferedData.size());
-                
-                if(n_w <= 0) {
-                    break;
-                }
-                //inefficient due to vector realloc but w.e. , our cpu is faster than data link
-                bufferedData.erase(bufferedData.begin(),bufferedData.begin()+n_w);
-                
+    for(std::map<uint8_t,ChannelConn>::iterator it = this->conns.begin(); it != this->conns.end() ; it++) {
+        ChannelConn & c = it->second;
+        if (c.io.fd < 0) {
+            continue;
+        }
+        if (c.reading && p.readyForData(it->first) && !this->link.full()) {
+            n_r = readSome(c.io,this->buff,sizeof(this->buff));
+            if (wouldBlock(n_r)) {
+                // nothing after all
+            } else if (n_r <= 0) {
+                c.reading = false;
+                p.closeChannel(it->first);
+            } else {
+                p.sendData(it->first,this->buff,n_r,now,this->link);
             }
         }
+        if (!c.out.empty()) {
+            n_w = writeQueue(c.io,c.out);
+            if (wouldBlock(n_w)) {
+                continue;
+            }
+            if (n_w <= 0) {
+                close(c.io.fd);
+                c.io = Endpoint();
+                p.dataConsumed(c.out.size(),it->first);
+                c.out.clear();
+                c.reading = false;
+                p.closeChannel(it->first);
+            } else {
+                p.dataConsumed(n_w,it->first);
+            }
+        }
+    }
+    
+    std::vector<ChannelEvent> events = p.takeChannelEvents();
+    
+    for(std::vector<ChannelEvent>::iterator it = events.begin(); it != events.end() ; it++) {
+        if (it->type == CHANNEL_OPENED) {
+            ChannelConn & c = this->conns[it->channel];
+            // only to what -R allows, or the peer could reach anything we can
+            bool permitted = std::find(this->allowed.begin(),this->allowed.end(),it->target) != this->allowed.end();
+            int fd = permitted ? nonBlocking(connectTarget(it->target)) : -1;
+            c.io = Endpoint();
+            c.reading = fd >= 0;
+            c.peerClosed = false;
+            c.shutDown = false;
+            if (fd >= 0 && !_watch(c.io,fd,EPOLLIN | EPOLLOUT)) {
+                close(fd);
+                fd = -1;
+                c.reading = false;
+            }
+            if (!permitted) {
+                std::cerr << "Refusing channel to " << it->target << ", not allowed with -R." << std::endl;
+                p.closeChannel(it->channel);
+            } else if (fd < 0) {
+                std::cerr << "Can't connect channel to " << it->target << std::endl;
+                p.closeChannel(it->channel);
+            }
+        } else if (this->conns.count(it->channel)) {
+            this->conns[it->channel].peerClosed = true;
+        }
+    }
+    
+    // the local end sees EOF once everything the peer sent before its
+    // CLOSE has been written, and is closed when both sides are done.
+    std::map<uint8_t,ChannelConn>::iterator cit = this->conns.begin();
+    while (cit != this->conns.end()) {
+        ChannelConn & c = cit->second;
+        std::vector<uint8_t> data = p.takeChannelData(cit->first);
+        if (c.io.fd >= 0) {
+            c.out.write(data.empty() ? NULL : &data[0],data.size());
+        } else {
+            p.dataConsumed(data.size(),cit->first);
+        }
+        if (c.peerClosed && c.out.empty() && c.io.fd >= 0 && !c.shutDown) {
+            shutdown(c.io.fd,SHUT_WR);
+            c.shutDown = true;
+        }
+        if (c.peerClosed && !c.reading && c.out.empty()) {
+            if (c.io.fd >= 0) {
+                close(c.io.fd);
+            }
+            this->conns.erase(cit++);
+        } else {
+            cit++;
+        }
+    }
+}
+
+// Whether anything is ready that the last round left undone, as each fd only
+// gets one read and one write a round.
+bool Proxy::_busy() {
+    
+    bool busy = (this->dataIn.readable && this->p.readyForData() && !this->link.full())
+                || (this->dataOut.writable && !this->local.empty());
+    
+    if (this->pipeline) {
+        busy = this->pipeline->fromLink.armData() || busy;
+        if (!this->link.empty()) {
+            busy = this->pipeline->toLink.armRoom() || busy;
+        }
+    } else {
+        busy = busy || this->linkIn.readable
+               || (this->linkOut.writable && !this->link.empty());
+    }
+    
+    for(size_t i = 0; i < this->listeners.size(); i++) {
+        busy = busy || this->listeners[i].readable;
+    }
+    
+    for(std::map<uint8_t,ChannelConn>::iterator it = this->conns.begin(); it != this->conns.end() ; it++) {
+        ChannelConn & c = it->second;
+        busy = busy || (c.io.fd >= 0 && c.reading && c.io.readable && this->p.readyForData(it->first) && !this->link.full())
+               || (c.io.fd >= 0 && c.io.writable && !c.out.empty());
+    }
+    return busy;
+}
+
+// Read buffers for each of the io_uring backend's inputs, and the size of
+// the fixed buffer each of its outputs is written from.
+static const uint16_t URING_READ_BUFFERS = 16;
+static const uint32_t URING_READ_SIZE = 4096;
+static const uint32_t URING_WRITE_SIZE = 65536;
+
+enum UringTag {
+    TAG_LINK_IN = 1,
+    TAG_DATA_IN,
+    TAG_LINK_OUT,
+    TAG_DATA_OUT,
+    TAG_SIGNAL
+};
+
+// The work Proxy does for the link and the local data fds, on io_uring.
+// Reads are multishot into buffer groups, so input keeps arriving with no
+// system call per read, and writes go out of registered buffers, one at a
+// time per fd. Each round of the loop is a single enter, which submits what
+// the round queued and waits for the next completion or timer deadline.
+// Channels and link threads are left to Proxy.
+class UringProxy {
+
+    public:
+        UringProxy(Protocol & p, std::vector<uint8_t> & initialProtoData, int protoin, int protoout,
+                   int datain, int dataout);
+
+        // whether the kernel can do all of it, if not the caller uses Proxy.
+        bool ok() const;
+        void run();
+
+    private:
+        // an input read into a buffer group. multishot is cleared for an
+        // fd that can't be polled, which then gets one read at a time.
+        struct Input {
+            int fd;
+            uint16_t group;
+            UringTag tag;
+            bool armed;
+            bool multishot;
+            uint8_t buffers[URING_READ_BUFFERS * URING_READ_SIZE];
+        };
+
+        // an output and the fixed buffer it is written from, with the
+        // bytes of the write in flight, if any.
+        struct Output {
+            int fd;
+            uint16_t index;
+            UringTag tag;
+            size_t inFlight;
+            uint8_t buffer[URING_WRITE_SIZE];
+        };
+
+        Protocol & p;
+        Uring ring;
+        bool ready;
+        int signalFd;
+        struct signalfd_siginfo signalInfo;
+        Input linkIn;
+        Input dataIn;
+        Output linkOut;
+        Output dataOut;
+        ChunkQueue link;
+        ChunkQueue local;
+        // application data read while the protocol couldn't take it, as
+        // buffer ids and lengths. Holding on to them is what stops the
+        // reads when the peer is slow.
+        std::deque<std::pair<uint16_t,uint32_t> > heldData;
+
+        void _arm(Input & in);
+        void _write(Output & out, const ChunkQueue & queue);
+        bool _complete(const struct io_uring_cqe & cqe, uint64_t now);
+};
+
+UringProxy::UringProxy(Protocol & p, std::vector<uint8_t> & initialProtoData, int protoin, int protoout,
+                       int datain, int dataout)
+    : p(p) , ring(64) , ready(false) , signalFd(-1) , link(LINK_HIGH_WATER,LINK_LOW_WATER) {
+    
+    this->link.write(initialProtoData.empty() ? NULL : &initialProtoData[0],initialProtoData.size());
+    
+    Input * ins[2] = { &this->linkIn, &this->dataIn };
+    int inFds[2] = { protoin, datain };
+    Output * outs[2] = { &this->linkOut, &this->dataOut };
+    int outFds[2] = { protoout, dataout };
+    for(uint16_t i = 0; i < 2; i++) {
+        ins[i]->fd = inFds[i];
+        ins[i]->group = i;
+        ins[i]->tag = i ? TAG_DATA_IN : TAG_LINK_IN;
+        ins[i]->armed = false;
+        ins[i]->multishot = true;
+        outs[i]->fd = outFds[i];
+        outs[i]->index = i;
+        outs[i]->tag = i ? TAG_DATA_OUT : TAG_LINK_OUT;
+        outs[i]->inFlight = 0;
+    }
+    
+    if (!this->ring.ok() || !this->ring.supports(URING_OP_READ_MULTISHOT) || !this->ring.supports(IORING_OP_WRITE_FIXED)) {
+        return;
+    }
+    
+    struct iovec iov[2] = { { this->linkOut.buffer, URING_WRITE_SIZE }, { this->dataOut.buffer, URING_WRITE_SIZE } };
+    if (!this->ring.registerBuffers(iov,2)
+        || !this->ring.addBufferGroup(0,this->linkIn.buffers,URING_READ_SIZE,URING_READ_BUFFERS)
+        || !this->ring.addBufferGroup(1,this->dataIn.buffers,URING_READ_SIZE,URING_READ_BUFFERS)) {
+        return;
+    }
+    
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals,SIGINT);
+    sigaddset(&signals,SIGTERM);
+    sigaddset(&signals,SIGHUP);
+    if (pthread_sigmask(SIG_BLOCK,&signals,NULL) || (this->signalFd = signalfd(-1,&signals,SFD_CLOEXEC)) < 0) {
+        return;
+    }
+    
+    this->ready = true;
+}
+
+bool UringProxy::ok() const {
+    return this->ready;
+}
+
+void UringProxy::_arm(Input & in) {
+    struct io_uring_sqe * sqe = this->ring.prepare(in.multishot ? URING_OP_READ_MULTISHOT : IORING_OP_READ,in.fd,in.tag);
+    if (!sqe) {
+        return;
+    }
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = in.group;
+    sqe->off = -1;
+    sqe->len = in.multishot ? 0 : URING_READ_SIZE;
+    in.armed = true;
+}
+
+// Copies as much as fits into the fixed buffer, and sends it, unless the
+// last write is still going.
+void UringProxy::_write(Output & out, const ChunkQueue & queue) {
+    if (out.inFlight || queue.empty()) {
+        return;
+    }
+    struct io_uring_sqe * sqe = this->ring.prepare(IORING_OP_WRITE_FIXED,out.fd,out.tag);
+    if (!sqe) {
+        return;
+    }
+    size_t n = queue.copyOut(out.buffer,URING_WRITE_SIZE);
+    sqe->addr = (uintptr_t)out.buffer;
+    sqe->len = n;
+    sqe->off = -1;
+    sqe->buf_index = out.index;
+    out.inFlight = n;
+}
+
+// Handles one completion, returning false when the connection is over.
+bool UringProxy::_complete(const struct io_uring_cqe & cqe, uint64_t now) {
+    
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    
+    switch (cqe.user_data) {
+    case TAG_LINK_IN:
+    case TAG_DATA_IN: {
+        Input & in = cqe.user_data == TAG_LINK_IN ? this->linkIn : this->dataIn;
+        in.armed = more;
+        if (cqe.res == -EBADFD && in.multishot) {
+            // not pollable, a regular file say.
+            in.multishot = false;
+            return true;
+        }
+        if (cqe.res == -ENOBUFS || cqe.res == -EINTR || cqe.res == -EAGAIN) {
+            return true;
+        }
+        if (cqe.res <= 0) {
+            return false;
+        }
+        uint16_t id = uringBufferId(&cqe);
+        if (&in == &this->dataIn) {
+            this->heldData.push_back(std::make_pair(id,(uint32_t)cqe.res));
+        } else {
+            this->p.dataEvent(in.buffers + id * URING_READ_SIZE,cqe.res,now,true,this->link,this->local);
+            this->ring.provide(in.group,id);
+        }
+        return true;
+    }
+    case TAG_LINK_OUT:
+    case TAG_DATA_OUT: {
+        Output & out = cqe.user_data == TAG_LINK_OUT ? this->linkOut : this->dataOut;
+        ChunkQueue & queue = &out == &this->linkOut ? this->link : this->local;
+        out.inFlight = 0;
+        if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+            return true;
+        }
+        if (cqe.res <= 0) {
+            return false;
+        }
+        queue.pop(cqe.res);
+        if (&out == &this->dataOut) {
+            this->p.dataConsumed(cqe.res);
+        }
+        return true;
+    }
+    case TAG_SIGNAL:
+        std::cerr << "Closing on signal " << this->signalInfo.ssi_signo << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void UringProxy::run() {
+    
+    struct io_uring_sqe * sqe = this->ring.prepare(IORING_OP_READ,this->signalFd,TAG_SIGNAL);
+    sqe->addr = (uintptr_t)&this->signalInfo;
+    sqe->len = sizeof(this->signalInfo);
+    
+    for (;;) {
+        uint64_t nowMicros = monotonicMicros();
+        uint64_t now = nowMicros / 1000;
         
-        if(doBufferedProtoOut) {
-            if (FD_ISSET(protoout, &writefds)) {
-                if(!bufferedProtocolData.size()) {
-                    std::cerr << "BUG: bad assertion. not for sending protocol buffered data." << std::endl;
-                    exit(1);
-                }
-                
-                n_w = write(protoout,&bufferedProtocolData.front(),bufferedProtocolData.size());
-                
-                if(n_w <= 0) {
-                    break;
-                }
-                
-                //inefficient due to vector realloc but w.e. , our cpu is faster than data link
-                bufferedProtocolData.erase(bufferedProtocolData.begin(),bufferedProtocolData.begin()+n_w);
+        struct io_uring_cqe * cqe;
+        while ((cqe = this->ring.completion())) {
+            bool go = _complete(*cqe,now);
+            this->ring.seen();
+            if (!go) {
+                return;
             }
         }
         
-        if( FD_ISSET(datain,&errfds)
-            || FD_ISSET(dataout,&errfds)
-            || FD_ISSET(protoin,&errfds)
-            || FD_ISSET(protoout,&errfds) ) {
-            std::cerr << "Closing - fd error\n";
-            break;
+        if (this->p.getState() == STATE_UNINIT) {
+            std::cerr << "Connection terminated." << std::endl;
+            return;
+        }
+        
+        while (!this->heldData.empty() && this->p.readyForData() && !this->link.full()) {
+            std::pair<uint16_t,uint32_t> held = this->heldData.front();
+            this->heldData.pop_front();
+            this->p.sendData(0,this->dataIn.buffers + held.first * URING_READ_SIZE,held.second,now,this->link);
+            this->ring.provide(this->dataIn.group,held.first);
+        }
+        
+        if (!this->linkIn.armed) {
+            _arm(this->linkIn);
+        }
+        if (!this->dataIn.armed && this->heldData.size() < URING_READ_BUFFERS) {
+            _arm(this->dataIn);
+        }
+        
+        this->p.timerEvent(now,this->link);
+        if (this->p.getState() == STATE_UNINIT) {
+            // said and done at the top
+            continue;
         }
         
-        out = p.timerEvent(now);
-        bufferedProtocolData.insert(bufferedProtocolData.end(),out.begin(),out.end());
+        _write(this->linkOut,this->link);
+        _write(this->dataOut,this->local);
+        
+        uint64_t next = this->p.nextTimerEvent(now);
+        uint64_t wait = static_cast<uint64_t>(-1);
+        if (next != NO_TIMER_EVENT) {
+            wait = next * 1000 > nowMicros ? next * 1000 - nowMicros : 1;
+        }
+        if (!this->ring.enter(wait)) {
+            perror("io_uring_enter");
+            return;
+        }
     }
+}
+
+// A bigger pipe buffer means fewer, larger reads and writes, and more
+// slack for a consumer that stalls. fds that aren't pipes are left alone.
+static void setPipeSize(int fd, int bytes) {
+    if (fcntl(fd,F_SETPIPE_SZ,bytes) < 0 && errno != EBADF) {
+        perror("Can't set pipe size");
+    }
+}
+
+void proxy_forever(Protocol & p, std::vector<uint8_t> & initialProtoData ,int protoin,int protoout,int datain, int dataout,
+                   std::vector<Forward> & forwards, const std::vector<std::string> & allowed,
+                   const LoopOptions & options) {
+    
+    int fds[4] = { protoin, protoout, datain, dataout };
+    for(int i = 0; options.pipeSize && i < 4; i++) {
+        setPipeSize(fds[i],options.pipeSize);
+    }
+    
+    UringProxy * uring = NULL;
+    if (options.uring && (!forwards.empty() || !allowed.empty() || options.threads)) {
+        std::cerr << "io_uring doesn't do channels or link threads, using epoll." << std::endl;
+    } else if (options.uring) {
+        uring = new UringProxy(p,initialProtoData,protoin,protoout,datain,dataout);
+        if (!uring->ok()) {
+            std::cerr << "io_uring not available, using epoll." << std::endl;
+            delete uring;
+            uring = NULL;
+        }
+    }
+    
+    if (uring) {
+        uring->run();
+        delete uring;
+    } else {
+        Proxy * proxy = new Proxy(p,initialProtoData,protoin,protoout,datain,dataout,forwards,allowed,options);
+        proxy->run();
+        // lets the link writer finish.
+        delete proxy;
+    }
+    
     std::cerr << "closing connection\n";
+    
+    if (p.getCompression()) {
+        const CompressionStats & c = p.getCompressStats();
+        const CompressionStats & d = p.getDecompressStats();
+        std::cerr << "compressed " << c.plainBytes << " -> " << c.codedBytes << " bytes, "
+                  << (c.plainBytes ? c.nanos / c.plainBytes : 0) << " ns/byte\n";
+        std::cerr << "decompressed " << d.codedBytes << " -> " << d.plainBytes << " bytes, "
+                  << (d.plainBytes ? d.nanos / d.plainBytes : 0) << " ns/byte\n";
+    }
     close(protoout);
-    close(protoin);
+    // puts a serial port back as it was
+    closeSerial(protoin);
     
     close(datain);
     close(dataout);
@@ -238,17 +1076,670 @@ void proxy_forever(Protocol & p, std::vector<uint8_t> & initialProtoData ,int pr
 }
 
 
+// A serial port for the link: PATH[:BAUD][=TARGET]. A console server
+// connects each session on it to TARGET, host:port or a unix socket, if
+// there is one, and runs the command if not.
+struct SerialSpec {
+    std::string path;
+    uint32_t baud;
+    std::string target;
+};
+
+bool parseSerialSpec(const std::string & spec, SerialSpec & s) {
+    size_t eq = spec.find('=');
+    if (eq != std::string::npos) {
+        s.target = spec.substr(eq + 1);
+        if (s.target.empty()) {
+            return false;
+        }
+    }
+    return parseSerial(spec.substr(0,eq).c_str(),s.path,s.baud);
+}
+
+class ConsoleShard;
+
+// One serial port of a console server, and the session on it, if any. It
+// is a timer on its shard's wheel, due at the protocol's next timer event.
+struct ConsolePort : public WheelTimer {
+    
+    // An fd of the port's, that puts the port on its shard's list to be
+    // serviced when it becomes ready.
+    struct Io : public Endpoint {
+        ConsolePort * port;
+        void ioEvent(uint32_t events);
+    };
+    
+    ConsolePort(ConsoleShard & shard, const ProtocolSettings & settings, const SerialSpec & spec, int link);
+    void expire(uint64_t now);
+    
+    ConsoleShard & shard;
+    SerialSpec spec;
+    Protocol p;
+    // the tty, twice over like the link in main. data fds are -1 between
+    // sessions.
+    Io linkIn;
+    Io linkOut;
+    Io dataIn;
+    Io dataOut;
+    ChunkQueue link;
+    ChunkQueue local;
+    // for the command, TUNCLIENT_PORT says which port it is serving
+    std::vector<std::string> env;
+    std::vector<char *> envp;
+    // the session's command, or -1
+    int pid;
+    bool queued;
+    // the tty failed, so the port is out of use
+    bool dead;
+};
+
+class ConsoleServer;
+
+// One thread's share of a console server's ports, on a Reactor of its own.
+// Handlers and timers only queue their port, and afterEvents services just
+// those, so an idle port costs nothing: it has no fds ready, and while it
+// is listening the protocol has no timers. A connected one only wakes the
+// loop for what its protocol needs doing.
+class ConsoleShard : public LoopHandler, public IoHandler {
+
+    public:
+        ConsoleShard(ConsoleServer & server, int cpu);
+        ~ConsoleShard();
+
+        // Gives the shard a port, that its thread sets up when it starts.
+        void addPort(const SerialSpec & spec, int link);
+        bool catchSignals(const sigset_t & signals);
+        bool start();
+        void join();
+        // Has afterEvents look at the server again, from any thread.
+        void wake();
+        void ready(ConsolePort & c);
+
+        // the stop eventfd
+        void ioEvent(uint32_t events);
+        void signal(int signo);
+        bool afterEvents();
+
+    private:
+        ConsoleServer & server;
+        Reactor reactor;
+        TimerWheel wheel;
+        std::vector<SerialSpec> specs;
+        std::vector<int> links;
+        std::vector<ConsolePort *> ports;
+        std::vector<ConsolePort *> queue;
+        // commands of ended sessions, hung up on but not yet reaped. Each
+        // shard reaps only its own, so a pid it signals can't have been
+        // reused.
+        std::vector<int> hungUp;
+        int wakeFd;
+        int cpu;
+        pthread_t thread;
+        uint8_t buff[4096];
+
+        static void * _run(void * self);
+        void _openPorts();
+        void _closePorts();
+        bool _watch(Endpoint & e, int fd, uint32_t events);
+        bool _service(ConsolePort & c, uint64_t now);
+        bool _startSession(ConsolePort & c);
+        void _endSession(ConsolePort & c);
+        void _reap();
+        bool _busy(ConsolePort & c);
+};
+
+// tunclient -C: one process for all the ports of a console server, a session
+// on each as its peer connects, for as long as it runs.
+class ConsoleServer {
+
+    public:
+        ConsoleServer(const ProtocolSettings & settings, char ** command);
+        ~ConsoleServer();
+
+        // Serves until a signal, using shards threads, and then puts the
+        // ports back as they were.
+        void run(const std::vector<SerialSpec> & specs, const std::vector<int> & links, int shards);
+        void stop();
+        bool stopping() const;
+        // Has every shard reap the commands of its ended sessions.
+        void childExited();
+
+        const ProtocolSettings & settings;
+        char ** command;
+
+    private:
+        std::vector<ConsoleShard *> shards;
+        bool stopped;
+};
+
+void ConsolePort::Io::ioEvent(uint32_t events) {
+    Endpoint::ioEvent(events);
+    this->port->shard.ready(*this->port);
+}
+
+ConsolePort::ConsolePort(ConsoleShard & shard, const ProtocolSettings & settings, const SerialSpec & spec, int link)
+    : shard(shard) , spec(spec) , link(LINK_HIGH_WATER,LINK_LOW_WATER) , pid(-1) , queued(false) , dead(false) {
+    
+    Io * ios[4] = { &this->linkIn, &this->linkOut, &this->dataIn, &this->dataOut };
+    for(int i = 0; i < 4; i++) {
+        ios[i]->port = this;
+    }
+    this->linkIn.fd = link;
+    this->linkOut.fd = fcntl(link,F_DUPFD_CLOEXEC,0);
+    settings.apply(this->p);
+    this->p.listen();
+    
+    for(char ** e = environ; *e ; e++) {
+        if (strncmp(*e,"TUNCLIENT_PORT=",15)) {
+            this->env.push_back(*e);
+        }
+    }
+    this->env.push_back("TUNCLIENT_PORT=" + spec.path);
+    for(size_t i = 0; i < this->env.size(); i++) {
+        this->envp.push_back(&this->env[i][0]);
+    }
+    this->envp.push_back(NULL);
+}
+
+void ConsolePort::expire(uint64_t now) {
+    this->shard.ready(*this);
+}
+
+ConsoleShard::ConsoleShard(ConsoleServer & server, int cpu)
+    : server(server) , reactor(*this) , wheel(getNow()) , cpu(cpu) {
+    this->wakeFd = eventfd(0,EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!this->reactor.ok() || this->wakeFd < 0 || !this->reactor.add(this->wakeFd,this,EPOLLIN)) {
+        perror("Can't set up event loop");
+        exit(1);
+    }
+}
+
+ConsoleShard::~ConsoleShard() {
+    close(this->wakeFd);
+}
+
+bool ConsoleShard::_watch(Endpoint & e, int fd, uint32_t events) {
+    return watch(this->reactor,e,fd,events);
+}
+
+void ConsoleShard::addPort(const SerialSpec & spec, int link) {
+    this->specs.push_back(spec);
+    this->links.push_back(link);
+}
+
+// On the shard's thread, so that its ports' Protocols, and every packet
+// buffer they take, belong to the thread that uses them.
+void ConsoleShard::_openPorts() {
+    for(size_t i = 0; i < this->specs.size(); i++) {
+        ConsolePort * c = new ConsolePort(*this,this->server.settings,this->specs[i],this->links[i]);
+        this->ports.push_back(c);
+        if (!_watch(c->linkIn,nonBlocking(c->linkIn.fd),EPOLLIN)
+            || !_watch(c->linkOut,nonBlocking(c->linkOut.fd),EPOLLOUT)) {
+            perror(("Can't watch " + c->spec.path).c_str());
+            exit(1);
+        }
+    }
+}
+
+// Also on the shard's thread. The ttys themselves are the server's to put
+// back once every shard is done.
+void ConsoleShard::_closePorts() {
+    for(size_t i = 0; i < this->ports.size(); i++) {
+        ConsolePort * c = this->ports[i];
+        this->wheel.cancel(*c);
+        if (c->linkOut.fd >= 0) {
+            close(c->linkOut.fd);
+        }
+        delete c;
+    }
+    this->ports.clear();
+}
+
+bool ConsoleShard::catchSignals(const sigset_t & signals) {
+    return this->reactor.catchSignals(signals);
+}
+
+bool ConsoleShard::start() {
+    if (pthread_create(&this->thread,NULL,_run,this)) {
+        return false;
+    }
+    return pinThread(this->thread,this->cpu);
+}
+
+void ConsoleShard::join() {
+    pthread_join(this->thread,NULL);
+}
+
+void * ConsoleShard::_run(void * self) {
+    ConsoleShard * shard = static_cast<ConsoleShard *>(self);
+    shard->_openPorts();
+    shard->reactor.run();
+    shard->_closePorts();
+    return NULL;
+}
+
+void ConsoleShard::wake() {
+    uint64_t one = 1;
+    while (write(this->wakeFd,&one,sizeof(one)) < 0 && errno == EINTR) {
+    }
+}
+
+void ConsoleShard::ioEvent(uint32_t events) {
+    uint64_t count;
+    while (read(this->wakeFd,&count,sizeof(count)) > 0) {
+    }
+}
+
+void ConsoleShard::ready(ConsolePort & c) {
+    if (!c.queued) {
+        c.queued = true;
+        this->queue.push_back(&c);
+    }
+}
+
+// Only the first shard catches signals.
+void ConsoleShard::signal(int signo) {
+    if (signo == SIGCHLD) {
+        this->server.childExited();
+        return;
+    }
+    std::cerr << "Closing on signal " << signo << std::endl;
+    this->server.stop();
+}
+
+bool ConsoleShard::afterEvents() {
+    uint64_t now = getNow();
+    
+    if (this->server.stopping()) {
+        for(size_t i = 0; i < this->ports.size(); i++) {
+            _endSession(*this->ports[i]);
+        }
+        this->reactor.stop();
+        return false;
+    }
+    
+    if (!this->hungUp.empty()) {
+        _reap();
+    }
+    
+    this->wheel.advance(now);
+    
+    std::vector<ConsolePort *> todo;
+    todo.swap(this->queue);
+    for(size_t i = 0; i < todo.size(); i++) {
+        ConsolePort & c = *todo[i];
+        c.queued = false;
+        if (c.dead) {
+            continue;
+        }
+        if (!_service(c,now)) {
+            _endSession(c);
+        }
+        if (c.dead) {
+            this->wheel.cancel(c);
+            continue;
+        }
+        if (_busy(c)) {
+            ready(c);
+        }
+        uint64_t next = c.p.nextTimerEvent(now);
+        if (next == NO_TIMER_EVENT) {
+            this->wheel.cancel(c);
+        } else {
+            this->wheel.schedule(c,next);
+        }
+    }
+    
+    uint64_t next = this->wheel.nextExpiry();
+    this->reactor.setDeadline(next == NO_EXPIRY ? NO_DEADLINE : next * 1000);
+    return !this->queue.empty();
+}
+
+// One round of work on a port, as Proxy::_service does for its one
+// connection, returning false when the session on it is over.
+bool ConsoleShard::_service(ConsolePort & c, uint64_t now) {
+    
+    ssize_t n_r, n_w;
+    bool session = c.dataIn.fd >= 0;
+    
+    if (session && c.p.readyForData() && !c.link.full()) {
+        n_r = readSome(c.dataIn,this->buff,sizeof(this->buff));
+        if (!wouldBlock(n_r)) {
+            if (n_r <= 0) {
+                return false;
+            }
+            c.p.sendData(0,this->buff,n_r,now,c.link);
+        }
+    }
+    
+    n_r = readSome(c.linkIn,this->buff,sizeof(this->buff));
+    if (!wouldBlock(n_r)) {
+        if (n_r <= 0) {
+            std::cerr << c.spec.path << ": port failed, no longer serving it." << std::endl;
+            c.dead = true;
+            return false;
+        }
+        c.p.dataEvent(this->buff,n_r,now,true,c.link,c.local);
+    }
+    
+    if (!session && c.p.getState() != STATE_LISTENING) {
+        if (!_startSession(c)) {
+            return false;
+        }
+        session = true;
+    }
+    
+    if (session && !c.local.empty()) {
+        n_w = writeQueue(c.dataOut,c.local);
+        if (!wouldBlock(n_w)) {
+            if (n_w <= 0) {
+                return false;
+            }
+            c.p.dataConsumed(n_w);
+        }
+    }
+    
+    if (!c.link.empty()) {
+        n_w = writeQueue(c.linkOut,c.link);
+        if (!wouldBlock(n_w) && n_w <= 0) {
+            std::cerr << c.spec.path << ": port failed, no longer serving it." << std::endl;
+            c.dead = true;
+            return false;
+        }
+    }
+    
+    if (session) {
+        c.p.timerEvent(now,c.link);
+        if (c.p.getState() == STATE_UNINIT) {
+            std::cerr << c.spec.path << ": connection terminated." << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ConsoleShard::_startSession(ConsolePort & c) {
+    int in, out;
+    if (c.spec.target.empty()) {
+        if (!subexec(this->server.command,&c.pid,&in,&out,&c.envp[0])) {
+            std::cerr << c.spec.path << ": can't start " << this->server.command[0] << std::endl;
+            return false;
+        }
+    } else {
+        out = connectTarget(c.spec.target);
+        if (out < 0) {
+            std::cerr << c.spec.path << ": can't connect to " << c.spec.target << std::endl;
+            return false;
+        }
+        in = fcntl(out,F_DUPFD_CLOEXEC,0);
+    }
+    if (!_watch(c.dataIn,nonBlocking(out),EPOLLIN) || !_watch(c.dataOut,nonBlocking(in),EPOLLOUT)) {
+        perror("Can't watch session");
+        close(in);
+        close(out);
+        return false;
+    }
+    std::cerr << c.spec.path << ": connection established" << std::endl;
+    return true;
+}
+
+// Closes the session's fds, if it has any, hangs up on its command and
+// listens afresh with a new Protocol. A dead port's tty is left out of the
+// loop, for the server to close.
+void ConsoleShard::_endSession(ConsolePort & c) {
+    if (c.dataIn.fd >= 0) {
+        close(c.dataIn.fd);
+        close(c.dataOut.fd);
+        std::cerr << c.spec.path << ": closing connection" << std::endl;
+    }
+    if (c.pid > 0) {
+        kill(c.pid,SIGHUP);
+        this->hungUp.push_back(c.pid);
+        c.pid = -1;
+        _reap();
+    }
+    c.dataIn.fd = -1;
+    c.dataIn.readable = false;
+    c.dataIn.writable = false;
+    c.dataOut.fd = -1;
+    c.dataOut.readable = false;
+    c.dataOut.writable = false;
+    c.link.clear();
+    c.local.clear();
+    c.p = Protocol();
+    this->server.settings.apply(c.p);
+    c.p.listen();
+    
+    if (c.dead && c.linkOut.fd >= 0) {
+        this->reactor.remove(c.linkIn.fd);
+        close(c.linkOut.fd);
+        c.linkOut.fd = -1;
+    }
+}
+
+// Reaps the commands that have gone since they were hung up on. One that
+// ignores SIGHUP still finds its pipes closed, and is reaped once it goes.
+void ConsoleShard::_reap() {
+    std::vector<int>::iterator it = this->hungUp.begin();
+    while (it != this->hungUp.end()) {
+        if (waitpid(*it,NULL,WNOHANG) != 0) {
+            it = this->hungUp.erase(it);
+        } else {
+            it++;
+        }
+    }
+}
+
+// Whether the port has anything ready that the last round left undone, as
+// Proxy::_busy.
+bool ConsoleShard::_busy(ConsolePort & c) {
+    return (c.dataIn.readable && c.p.readyForData() && !c.link.full())
+           || (c.dataOut.writable && !c.local.empty())
+           || c.linkIn.readable
+           || (c.linkOut.writable && !c.link.empty());
+}
+
+ConsoleServer::ConsoleServer(const ProtocolSettings & settings, char ** command)
+    : settings(settings) , command(command) , stopped(false) {
+
+}
+
+ConsoleServer::~ConsoleServer() {
+    for(size_t i = 0; i < this->shards.size(); i++) {
+        delete this->shards[i];
+    }
+}
+
+void ConsoleServer::run(const std::vector<SerialSpec> & specs, const std::vector<int> & links, int shards) {
+    
+    // blocked here, so every thread starts with them blocked, and the first
+    // shard takes them from its signalfd.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals,SIGINT);
+    sigaddset(&signals,SIGTERM);
+    sigaddset(&signals,SIGHUP);
+    sigaddset(&signals,SIGCHLD);
+    pthread_sigmask(SIG_BLOCK,&signals,NULL);
+    
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpus = cpus > 0 ? cpus : 1;
+    for(int i = 0; i < shards; i++) {
+        this->shards.push_back(new ConsoleShard(*this,i % cpus));
+    }
+    for(size_t i = 0; i < specs.size(); i++) {
+        this->shards[i % shards]->addPort(specs[i],links[i]);
+    }
+    
+    if (!this->shards[0]->catchSignals(signals)) {
+        perror("Can't set up event loop");
+        exit(1);
+    }
+    
+    for(int i = 0; i < shards; i++) {
+        if (!this->shards[i]->start()) {
+            std::cerr << "Can't start or pin console threads." << std::endl;
+            exit(1);
+        }
+    }
+    std::cerr << "serving " << specs.size() << " ports on " << shards << " threads.\n";
+    
+    for(int i = 0; i < shards; i++) {
+        this->shards[i]->join();
+    }
+    for(size_t i = 0; i < links.size(); i++) {
+        closeSerial(links[i]);
+    }
+}
+
+void ConsoleServer::stop() {
+    __atomic_store_n(&this->stopped,true,__ATOMIC_SEQ_CST);
+    for(size_t i = 0; i < this->shards.size(); i++) {
+        this->shards[i]->wake();
+    }
+}
+
+bool ConsoleServer::stopping() const {
+    return __atomic_load_n(&this->stopped,__ATOMIC_SEQ_CST);
+}
+
+void ConsoleServer::childExited() {
+    for(size_t i = 0; i < this->shards.size(); i++) {
+        this->shards[i]->wake();
+    }
+}
+
+
 int
 main(int argc, char *argv[]) {
     
     int opt;
     int server = 0;
+    int window = 0;
+    int payload = 0;
+    unsigned int fecGroup = 0;
+    unsigned int fecDepth = 1;
+    int compress = 0;
+    // bytes of received data we are prepared to hold for a slow consumer
+    int recvBuffer = 65536;
+    // COBS frames if the link turns out to be 8-bit clean
+    int binary = 1;
+    int crc32c = 0;
+    std::vector<Forward> forwards;
+    // channel targets the peer may open at this end.
+    std::vector<std::string> allowed;
+    // serial ports for the link, in place of a command or stdin and stdout.
+    // Only a console server takes more than one.
+    std::vector<SerialSpec> serials;
+    bool console = false;
+    int shards = 0;
+    LoopOptions options = { 0, false, false, -1, -1, -1 };
 
-    while ((opt = getopt(argc, argv, "s")) != -1) {
+    while ((opt = getopt(argc, argv, "sw:m:f:zb:acL:R:tT:uP:S:Cj:")) != -1) {
         switch (opt) {
         case 's':
             server = 1;
             break;
+        case 'w':
+            window = atoi(optarg);
+            if (window <= 0) {
+                std::cerr << "Bad window size." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'm':
+            payload = atoi(optarg);
+            if (payload <= 0) {
+                std::cerr << "Bad payload size." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'z':
+            compress = 1;
+            break;
+        case 'b':
+            // 0 turns flow control off
+            recvBuffer = atoi(optarg);
+            if (recvBuffer < 0) {
+                std::cerr << "Bad receive buffer size." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'a':
+            // base64 lines only, for links that must stay text
+            binary = 0;
+            break;
+        case 'c':
+            // CRC32C frame checksums, if both ends have SSE4.2
+            crc32c = 1;
+            break;
+        case 'L':
+            // LOCAL=REMOTE[@weight], connections to the local TCP port or
+            // unix socket are carried to REMOTE at the far end.
+            forwards.push_back(Forward());
+            if (!parseForward(optarg,forwards.back())) {
+                std::cerr << "Bad forward." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'R':
+            // REMOTE, a target as in -L the peer may open channels to here.
+            // Without any, every channel the peer opens is refused.
+            allowed.push_back(optarg);
+            break;
+        case 'S':
+            // PATH[:BAUD][=TARGET]
+            serials.push_back(SerialSpec());
+            if (!parseSerialSpec(optarg,serials.back())) {
+                std::cerr << "Bad serial port." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'C':
+            // a console server: a session on each -S port as its peer
+            // connects, one after another, until signalled
+            console = true;
+            server = 1;
+            break;
+        case 'j':
+            // console server threads, by default one a cpu, up to one a port
+            shards = atoi(optarg);
+            if (shards <= 0) {
+                std::cerr << "Bad thread count." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'P':
+            // bytes of kernel buffer for pipes, within /proc/sys/fs/pipe-max-size
+            options.pipeSize = atoi(optarg);
+            if (options.pipeSize <= 0) {
+                std::cerr << "Bad pipe size." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'u':
+            // io_uring, where the kernel has what it takes
+            options.uring = true;
+            break;
+        case 't':
+            // link reader and writer threads
+            options.threads = true;
+            break;
+        case 'T':
+            // reader,writer,protocol cpus for the threads, -1 for any
+            options.threads = true;
+            if (sscanf(optarg,"%d,%d,%d",&options.readerCpu,&options.writerCpu,&options.protocolCpu) != 3) {
+                std::cerr << "Bad thread cpus." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'f':
+            // group[,depth]
+            if (sscanf(optarg,"%u,%u",&fecGroup,&fecDepth) < 1 || fecGroup < 2) {
+                std::cerr << "Bad FEC setting." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
         default: /* '?' */
             std::cerr << "Bad arguments." << std::endl;
             exit(EXIT_FAILURE);
@@ -259,22 +1750,89 @@ main(int argc, char *argv[]) {
     
     int childpid,childin,childout;
     
+    ProtocolSettings settings = { window, payload, fecGroup, fecDepth, compress, recvBuffer, binary, crc32c,
+                                  !forwards.empty() || !allowed.empty() };
+    
     Protocol p;
+    settings.apply(p);
+    
+    signal(SIGPIPE,SIG_IGN);
+    
+    // the tty straight onto the loop, saving a serialredir process and a
+    // pair of pipes. The link is written through a dup so that it is two
+    // fds, like the pipes, for epoll to watch apart.
+    if (console) {
+        bool needCommand = false;
+        for(size_t i = 0; i < serials.size(); i++) {
+            needCommand = needCommand || serials[i].target.empty();
+        }
+        if (serials.empty() || (needCommand && optind >= argc)) {
+            std::cerr << "A console server needs ports, and a command for those without a target." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        // its sessions have no channels, and its shards no link threads,
+        // io_uring or pipes of their own to size.
+        if (!forwards.empty() || !allowed.empty() || options.threads || options.uring || options.pipeSize) {
+            std::cerr << "A console server takes no -L, -R, -t, -T, -u or -P." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::vector<int> links;
+        for(size_t i = 0; i < serials.size(); i++) {
+            links.push_back(openSerial(serials[i].path.c_str(),serials[i].baud));
+            if (links.back() < 0) {
+                exit(1);
+            }
+        }
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        shards = shards ? shards : cpus > 0 ? cpus : 1;
+        shards = std::min<int>(shards,serials.size());
+        
+        ConsoleServer * consoleServer = new ConsoleServer(settings,&argv[optind]);
+        consoleServer->run(serials,links,shards);
+        delete consoleServer;
+        std::cerr << "console server stopped\n";
+        exit(0);
+    }
+    
+    if (serials.size() > 1 || (!serials.empty() && !serials[0].target.empty())) {
+        std::cerr << "Only a console server takes more than one port, or a target." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    int linkin = STDIN_FILENO;
+    int linkout = STDOUT_FILENO;
+    if (!serials.empty()) {
+        if (!server && optind < argc) {
+            std::cerr << "No command with a serial port." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        linkin = openSerial(serials[0].path.c_str(),serials[0].baud);
+        if (linkin < 0) {
+            exit(1);
+        }
+        linkout = fcntl(linkin,F_DUPFD_CLOEXEC,0);
+    }
     
     if(!server) {
-        subexec(&argv[optind],&childpid,&childin,&childout);
+        if (serials.empty()) {
+            if (!subexec(&argv[optind],&childpid,&childin,&childout)) {
+                exit(1);
+            }
+            linkin = childout;
+            linkout = childin;
+        }
         std::vector<uint8_t> initVec;
         initVec = p.connect(getNow());
-        proxy_forever(p,initVec,childout,childin,STDIN_FILENO,STDOUT_FILENO);
+        proxy_forever(p,initVec,linkin,linkout,STDIN_FILENO,STDOUT_FILENO,forwards,allowed,options);
     } else {
         int n_r;
         uint8_t buff[4096];
         p.listen();
         std::cerr << "listening for connection.\n";
         while(1) {
-            n_r = read(STDIN_FILENO,buff,sizeof(buff));
+            n_r = read(linkin,buff,sizeof(buff));
             if(n_r <= 0) {
-                std::cerr << "std in abruptly closed" << std::endl;
+                std::cerr << "link abruptly closed" << std::endl;
                 exit(1);
             }
             std::vector<uint8_t> out(buff,buff+n_r);
@@ -283,8 +1841,10 @@ main(int argc, char *argv[]) {
             
             if(p.getState() != STATE_LISTENING) {
                 std::cerr << "Connection established\n";
-                subexec(&argv[optind],&childpid,&childin,&childout);
-                proxy_forever(p,out,STDIN_FILENO,STDOUT_FILENO,childout,childin);
+                if (!subexec(&argv[optind],&childpid,&childin,&childout)) {
+                    exit(1);
+                }
+                proxy_forever(p,out,linkin,linkout,childout,childin,forwards,allowed,options);
                 return 0;
             }
             
@@ -0,0 +1,212 @@
+#include "uring.h"
+
+#include <cstring>
+#include <algorithm>
+#include <cstdlib>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int uringSetup(unsigned entries, struct io_uring_params * p) {
+    return syscall(__NR_io_uring_setup,entries,p);
+}
+
+static int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, void * arg, size_t argSize) {
+    return syscall(__NR_io_uring_enter,fd,toSubmit,minComplete,flags,arg,argSize);
+}
+
+static int uringRegister(int fd, unsigned op, void * arg, unsigned n) {
+    return syscall(__NR_io_uring_register,fd,op,arg,n);
+}
+
+Uring::Uring(unsigned entries) : enters(0) , fd(-1) , features(false) , sqRing(MAP_FAILED) , cqRing(MAP_FAILED) ,
+                                 sqes((struct io_uring_sqe *)MAP_FAILED) , toSubmit(0) {
+    
+    memset(this->opSupported,0,sizeof(this->opSupported));
+    memset(this->groups,0,sizeof(this->groups));
+    
+    struct io_uring_params p;
+    memset(&p,0,sizeof(p));
+    this->fd = uringSetup(entries,&p);
+    if (this->fd < 0) {
+        return;
+    }
+    
+    this->features = (p.features & IORING_FEAT_SINGLE_MMAP) && (p.features & IORING_FEAT_EXT_ARG)
+                     && (p.features & IORING_FEAT_RW_CUR_POS);
+    if (!this->features) {
+        return;
+    }
+    
+    // with SINGLE_MMAP the two rings share one mapping.
+    this->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    this->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    this->sqRingSize = std::max(this->sqRingSize,this->cqRingSize);
+    this->sqRing = mmap(NULL,this->sqRingSize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,this->fd,IORING_OFF_SQ_RING);
+    this->cqRing = this->sqRing;
+    this->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    this->sqes = (struct io_uring_sqe *)mmap(NULL,this->sqesSize,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,this->fd,IORING_OFF_SQES);
+    if (this->sqRing == MAP_FAILED || this->sqes == MAP_FAILED) {
+        this->features = false;
+        return;
+    }
+    
+    uint8_t * sq = (uint8_t *)this->sqRing;
+    this->sqHead = (unsigned *)(sq + p.sq_off.head);
+    this->sqTail = (unsigned *)(sq + p.sq_off.tail);
+    this->sqMask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    this->sqArray = (unsigned *)(sq + p.sq_off.array);
+    this->sqEntries = p.sq_entries;
+    uint8_t * cq = (uint8_t *)this->cqRing;
+    this->cqHead = (unsigned *)(cq + p.cq_off.head);
+    this->cqTail = (unsigned *)(cq + p.cq_off.tail);
+    this->cqMask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    this->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    
+    size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe * probe = (struct io_uring_probe *)calloc(1,probeSize);
+    if (uringRegister(this->fd,IORING_REGISTER_PROBE,probe,256) == 0) {
+        for(unsigned i = 0; i < probe->ops_len; i++) {
+            this->opSupported[probe->ops[i].op] = (probe->ops[i].flags & IO_URING_OP_SUPPORTED) != 0;
+        }
+    }
+    free(probe);
+}
+
+Uring::~Uring() {
+    for(unsigned i = 0; i < sizeof(this->groups) / sizeof(this->groups[0]); i++) {
+        if (this->groups[i].bufs) {
+            munmap(this->groups[i].bufs,(this->groups[i].mask + 1) * sizeof(struct io_uring_buf));
+        }
+    }
+    if (this->sqes != MAP_FAILED) {
+        munmap(this->sqes,this->sqesSize);
+    }
+    if (this->sqRing != MAP_FAILED) {
+        munmap(this->sqRing,this->sqRingSize);
+    }
+    if (this->fd >= 0) {
+        close(this->fd);
+    }
+}
+
+bool Uring::ok() const {
+    return this->fd >= 0 && this->features;
+}
+
+bool Uring::supports(uint8_t op) const {
+    return this->opSupported[op];
+}
+
+struct io_uring_sqe * Uring::prepare(uint8_t op, int fd, uint64_t userData) {
+    
+    unsigned tail = *this->sqTail;
+    
+    if (tail - __atomic_load_n(this->sqHead,__ATOMIC_ACQUIRE) >= this->sqEntries) {
+        return NULL;
+    }
+    
+    unsigned index = tail & this->sqMask;
+    struct io_uring_sqe * sqe = &this->sqes[index];
+    memset(sqe,0,sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = userData;
+    this->sqArray[index] = index;
+    __atomic_store_n(this->sqTail,tail + 1,__ATOMIC_RELEASE);
+    this->toSubmit++;
+    return sqe;
+}
+
+bool Uring::enter(uint64_t timeoutMicros) {
+    
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg,0,sizeof(arg));
+    
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    unsigned wait = 0;
+    if (timeoutMicros) {
+        flags |= IORING_ENTER_GETEVENTS;
+        wait = 1;
+    }
+    if (timeoutMicros && timeoutMicros != static_cast<uint64_t>(-1)) {
+        ts.tv_sec = timeoutMicros / 1000000;
+        ts.tv_nsec = (timeoutMicros % 1000000) * 1000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    arg.sigmask_sz = _NSIG / 8;
+    
+    // nothing to submit and nothing to wait for, no need to enter at all.
+    if (!this->toSubmit && !wait) {
+        return true;
+    }
+    
+    this->enters++;
+    int r = uringEnter(this->fd,this->toSubmit,wait,flags,&arg,sizeof(arg));
+    // a wait that ran out can still have submitted, so ask the ring.
+    this->toSubmit = *this->sqTail - __atomic_load_n(this->sqHead,__ATOMIC_ACQUIRE);
+    return r >= 0 || errno == ETIME || errno == EINTR || errno == EBUSY || errno == EAGAIN;
+}
+
+struct io_uring_cqe * Uring::completion() {
+    unsigned head = *this->cqHead;
+    if (head == __atomic_load_n(this->cqTail,__ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &this->cqes[head & this->cqMask];
+}
+
+void Uring::seen() {
+    __atomic_store_n(this->cqHead,*this->cqHead + 1,__ATOMIC_RELEASE);
+}
+
+bool Uring::registerBuffers(const struct iovec * iov, unsigned n) {
+    return uringRegister(this->fd,IORING_REGISTER_BUFFERS,(void *)iov,n) == 0;
+}
+
+bool Uring::addBufferGroup(uint16_t group, uint8_t * base, uint32_t size, uint16_t count) {
+    
+    if (group >= sizeof(this->groups) / sizeof(this->groups[0]) || (count & (count - 1))) {
+        return false;
+    }
+    
+    BufferGroup & g = this->groups[group];
+    void * ring = mmap(NULL,count * sizeof(struct io_uring_buf),PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+    if (ring == MAP_FAILED) {
+        return false;
+    }
+    
+    struct io_uring_buf_reg reg;
+    memset(&reg,0,sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (uringRegister(this->fd,IORING_REGISTER_PBUF_RING,&reg,1) != 0) {
+        munmap(ring,count * sizeof(struct io_uring_buf));
+        return false;
+    }
+    
+    g.bufs = (struct io_uring_buf *)ring;
+    g.base = base;
+    g.size = size;
+    g.mask = count - 1;
+    for(uint16_t i = 0; i < count; i++) {
+        provide(group,i);
+    }
+    return true;
+}
+
+// The ring's tail shares its slot with the first buffer's resv field.
+void Uring::provide(uint16_t group, uint16_t id) {
+    BufferGroup & g = this->groups[group];
+    struct io_uring_buf_ring * ring = (struct io_uring_buf_ring *)g.bufs;
+    uint16_t tail = ring->tail;
+    struct io_uring_buf * b = &g.bufs[tail & g.mask];
+    b->addr = (uint64_t)(uintptr_t)(g.base + (size_t)id * g.size);
+    b->len = g.size;
+    b->bid = id;
+    __atomic_store_n(&ring->tail,(uint16_t)(tail + 1),__ATOMIC_RELEASE);
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// Newer than some system headers. Whether the kernel has it is up to
+// Uring::supports.
+static const uint8_t URING_OP_READ_MULTISHOT = 49;
+
+// An io_uring set up with the raw system calls, for the few operations the
+// tunnel uses. SQEs are prepared, then one enter submits them all and waits
+// for completions, so a burst of I/O costs a system call or two however
+// many reads and writes it takes.
+class Uring {
+
+    public:
+        explicit Uring(unsigned entries);
+        ~Uring();
+
+        // whether the ring is up, with what we rely on: buffer rings, the
+        // current position for reads and writes, and timed waits.
+        bool ok() const;
+        bool supports(uint8_t op) const;
+
+        // A zeroed SQE for op on fd, or NULL if the queue is full and
+        // needs an enter first.
+        struct io_uring_sqe * prepare(uint8_t op, int fd, uint64_t userData);
+
+        // Submits what was prepared, then waits for a completion for up to
+        // timeoutMicros, not at all if it is 0, or without limit if it is
+        // -1. Returns false on an error other than the wait running out.
+        bool enter(uint64_t timeoutMicros);
+
+        // The next completion, which stays put until seen, or NULL.
+        struct io_uring_cqe * completion();
+        void seen();
+
+        // Fixed buffers for READ_FIXED and WRITE_FIXED, by index.
+        bool registerBuffers(const struct iovec * iov, unsigned n);
+
+        // A ring of count buffers of size bytes, from base, for reads with
+        // IOSQE_BUFFER_SELECT in group to pick from. count is a power of
+        // two. A completion names the buffer it used, which is gone from
+        // the ring until provided again.
+        bool addBufferGroup(uint16_t group, uint8_t * base, uint32_t size, uint16_t count);
+        void provide(uint16_t group, uint16_t id);
+
+        // enters so far, the only system calls the ring makes.
+        uint64_t enters;
+
+    private:
+        struct BufferGroup {
+            struct io_uring_buf * bufs;
+            uint8_t * base;
+            uint32_t size;
+            uint16_t mask;
+        };
+
+        int fd;
+        bool features;
+        uint8_t opSupported[256];
+        void * sqRing;
+        void * cqRing;
+        size_t sqRingSize;
+        size_t cqRingSize;
+        struct io_uring_sqe * sqes;
+        size_t sqesSize;
+        unsigned * sqHead;
+        unsigned * sqTail;
+        unsigned sqMask;
+        unsigned * sqArray;
+        unsigned sqEntries;
+        unsigned * cqHead;
+        unsigned * cqTail;
+        unsigned cqMask;
+        struct io_uring_cqe * cqes;
+        unsigned toSubmit;
+        BufferGroup groups[4];
+
+        Uring(const Uring &);
+        Uring & operator=(const Uring &);
+};
+
+// The buffer a completion from a buffer group used.
+static inline uint16_t uringBufferId(const struct io_uring_cqe * cqe) {
+    return cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+}
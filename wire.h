@@ -0,0 +1,122 @@
+#pragma once
+#include <stdint.h>
+
+// The wire format, and the rules of the protocol every implementation of it
+// follows: the full Protocol and the fixed size one for small boards in
+// embedded.h.
+
+enum ProtoState {
+    STATE_UNINIT,
+    STATE_LISTENING,
+    STATE_CONNECTING,
+    STATE_CONNECTED,
+};
+
+enum PacketType {
+    TYPE_PING,
+    TYPE_CON,
+    TYPE_CONACK,
+    TYPE_ACK,
+    TYPE_DATA,
+    TYPE_PARITY
+};
+
+// Options carried in the payload of CON and CONACK packets as
+// (option, length, value) triples. The CON lists what the connecting side
+// would like and the CONACK what was agreed; anything absent is off.
+enum ConnectOption {
+    // value is the parity group size and interleave depth.
+    OPT_FEC = 1,
+    // value is the log2 of the compression history window.
+    OPT_COMPRESS = 2,
+    // value is the sender's receive buffer size in bytes, 4 bytes little
+    // endian. Flow control is on if both sides send it. The credit field
+    // covers channel 0, and every other channel has credit of its own, a
+    // buffer's worth from when it opens and then as CHANNEL_CREDIT says.
+    OPT_FLOW = 3,
+    // the sender can receive COBS framed packets, no value. Each direction
+    // switches to them once its probe is known to have got through intact.
+    OPT_FRAMING = 4,
+    // value is 1 to check frames with CRC32C rather than CRC32. Only
+    // offered and agreed by hosts that compute it in hardware.
+    OPT_CHECKSUM = 5,
+    // value is the largest DATA payload the sender can take, 2 bytes little
+    // endian, then how many DATA packets past the next expected one it can
+    // hold, 1 byte. Sent by peers with less room than MAX_PAYLOAD_SIZE and
+    // MAX_WINDOW_SIZE, and obeyed for the connection.
+    OPT_LIMITS = 6,
+    // the sender takes DATA whose header carries an attempt number, and
+    // echoes it in its ACKs, no value. Peers that don't send it compare
+    // the whole header word with the packet type, so retransmissions to
+    // them go out as attempt 0.
+    OPT_ATTEMPTS = 7,
+    // the sender takes DATA with FLAG_ACK and an ACK ahead of the payload,
+    // no value. Peers that don't send it get ACKs of their own.
+    OPT_PIGGYBACK = 8,
+    // the sender takes DATA on channels other than 0 and channel control
+    // messages, no value. Channels are only opened if both sides send it.
+    OPT_CHANNELS = 9
+};
+
+// How packets are framed on the wire. Base64 lines get through anything that
+// passes text, COBS frames delimited by a zero byte need an 8-bit clean link
+// but cost a third as much.
+enum Framing {
+    FRAMING_BASE64,
+    FRAMING_BINARY
+};
+
+enum PacketFlags {
+    // A cumulative ACK is prepended to the payload of this packet.
+    FLAG_ACK = 0x01,
+    // The payload is the next part of the compressed stream.
+    FLAG_COMPRESSED = 0x02,
+    // The payload is a channel control message rather than channel data.
+    FLAG_CONTROL = 0x04,
+    // The senders receive credit follows the header and any ACK.
+    FLAG_CREDIT = 0x08,
+    // A PING carrying every byte value, always COBS framed, to find out
+    // whether the link is 8-bit clean.
+    FLAG_PROBE = 0x10,
+    // The sender has received our probe intact, so we may send COBS frames.
+    FLAG_CLEAN = 0x20,
+    // The frame checksum is CRC32C.
+    FLAG_CRC32C = 0x40
+};
+
+// Channel control messages, sent as reliable DATA packets with FLAG_CONTROL
+// set on the channel they refer to. The first payload byte is the op.
+enum ChannelOp {
+    // followed by the channel weight and the target the peer should connect
+    // the channel to.
+    CHANNEL_OPEN = 1,
+    // the sender will send no more data on the channel.
+    CHANNEL_CLOSE = 2,
+    // followed by the total number of bytes the sender will take on the
+    // channel, 4 bytes little endian, as the credit field for channel 0.
+    CHANNEL_CREDIT = 3
+};
+
+// Channel 0 is always open. Further channels are numbered by whoever opens
+// them, odd for the connecting side and even for the listener, so both ends
+// can open channels at once without clashing.
+static const uint32_t MAX_CHANNELS = 256;
+
+// Bounds on the retransmission timeout in ms.
+static const uint64_t MIN_RETRANSMIT_TIMEOUT = 50;
+static const uint64_t MAX_RETRANSMIT_TIMEOUT = 5000;
+static const uint32_t MAX_BACKOFF_SHIFT = 6;
+
+// Payload size limits for DATA packets.
+static const uint32_t MIN_PAYLOAD_SIZE = 16;
+static const uint32_t MAX_PAYLOAD_SIZE = 2048;
+
+// Largest number of DATA packets that may be outstanding, and how far past
+// expectedDataSeqnum the receiver will buffer out of order packets.
+static const uint32_t MAX_WINDOW_SIZE = 256;
+
+// Probes sent before giving up on binary framing for the connection.
+static const uint32_t MAX_PROBES = 4;
+
+// Checksum, header, ACK and credit bytes ahead of a packet's payload.
+static const uint32_t MAX_HEADER_SIZE = 12 + 5 + 4;